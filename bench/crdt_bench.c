@@ -0,0 +1,361 @@
+/**
+** Throughput benchmark for the uuid, hlc and crdt extensions.
+**
+** Links the vendored SQLite amalgamation and loads ./uuid, ./hlc and ./crdt
+** (run it from the repository root). For every row count it measures
+**
+**     view_insert, view_update, view_delete   local writes through a view
+**     hlc_now, hlc_compare, hlc_parse         HLC functions called from SQL
+**     remote_apply                            crdt_apply_changes of the log
+**     sync_round_trip                         crdt_changes_since both ways
+**
+** and prints one JSON object per line with the number of ops, ops per
+** second, p50/p99 latency in microseconds and the database size:
+**
+**     make bench BENCH_ROWS="10000 1000000 10000000"
+**     ./bench/crdt_bench [rows ...]
+**
+** Local writes commit every BATCH_OPS ops. Latencies are per op, except for
+** remote_apply where a sample is a batch of BATCH_OPS changes and for
+** sync_round_trip where it is one round trip, "batch" says how many ops a
+** sample covers. Databases are written to crdt_bench_*.db in the current
+** directory and removed afterwards.
+*/
+
+#include "sqlite3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ROWS 10000
+#define BATCH_OPS 1000
+#define SYNC_ROUNDS 100
+#define SYNC_WRITES 10
+
+static const char* NODE_A = "3afeb0e0-d9a6-424b-b60d-af86c06a4799";
+static const char* NODE_B = "7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60";
+static const char* SAMPLE_HLC = "2024-06-15T12:34:56.789Z-00FF-3afeb0e0-d9a6-424b-b60d-af86c06a4799";
+static const char* OTHER_HLC = "2024-06-15T12:34:56.789Z-0100-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60";
+
+typedef struct {
+    float* samples; // Microseconds
+    long count;
+    long cap;
+} Latencies;
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void latenciesAdd(Latencies* lat, double seconds) {
+    if (lat->count == lat->cap) {
+        lat->cap = lat->cap ? lat->cap * 2 : 4096;
+        lat->samples = (float*)realloc(lat->samples, (size_t)lat->cap * sizeof(float));
+        if (lat->samples == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    lat->samples[lat->count++] = (float)(seconds * 1e6);
+}
+
+static int compareFloat(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(Latencies* lat, double p) {
+    if (lat->count == 0) {
+        return 0;
+    }
+    long i = (long)(p * (double)(lat->count - 1) + 0.5);
+    return lat->samples[i];
+}
+
+static void fail(sqlite3* db, const char* what) {
+    fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+    exit(1);
+}
+
+static void exec(sqlite3* db, const char* sql) {
+    char* err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, err);
+        exit(1);
+    }
+}
+
+static sqlite3_stmt* prepare(sqlite3* db, const char* sql) {
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fail(db, sql);
+    }
+    return stmt;
+}
+
+// Step stmt to the end and reset it, returns the time it took
+static double run(sqlite3* db, sqlite3_stmt* stmt) {
+    double start = nowSeconds();
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    }
+    double took = nowSeconds() - start;
+    if (rc != SQLITE_DONE || sqlite3_reset(stmt) != SQLITE_OK) {
+        fail(db, sqlite3_sql(stmt));
+    }
+    return took;
+}
+
+static sqlite3_int64 queryInt(sqlite3* db, const char* sql) {
+    sqlite3_stmt* stmt = prepare(db, sql);
+    sqlite3_int64 value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static sqlite3_int64 dbBytes(sqlite3* db) {
+    return queryInt(db, "SELECT page_count * page_size FROM pragma_page_count, pragma_page_size");
+}
+
+static void removeDb(const char* path) {
+    char name[256];
+    remove(path);
+    snprintf(name, sizeof(name), "%s-wal", path);
+    remove(name);
+    snprintf(name, sizeof(name), "%s-shm", path);
+    remove(name);
+}
+
+static sqlite3* openDb(const char* path, const char* node) {
+    sqlite3* db = NULL;
+    removeDb(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        fail(db, path);
+    }
+    sqlite3_enable_load_extension(db, 1);
+    static const char* extensions[] = { "./uuid", "./hlc", "./crdt" };
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        char* err = NULL;
+        if (sqlite3_load_extension(db, extensions[i], NULL, &err) != SQLITE_OK) {
+            fprintf(stderr, "loading %s: %s\n", extensions[i], err);
+            exit(1);
+        }
+    }
+    exec(db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;");
+    char* sql = sqlite3_mprintf("SELECT crdt_create(%Q); SELECT crdt_create_table('bench', %Q);", node, node);
+    exec(db, sql);
+    sqlite3_free(sql);
+    return db;
+}
+
+static void report(const char* bench, long rows, long ops, long batch, double seconds, Latencies* lat,
+                   sqlite3_int64 bytes) {
+    qsort(lat->samples, (size_t)lat->count, sizeof(float), compareFloat);
+    printf("{\"bench\":\"%s\",\"rows\":%ld,\"ops\":%ld,\"batch\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"db_bytes\":%lld}\n",
+           bench, rows, ops, batch, seconds, seconds > 0 ? ops / seconds : 0, percentile(lat, 0.50),
+           percentile(lat, 0.99), (long long)bytes);
+    fflush(stdout);
+    lat->count = 0;
+}
+
+// Run stmt once per row with ?1 the row id and ?2 the row number,
+// committing every BATCH_OPS rows. check counts the rows that show the
+// writes, it has to find one per op or the run is not reported.
+static void benchWrites(sqlite3* db, const char* bench, const char* sql, const char* check, long rows, long step,
+                        Latencies* lat) {
+    sqlite3_stmt* stmt = prepare(db, sql);
+    char id[32];
+    long ops = 0;
+    double start = nowSeconds();
+    exec(db, "BEGIN");
+    for (long i = 0; i < rows; i += step) {
+        snprintf(id, sizeof(id), "r%ld", i);
+        sqlite3_bind_text(stmt, 1, id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, i);
+        latenciesAdd(lat, run(db, stmt));
+        if (++ops % BATCH_OPS == 0) {
+            exec(db, "COMMIT; BEGIN");
+        }
+    }
+    exec(db, "COMMIT");
+    double seconds = nowSeconds() - start;
+    sqlite3_finalize(stmt);
+    sqlite3_int64 changed = queryInt(db, check);
+    if (changed != ops) {
+        fprintf(stderr, "%s: %lld of %ld rows changed\n", bench, (long long)changed, ops);
+        exit(1);
+    }
+    report(bench, rows, ops, 1, seconds, lat, dbBytes(db));
+}
+
+// Run a one row SELECT of HLC functions rows times, ?1 and ?2 are HLCs
+// and ?3 a node_id
+static void benchHlc(sqlite3* db, const char* bench, const char* sql, long rows, Latencies* lat) {
+    sqlite3_stmt* stmt = prepare(db, sql);
+    sqlite3_bind_text(stmt, 1, SAMPLE_HLC, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, OTHER_HLC, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, NODE_A, -1, SQLITE_STATIC);
+    double start = nowSeconds();
+    for (long i = 0; i < rows; i++) {
+        latenciesAdd(lat, run(db, stmt));
+    }
+    double seconds = nowSeconds() - start;
+    sqlite3_finalize(stmt);
+    report(bench, rows, rows, 1, seconds, lat, 0);
+}
+
+// Apply the change log of a to b as JSON batches of BATCH_OPS changes
+static void benchRemoteApply(sqlite3* a, sqlite3* b, long rows, Latencies* lat) {
+    sqlite3_stmt* read = prepare(a,
+        "SELECT json_group_array(json_object('pk', pk, 'tbl', tbl, 'data', json(data), 'path', path, 'op', op,"
+        " 'hlc', hlc)), max(rowid), count(*)"
+        " FROM (SELECT rowid, * FROM crdt_changes WHERE rowid > ?1 ORDER BY rowid LIMIT ?2)");
+    sqlite3_stmt* apply = prepare(b, "SELECT crdt_apply_changes(?1)");
+    sqlite3_int64 last = 0;
+    long ops = 0;
+    double seconds = 0;
+    for (;;) {
+        sqlite3_bind_int64(read, 1, last);
+        sqlite3_bind_int(read, 2, BATCH_OPS);
+        if (sqlite3_step(read) != SQLITE_ROW) {
+            fail(a, "reading crdt_changes");
+        }
+        long count = (long)sqlite3_column_int64(read, 2);
+        if (count == 0) {
+            sqlite3_reset(read);
+            break;
+        }
+        last = sqlite3_column_int64(read, 1);
+        sqlite3_bind_value(apply, 1, sqlite3_column_value(read, 0));
+        double took = run(b, apply);
+        sqlite3_reset(read);
+        latenciesAdd(lat, took);
+        seconds += took;
+        ops += count;
+    }
+    sqlite3_finalize(read);
+    sqlite3_finalize(apply);
+    report("remote_apply", rows, ops, BATCH_OPS, seconds, lat, dbBytes(b));
+}
+
+// Send the changes logged on from since the last call to to, through the
+// crdt_changes_since watermark of peer. to then acks what it logged as
+// sent to node, so the changes do not echo back. Without to only the
+// watermark moves.
+static void syncChanges(sqlite3* from, sqlite3* to, const char* node, const char* peer) {
+    sqlite3_stmt* read = prepare(from,
+        "SELECT json_group_array(json_object('pk', pk, 'tbl', tbl, 'data', json(data), 'path', path, 'op', op,"
+        " 'hlc', hlc)) FROM crdt_changes_since(?1)");
+    sqlite3_bind_text(read, 1, peer, -1, SQLITE_STATIC);
+    if (sqlite3_step(read) != SQLITE_ROW) {
+        fail(from, "crdt_changes_since");
+    }
+    if (to != NULL) {
+        sqlite3_stmt* apply = prepare(to, "SELECT crdt_apply_changes(?1)");
+        sqlite3_bind_value(apply, 1, sqlite3_column_value(read, 0));
+        run(to, apply);
+        sqlite3_finalize(apply);
+        sqlite3_stmt* ack = prepare(to, "SELECT crdt_ack(?1, (SELECT max(id) FROM crdt_changes))");
+        sqlite3_bind_text(ack, 1, node, -1, SQLITE_STATIC);
+        run(to, ack);
+        sqlite3_finalize(ack);
+    }
+    sqlite3_finalize(read);
+}
+
+// Round trips of SYNC_WRITES local updates on a sent to b, then on b sent
+// back to a. The updates take a new HLC, an UPDATE of the view keeps the
+// old one unless hlc is set. a and b update different rows to -1 - round
+// and have to end up with the same records.
+static void benchSync(sqlite3* a, sqlite3* b, long rows, Latencies* lat) {
+    sqlite3* dbs[2] = { a, b };
+    sqlite3_stmt* update[2];
+    for (int d = 0; d < 2; d++) {
+        update[d] = prepare(dbs[d], "UPDATE bench SET data = json_object('n', -1 - ?2), hlc = NULL WHERE id = ?1");
+    }
+    const char* nodes[2] = { NODE_A, NODE_B };
+    char id[32];
+    double seconds = 0;
+    // Move the watermarks past the changes remote_apply already sent
+    for (int d = 0; d < 2; d++) {
+        syncChanges(dbs[d], NULL, nodes[d], nodes[1 - d]);
+    }
+    for (long round = 0; round < SYNC_ROUNDS; round++) {
+        double start = nowSeconds();
+        for (int d = 0; d < 2; d++) {
+            exec(dbs[d], "BEGIN");
+            for (long w = 0; w < SYNC_WRITES; w++) {
+                long row = ((round * SYNC_WRITES + w) * 7919 + d * (rows / 2)) % (rows - 1);
+                if (row % 10 == 0) {
+                    row++; // view_delete deleted every 10th row
+                }
+                snprintf(id, sizeof(id), "r%ld", row);
+                sqlite3_bind_text(update[d], 1, id, -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(update[d], 2, round);
+                run(dbs[d], update[d]);
+            }
+            exec(dbs[d], "COMMIT");
+            syncChanges(dbs[d], dbs[1 - d], nodes[d], nodes[1 - d]);
+        }
+        double took = nowSeconds() - start;
+        latenciesAdd(lat, took);
+        seconds += took;
+    }
+    for (int d = 0; d < 2; d++) {
+        sqlite3_finalize(update[d]);
+    }
+    const char* check = "SELECT total(data ->> 'n') FROM bench WHERE data ->> 'n' < 0";
+    sqlite3_int64 sums[2] = { queryInt(a, check), queryInt(b, check) };
+    if (sums[0] != sums[1] || sums[0] == 0) {
+        fprintf(stderr, "sync_round_trip: records differ after the round trips\n");
+        exit(1);
+    }
+    report("sync_round_trip", rows, SYNC_ROUNDS, 1, seconds, lat, dbBytes(b));
+}
+
+static void benchRows(long rows, Latencies* lat) {
+    sqlite3* a = openDb("crdt_bench_a.db", NODE_A);
+    benchWrites(a, "view_insert", "INSERT INTO bench (id, data) VALUES (?1, json_object('n', ?2, 'name', 'row ' || ?2))",
+                "SELECT count(*) FROM bench WHERE data ->> 'n' = CAST(substr(id, 2) AS INTEGER)", rows, 1, lat);
+    // Without hlc = NULL the change keeps the HLC of the record and loses
+    benchWrites(a, "view_update", "UPDATE bench SET data = json_object('n', ?2 + 1), hlc = NULL WHERE id = ?1",
+                "SELECT count(*) FROM bench WHERE data ->> 'n' = CAST(substr(id, 2) AS INTEGER) + 1", rows, 1, lat);
+    benchWrites(a, "view_delete", "DELETE FROM bench WHERE id = ?1",
+                "SELECT count(*) FROM crdt_records WHERE tbl = 'bench' AND deleted", rows, 10, lat);
+
+    benchHlc(a, "hlc_now", "SELECT hlc_now(?3)", rows, lat);
+    benchHlc(a, "hlc_compare", "SELECT hlc_compare(?1, ?2)", rows, lat);
+    benchHlc(a, "hlc_parse", "SELECT hlc_parse(?1)", rows, lat);
+
+    sqlite3* b = openDb("crdt_bench_b.db", NODE_B);
+    benchRemoteApply(a, b, rows, lat);
+    benchSync(a, b, rows, lat);
+
+    sqlite3_close(a);
+    sqlite3_close(b);
+    removeDb("crdt_bench_a.db");
+    removeDb("crdt_bench_b.db");
+}
+
+int main(int argc, char** argv) {
+    Latencies lat = { NULL, 0, 0 };
+    if (argc < 2) {
+        benchRows(DEFAULT_ROWS, &lat);
+    }
+    for (int i = 1; i < argc; i++) {
+        long rows = atol(argv[i]);
+        if (rows < 10) {
+            fprintf(stderr, "usage: %s [rows ...], at least 10 rows\n", argv[0]);
+            return 1;
+        }
+        benchRows(rows, &lat);
+    }
+    free(lat.samples);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/**
+** Microbenchmark for the HLC parser in hlc.c.
+**
+** Measures parses per second for the original allocating hlc_parse path
+** (strptime + malloc) and for hlc_parse_into, which decodes canonical HLC
+** strings into a stack Hlc without allocating.
+**
+**     make bench/hlc_parse && ./bench/hlc_parse [iterations]
+*/
+
+#include "../hlc.c"
+
+#define DEFAULT_ITERATIONS 1000000
+
+static const char* SAMPLES[] = {
+    "2024-01-01T00:00:00.000Z-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799",
+    "2024-06-15T12:34:56.789Z-00FF-3afeb0e0-d9a6-424b-b60d-af86c06a4799",
+    "2025-03-09T23:59:59.999-0001-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60",
+    "1999-12-31T23:59:59.500-FFFE-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60",
+};
+#define SAMPLE_COUNT (sizeof(SAMPLES) / sizeof(SAMPLES[0]))
+
+static double elapsedSeconds(struct timespec* start, struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    struct timespec start, end;
+    int64_t checksum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        Hlc* hlc = hlc_parse(SAMPLES[i % SAMPLE_COUNT]);
+        if (hlc == NULL) {
+            fprintf(stderr, "hlc_parse failed\n");
+            return 1;
+        }
+        checksum += hlc->dateTime + hlc->counter;
+        hlc_free(hlc);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double slow = elapsedSeconds(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        Hlc hlc;
+        if (hlc_parse_into(SAMPLES[i % SAMPLE_COUNT], &hlc) != 0) {
+            fprintf(stderr, "hlc_parse_into failed\n");
+            return 1;
+        }
+        checksum -= hlc.dateTime + hlc.counter;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double fast = elapsedSeconds(&start, &end);
+
+    if (checksum != 0) {
+        fprintf(stderr, "fast and slow parsers disagree\n");
+        return 1;
+    }
+
+    printf("hlc_parse      %12.0f parses/sec\n", iterations / slow);
+    printf("hlc_parse_into %12.0f parses/sec\n", iterations / fast);
+    printf("speedup        %12.1fx\n", slow / fast);
+    return 0;
+}
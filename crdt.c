@@ -5,6 +5,8 @@ SQLITE_EXTENSION_INIT1
 #include <stdlib.h> // Needed for sqlite3_free used indirectly by sqlite3_mprintf
 #include <stdio.h>  // Keep for potential debugging printf statements if uncommented
 
+#include "jsonb.h"
+
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
 #else
@@ -40,270 +42,4566 @@ static int execute_sql(sqlite3_context *context, sqlite3 *db, char *sql) {
     return SQLITE_OK;
 }
 
+// Options accepted by crdt_create as a space or comma separated list
+#define CRDT_OPT_PACKED_HLC 0x01 // Store HLCs as hlc_pack() blobs
+#define CRDT_OPT_PATH_CLOCKS 0x02 // Keep a clock per JSON path in crdt_clocks
+#define CRDT_OPT_ROWID_CHANGES 0x04 // Key crdt_changes by an INTEGER PRIMARY KEY
+#define CRDT_OPT_DIGEST 0x08 // Keep hashes of crdt_changes by HLC time in crdt_digest
+#define CRDT_OPT_NODES 0x10 // Index crdt_changes by crdt_node() integers instead of node_id text
 
-static void crdt_create(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 1) {
-        sqlite3_result_error(context, "crdt_create requires 1 argument", -1);
+typedef struct {
+    const char *name;
+    unsigned int flag;
+} CrdtOption;
+
+static const CrdtOption crdt_create_options[] = {
+    { "packed", CRDT_OPT_PACKED_HLC },
+    { "text", 0 },
+    { "paths", CRDT_OPT_PATH_CLOCKS },
+    { "records", 0 },
+    { "rowid", CRDT_OPT_ROWID_CHANGES },
+    { "digest", CRDT_OPT_DIGEST },
+    { "nodes", CRDT_OPT_NODES },
+    { NULL, 0 }
+};
+
+// Options accepted by crdt_create_table and crdt_create_tables
+#define CRDT_OPT_DEDICATED 0x01 // Keep the records in <tbl>_records
+#define CRDT_OPT_COUNTERS 0x02 // Log '+' and '-' writes as PN-counter changes
+
+static const CrdtOption crdt_create_table_options[] = {
+    { "dedicated", CRDT_OPT_DEDICATED },
+    { "counters", CRDT_OPT_COUNTERS },
+    { "shared", 0 },
+    { NULL, 0 }
+};
+
+// Parse a list of option keywords into a bitmask of flags. Returns
+// SQLITE_OK, or SQLITE_ERROR with an error already set on the context.
+static int parse_options(sqlite3_context *context, const CrdtOption *options, const char *text, unsigned int *flags) {
+    *flags = 0;
+    if (text == NULL) {
+        return SQLITE_OK;
+    }
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '\0') break;
+        size_t len = strcspn(p, " ,");
+        const CrdtOption *opt = options;
+        while (opt->name != NULL && (strlen(opt->name) != len || sqlite3_strnicmp(opt->name, p, (int)len) != 0)) {
+            opt++;
+        }
+        if (opt->name == NULL) {
+            char *err = sqlite3_mprintf("Unknown option: %.*s", (int)len, p);
+            sqlite3_result_error(context, err ? err : "Unknown option", -1);
+            sqlite3_free(err);
+            return SQLITE_ERROR;
+        }
+        *flags |= opt->flag;
+        p += len;
+    }
+    return SQLITE_OK;
+}
+
+// Read a value from crdt_kv, returns a string owned by the caller (free with
+// sqlite3_free) or NULL if the key or the table does not exist.
+static char *get_kv(sqlite3 *db, const char *key) {
+    sqlite3_stmt *stmt = NULL;
+    char *value = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM crdt_kv WHERE key = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        value = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+// Returns non-zero if crdt_create was called with the 'packed' option
+static int uses_packed_hlc(sqlite3 *db) {
+    char *format = get_kv(db, "hlc_format");
+    int packed = format != NULL && strcmp(format, "packed") == 0;
+    sqlite3_free(format);
+    return packed;
+}
+
+// Returns non-zero if crdt_create was called with the 'paths' option
+static int uses_path_clocks(sqlite3 *db) {
+    char *clocks = get_kv(db, "clocks");
+    int paths = clocks != NULL && strcmp(clocks, "paths") == 0;
+    sqlite3_free(clocks);
+    return paths;
+}
+
+// Returns non-zero if crdt_create made crdt_changes with the 'rowid' option
+static int uses_rowid_changes(sqlite3 *db) {
+    sqlite3_stmt *stmt = NULL;
+    int rowid = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('crdt_changes') WHERE name = 'id' AND type = 'INTEGER' AND pk = 1",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    rowid = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return rowid;
+}
+
+// Returns non-zero if crdt_create made crdt_digest with the 'digest' option
+static int uses_digest(sqlite3 *db) {
+    return sqlite3_table_column_metadata(db, "main", "crdt_digest", NULL, NULL, NULL, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+// Returns non-zero if crdt_create made crdt_changes with the 'nodes' option
+static int uses_node_numbers(sqlite3 *db) {
+    return sqlite3_table_column_metadata(db, "main", "crdt_changes", "node", NULL, NULL, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+// crdt_create notes the layout of its tables and triggers as 'schema_version'
+// in crdt_kv. Bump it whenever crdt_create changes them in a way the other
+// functions depend on, databases with an older one have to run crdt_create
+// again first.
+#define CRDT_SCHEMA_VERSION 1
+
+// Returns non-zero if crdt_create laid out the tables with the current
+// schema version, 0 for older databases and databases without crdt_kv
+static int crdt_schema_current(sqlite3 *db) {
+    sqlite3_stmt *stmt = NULL;
+    int current = 0;
+    if (sqlite3_prepare_v2(db, "SELECT value >= ?1 FROM crdt_kv WHERE key = 'schema_version'", -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, CRDT_SCHEMA_VERSION);
+    current = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return current;
+}
+
+// Returns an error message if the crdt_create tables have no crdt_counters
+// yet for 'counters' tables
+static const char *crdt_counters_error(sqlite3 *db) {
+    return crdt_schema_current(db) ? NULL : "'counters' tables need the crdt tables from crdt_create, run crdt_create again to upgrade them";
+}
+
+static void crdt_free_names(char **names, int count) {
+    for (int i = 0; i < count; i++) {
+        sqlite3_free(names[i]);
+    }
+    sqlite3_free(names);
+}
+
+// Names of the tables created with the 'dedicated' option, sorted, or NULL
+// if there are none. *count is -1 if they could not be read. Free with
+// crdt_free_names.
+static char **crdt_dedicated_tables(sqlite3 *db, int *count) {
+    sqlite3_stmt *stmt = NULL;
+    char **names = NULL;
+    int cap = 0;
+    *count = 0;
+    // 'dedicated;' is the first key after every 'dedicated:' key
+    if (sqlite3_prepare_v2(db,
+            "SELECT substr(key, 11) FROM crdt_kv WHERE key > 'dedicated:' AND key < 'dedicated;' ORDER BY 1",
+            -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL; // No crdt_kv, so no dedicated tables
+    }
+    int rc = SQLITE_OK;
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 8;
+            char **grown = (char **)sqlite3_realloc64(names, (sqlite3_uint64)cap * sizeof(char *));
+            if (grown == NULL) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            names = grown;
+        }
+        names[*count] = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+        if (names[*count] == NULL) {
+            rc = SQLITE_NOMEM;
+        } else {
+            (*count)++;
+        }
+    }
+    if (sqlite3_finalize(stmt) != SQLITE_OK || rc != SQLITE_OK) {
+        crdt_free_names(names, *count);
+        *count = -1;
+        return NULL;
+    }
+    return names;
+}
+
+// Returns non-zero if tbl was created with the 'dedicated' option
+static int crdt_is_dedicated(sqlite3 *db, const char *tbl) {
+    char *key = sqlite3_mprintf("dedicated:%s", tbl);
+    char *value = key ? get_kv(db, key) : NULL;
+    sqlite3_free(key);
+    sqlite3_free(value);
+    return value != NULL;
+}
+
+// Returns non-zero if column of table is a VIRTUAL generated column, tables
+// from before the crdt indexes kept deleted and node_id VIRTUAL.
+static int is_virtual_column(sqlite3 *db, const char *table, const char *column) {
+    sqlite3_stmt *stmt = NULL;
+    int is_virtual = 0;
+    if (sqlite3_prepare_v2(db, "SELECT hidden FROM pragma_table_xinfo(?1) WHERE name = ?2", -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        is_virtual = sqlite3_column_int(stmt, 0) == 2;
+    }
+    sqlite3_finalize(stmt);
+    return is_virtual;
+}
+
+#define LARGEST_INT64 ((sqlite3_int64)0x7FFFFFFFFFFFFFFFLL)
+#define SMALLEST_INT64 (-LARGEST_INT64 - 1)
+
+// Operators a change can apply to a record, see crdt_merge
+typedef enum {
+    CRDT_OP_ASSIGN,  // '='
+    CRDT_OP_SET,
+    CRDT_OP_INSERT,
+    CRDT_OP_PATCH,
+    CRDT_OP_REMOVE,
+    CRDT_OP_REPLACE,
+    CRDT_OP_ADD,     // '+'
+    CRDT_OP_SUB,     // '-'
+    CRDT_OP_MUL,     // '*'
+    CRDT_OP_DIV,     // '/'
+    CRDT_OP_MOD,     // '%'
+    CRDT_OP_AND,     // '&'
+    CRDT_OP_OR,      // '|'
+    CRDT_OP_CONCAT,  // '||'
+    CRDT_OP_UNKNOWN  // Anything else leaves the record unchanged
+} CrdtOp;
+
+static const struct {
+    const char *name;
+    CrdtOp op;
+} crdt_ops[] = {
+    { "=", CRDT_OP_ASSIGN },
+    { "set", CRDT_OP_SET },
+    { "insert", CRDT_OP_INSERT },
+    { "patch", CRDT_OP_PATCH },
+    { "remove", CRDT_OP_REMOVE },
+    { "replace", CRDT_OP_REPLACE },
+    { "+", CRDT_OP_ADD },
+    { "-", CRDT_OP_SUB },
+    { "*", CRDT_OP_MUL },
+    { "/", CRDT_OP_DIV },
+    { "%", CRDT_OP_MOD },
+    { "&", CRDT_OP_AND },
+    { "|", CRDT_OP_OR },
+    { "||", CRDT_OP_CONCAT },
+    { NULL, CRDT_OP_UNKNOWN }
+};
+
+static CrdtOp crdt_op_lookup(const char *name) {
+    for (int i = 0; name != NULL && crdt_ops[i].name != NULL; i++) {
+        if (strcmp(crdt_ops[i].name, name) == 0) {
+            return crdt_ops[i].op;
+        }
+    }
+    return CRDT_OP_UNKNOWN;
+}
+
+// Convert a number to an integer the way SQLite casts a REAL
+static sqlite3_int64 crdt_number_to_int(const JsonbNumber *num) {
+    if (num->type == JSONB_VALUE_INT) {
+        return num->i;
+    }
+    if (num->r <= -9223372036854775808.0) {
+        return SMALLEST_INT64;
+    }
+    if (num->r >= 9223372036854775807.0) {
+        return LARGEST_INT64;
+    }
+    return (sqlite3_int64)num->r;
+}
+
+// Apply an arithmetic operator with SQL semantics: integers stay integers
+// unless they overflow, division by zero and NULL operands give NULL.
+// Appends the resulting JSONB element to out.
+static void crdt_arithmetic(CrdtOp op, const JsonbNumber *a, const JsonbNumber *b, JsonbBuf *out) {
+    if (a->type == JSONB_VALUE_NULL || b->type == JSONB_VALUE_NULL) {
+        jsonb_append_node(out, JSONB_NULL, NULL, 0);
         return;
     }
-    const char *node_id = (const char *)sqlite3_value_text(argv[0]);
+    if (op == CRDT_OP_AND || op == CRDT_OP_OR) {
+        sqlite3_int64 x = crdt_number_to_int(a), y = crdt_number_to_int(b);
+        jsonb_append_int(out, op == CRDT_OP_AND ? (x & y) : (x | y));
+        return;
+    }
+    if (op == CRDT_OP_MOD) {
+        sqlite3_int64 x = crdt_number_to_int(a), y = crdt_number_to_int(b);
+        if (y == 0) {
+            jsonb_append_node(out, JSONB_NULL, NULL, 0);
+            return;
+        }
+        sqlite3_int64 r = y == -1 ? 0 : x % y;
+        if (a->type == JSONB_VALUE_REAL || b->type == JSONB_VALUE_REAL) {
+            jsonb_append_real(out, (double)r);
+        } else {
+            jsonb_append_int(out, r);
+        }
+        return;
+    }
+    if (a->type == JSONB_VALUE_INT && b->type == JSONB_VALUE_INT) {
+        sqlite3_int64 x = a->i, y = b->i, r;
+        int overflow = 0;
+        switch (op) {
+            case CRDT_OP_ADD:
+                overflow = (y > 0 && x > LARGEST_INT64 - y) || (y < 0 && x < SMALLEST_INT64 - y);
+                r = overflow ? 0 : x + y;
+                break;
+            case CRDT_OP_SUB:
+                overflow = (y < 0 && x > LARGEST_INT64 + y) || (y > 0 && x < SMALLEST_INT64 + y);
+                r = overflow ? 0 : x - y;
+                break;
+            case CRDT_OP_MUL:
+                if (x > 0) {
+                    overflow = y > 0 ? x > LARGEST_INT64 / y : y < SMALLEST_INT64 / x;
+                } else if (x < 0) {
+                    overflow = y > 0 ? x < SMALLEST_INT64 / y : y < LARGEST_INT64 / x;
+                }
+                r = overflow ? 0 : x * y;
+                break;
+            default:
+                if (y == 0) {
+                    jsonb_append_node(out, JSONB_NULL, NULL, 0);
+                    return;
+                }
+                overflow = x == SMALLEST_INT64 && y == -1;
+                r = overflow ? 0 : x / y;
+                break;
+        }
+        if (!overflow) {
+            jsonb_append_int(out, r);
+            return;
+        }
+    }
+    double x = a->type == JSONB_VALUE_INT ? (double)a->i : a->r;
+    double y = b->type == JSONB_VALUE_INT ? (double)b->i : b->r;
+    switch (op) {
+        case CRDT_OP_ADD: jsonb_append_real(out, x + y); break;
+        case CRDT_OP_SUB: jsonb_append_real(out, x - y); break;
+        case CRDT_OP_MUL: jsonb_append_real(out, x * y); break;
+        default:
+            if (y == 0.0) {
+                jsonb_append_node(out, JSONB_NULL, NULL, 0);
+            } else {
+                jsonb_append_real(out, x / y);
+            }
+            break;
+    }
+}
 
-    if (node_id == NULL) {
-        sqlite3_result_error(context, "node_id cannot be NULL", -1);
+// Store the computed element at loc, in place in writable (data itself, a
+// copy the caller owns, or NULL) when it takes as many bytes as the element
+// it replaces. Numbers usually do, so a counter bump then costs the path
+// lookup instead of a copy of the document.
+static int crdt_store_at(const unsigned char *data, size_t data_len, const JsonbLocation *loc,
+                         JsonbBuf *computed, unsigned char *writable, JsonbBuf *out) {
+    int rc;
+    if (computed->oom) {
+        rc = JSONB_NOMEM;
+    } else if (writable != NULL && jsonb_overwrite_at(writable, loc, computed->data, computed->len)) {
+        rc = JSONB_IN_PLACE;
+    } else {
+        rc = jsonb_edit_at(data, data_len, loc, JSONB_EDIT_SET, computed->data, computed->len, out);
+    }
+    jsonb_buf_free(computed);
+    return rc;
+}
+
+// Apply an arithmetic op with b as the right operand to the element at path,
+// a missing or null element is 0 with zero_missing and NULL otherwise
+static int crdt_arithmetic_at(const unsigned char *data, size_t data_len, const char *path, CrdtOp op,
+                              const JsonbNumber *b, int zero_missing, unsigned char *writable, JsonbBuf *out) {
+    JsonbLocation loc;
+    if (jsonb_locate(data, data_len, path, &loc) != 0) {
+        return JSONB_MALFORMED;
+    }
+    JsonbNumber a;
+    JsonbBuf computed;
+    jsonb_buf_init(&computed);
+    jsonb_to_number(loc.found ? data : NULL, loc.end, loc.start, &a);
+    if (zero_missing && a.type == JSONB_VALUE_NULL) {
+        a.type = JSONB_VALUE_INT;
+    }
+    crdt_arithmetic(op, &a, b, &computed);
+    return crdt_store_at(data, data_len, &loc, &computed, writable, out);
+}
+
+// Apply op to the JSONB document data, leaving the result in out. Returns
+// one of the JSONB_* result codes from jsonb.h, JSONB_IN_PLACE only when
+// writable is data itself. Shared by crdt_merge and crdt_apply_changes;
+// NULL documents are handled by the callers.
+static int crdt_merge_jsonb(const unsigned char *data, size_t data_len, const unsigned char *value, size_t value_len,
+                            const char *path, CrdtOp op, JsonbBuf *out, unsigned char *writable) {
+    JsonbBuf computed;
+    int rc = JSONB_UNCHANGED;
+    switch (op) {
+        case CRDT_OP_ASSIGN:
+        case CRDT_OP_SET:
+            return jsonb_edit(data, data_len, path, JSONB_EDIT_SET, value, value_len, out);
+        case CRDT_OP_INSERT:
+            return jsonb_edit(data, data_len, path, JSONB_EDIT_INSERT, value, value_len, out);
+        case CRDT_OP_REPLACE:
+            return jsonb_edit(data, data_len, path, JSONB_EDIT_REPLACE, value, value_len, out);
+        case CRDT_OP_REMOVE:
+            return jsonb_edit(data, data_len, path, JSONB_EDIT_REMOVE, NULL, 0, out);
+        case CRDT_OP_PATCH:
+            // Like jsonb_patch the whole document is patched, path is ignored
+            rc = jsonb_patch(data, 0, data_len, value, 0, value_len, out, 0);
+            if (rc == 0) {
+                rc = out->oom ? JSONB_NOMEM : JSONB_CHANGED;
+            }
+            return rc;
+        case CRDT_OP_UNKNOWN:
+            return JSONB_UNCHANGED;
+        case CRDT_OP_CONCAT:
+            break;
+        default: {
+            // Operators that combine the current number at path with value
+            JsonbNumber b;
+            jsonb_to_number(value, value_len, 0, &b);
+            return crdt_arithmetic_at(data, data_len, path, op, &b, 0, writable, out);
+        }
+    }
+
+    JsonbLocation loc;
+    if (jsonb_locate(data, data_len, path, &loc) != 0) {
+        return JSONB_MALFORMED;
+    }
+    jsonb_buf_init(&computed);
+    JsonbBuf text;
+    jsonb_buf_init(&text);
+    int has_lhs = loc.found && jsonb_to_text(data, loc.end, loc.start, &text);
+    int has_rhs = has_lhs && jsonb_to_text(value, value_len, 0, &text);
+    if (has_lhs && has_rhs) {
+        jsonb_append_text(&computed, text.len ? (const char *)text.data : "", text.len);
+    } else {
+        jsonb_append_node(&computed, JSONB_NULL, NULL, 0);
+    }
+    computed.oom |= text.oom;
+    jsonb_buf_free(&text);
+    return crdt_store_at(data, data_len, &loc, &computed, writable, out);
+}
+
+// Set the result of a JSONB edit of the document input, taking ownership of
+// the edited document in out
+static void crdt_result_jsonb(sqlite3_context *context, int rc, JsonbBuf *out, sqlite3_value *input,
+                              const char *malformed) {
+    switch (rc) {
+        case JSONB_CHANGED:
+            sqlite3_result_blob(context, out->data, (int)out->len, free);
+            jsonb_buf_init(out); // Ownership passed to SQLite
+            break;
+        case JSONB_UNCHANGED:
+            sqlite3_result_value(context, input);
+            break;
+        case JSONB_REMOVED:
+            sqlite3_result_null(context);
+            break;
+        case JSONB_NOMEM:
+            sqlite3_result_error_nomem(context);
+            break;
+        default:
+            sqlite3_result_error(context, malformed, -1);
+            break;
+    }
+    jsonb_buf_free(out);
+}
+
+// crdt_merge(data, value, path, op)
+//
+// Apply a change to a record document in one pass over its JSONB, this is
+// what the crdt_changes trigger uses instead of a chain of json_extract and
+// jsonb_set calls per operator. data and value are JSONB blobs, a NULL
+// value deletes the record.
+static void crdt_merge(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL || sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    CrdtOp op = crdt_op_lookup((const char *)sqlite3_value_text(argv[3]));
+    if (op == CRDT_OP_UNKNOWN) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "crdt_merge expects JSONB blobs", -1);
         return;
     }
+    const char *path = (const char *)sqlite3_value_text(argv[2]);
+    JsonbBuf out;
+    jsonb_buf_init(&out);
+    int rc = crdt_merge_jsonb(sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]),
+                              sqlite3_value_blob(argv[1]), (size_t)sqlite3_value_bytes(argv[1]),
+                              path ? path : "$", op, &out, NULL);
+    crdt_result_jsonb(context, rc, &out, argv[0], "crdt_merge: malformed JSONB or JSON path");
+}
 
-    // Use %Q for SQL string literals - it handles NULL and escapes quotes.
-    // Escape the literal SQL modulo operator % as %%
-    char *sql = sqlite3_mprintf(
-        "CREATE TABLE IF NOT EXISTS crdt_changes (\n"
-        "    id TEXT NOT NULL PRIMARY KEY DEFAULT (hlc_now(%Q)),\n" // Use %Q for node_id literal
-        "    pk TEXT NOT NULL,\n"
-        "    tbl TEXT NOT NULL,\n"
-        "    data BLOB,\n"
-        "    path TEXT NOT NULL DEFAULT ('$'),\n"
-        "    op TEXT NOT NULL DEFAULT ('='),\n"
-        "    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) VIRTUAL,\n"
-        "    hlc TEXT NOT NULL,\n"
-        "    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,\n"
-        "    node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) VIRTUAL\n"
-        ");\n"
-        "\n"
-        "CREATE TABLE IF NOT EXISTS crdt_kv (\n"
-        "    key TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE,\n"
-        "    value\n"
-        ");\n"
-        "\n"
-        "CREATE TABLE IF NOT EXISTS crdt_records (\n"
-        "    id TEXT NOT NULL PRIMARY KEY,\n"
-        "    tbl TEXT NOT NULL,\n"
-        "    data BLOB,\n"
-        "    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) VIRTUAL,\n"
-        "    hlc TEXT NOT NULL,\n"
-        "    path TEXT,\n"
-        "    op TEXT,\n"
-        "    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,\n"
-        "    node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) VIRTUAL\n"
-        ");\n"
-        "\n"
-        "DROP TRIGGER IF EXISTS crdt_changes_trigger;\n"
-        "CREATE TRIGGER crdt_changes_trigger\n"
-        "AFTER INSERT ON crdt_changes\n"
-        "BEGIN\n"
-        "    INSERT INTO crdt_records (id, tbl, data, hlc, op, path)\n"
-        "    VALUES (\n"
-        "            NEW.pk,\n"
-        "            NEW.tbl,\n"
-        "            jsonb(NEW.data), \n"
-        "            NEW.hlc,\n"
-        "            IFNULL(NEW.op, '='),\n"
-        "            IFNULL(NEW.path, '$')\n"
-        "        ) ON CONFLICT (id) DO\n"
-        "    UPDATE\n"
-        "    SET data = (\n"
-        "        CASE\n"
-        "            WHEN NEW.deleted THEN NULL \n"
-        "            WHEN NEW.op = 'set' THEN jsonb_set(data, NEW.path, jsonb(NEW.data))\n"
-        "            WHEN NEW.op = 'insert' THEN jsonb_insert(data, NEW.path, jsonb(NEW.data))\n"
-        "            WHEN NEW.op = 'patch' THEN jsonb_patch(data, jsonb(NEW.data))\n"
-        "            WHEN NEW.op = 'remove' THEN jsonb_remove(data, NEW.path)\n"
-        "            WHEN NEW.op = 'replace' THEN jsonb_replace(data, NEW.path, jsonb(NEW.data))\n"
-        "            WHEN NEW.op = '=' THEN jsonb_set(data, NEW.path, jsonb(NEW.data))\n"
-        "            WHEN NEW.op = '+' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) + json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '-' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) - json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '*' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) * json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '/' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) / json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '%%' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) %% json_extract(NEW.data, '$')))\n" // ESCAPED % -> %%
-        "            WHEN NEW.op = '&' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) & json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '|' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) | json_extract(NEW.data, '$')))\n"
-        "            WHEN NEW.op = '||' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) || json_extract(NEW.data, '$')))\n"
-        "            ELSE data \n"
-        "        END\n"
-        "    ),\n"
-        "    hlc = NEW.hlc,\n"
-        "    path = IFNULL(NEW.path, '$'),\n"
-        "    op = IFNULL(NEW.op, '=')\n"
-        "    WHERE hlc_compare(NEW.hlc, crdt_records.hlc) > 0;\n"
-        "END;\n",
-        node_id // Argument for the %Q in hlc_now default
-    );
+// crdt_jsonb_incr(data, path, delta)
+//
+// Add the SQL number delta to the number at path of the JSONB document
+// data, the '+' operator of crdt_merge without encoding delta as JSONB
+// first. Unlike '+' a missing or null counter starts at 0, a NULL delta
+// still gives null. Counters can call it directly:
+//
+//     UPDATE t SET data = crdt_jsonb_incr(data, '$.views', 1)
+static void crdt_jsonb_incr(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "crdt_jsonb_incr expects a JSONB blob", -1);
+        return;
+    }
+    JsonbNumber delta;
+    memset(&delta, 0, sizeof(JsonbNumber));
+    switch (sqlite3_value_numeric_type(argv[2])) {
+        case SQLITE_INTEGER:
+            delta.type = JSONB_VALUE_INT;
+            delta.i = sqlite3_value_int64(argv[2]);
+            break;
+        case SQLITE_FLOAT:
+            delta.type = JSONB_VALUE_REAL;
+            delta.r = sqlite3_value_double(argv[2]);
+            break;
+        case SQLITE_NULL:
+            delta.type = JSONB_VALUE_NULL;
+            break;
+        default:
+            jsonb_text_to_number((const char *)sqlite3_value_text(argv[2]), &delta);
+            break;
+    }
+    const char *path = (const char *)sqlite3_value_text(argv[1]);
+    JsonbBuf out;
+    jsonb_buf_init(&out);
+    int rc = crdt_arithmetic_at(sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]),
+                                path ? path : "$", CRDT_OP_ADD, &delta, 1, NULL, &out);
+    crdt_result_jsonb(context, rc, &out, argv[0], "crdt_jsonb_incr: malformed JSONB or JSON path");
+}
 
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    execute_sql(context, db, sql); // Use helper to execute and handle errors/freeing
+// Returns 1 if path a is b or one of its ancestors, 0 if it is not and -1 if
+// either path is malformed. Keys are compared unescaped, so $."a" covers
+// $.a.b, and [#] only covers [#].
+static int crdt_path_covers_text(const char *a, const char *b) {
+    if (*a++ != '$' || *b++ != '$') {
+        return -1;
+    }
+    JsonbPathSegment sa, sb;
+    for (;;) {
+        int ra = jsonb_path_next(&a, &sa);
+        int rb = jsonb_path_next(&b, &sb);
+        if (ra < 0 || rb < 0) {
+            return -1;
+        }
+        if (ra == 0) {
+            return 1;
+        }
+        if (rb == 0 || sa.isIndex != sb.isIndex) {
+            return 0;
+        }
+        if (sa.isIndex) {
+            if (sa.fromEnd != sb.fromEnd || sa.index != sb.index) {
+                return 0;
+            }
+        } else if (!sa.escaped && !sb.escaped) {
+            if (sa.keyLen != sb.keyLen || memcmp(sa.key, sb.key, sa.keyLen) != 0) {
+                return 0;
+            }
+        } else {
+            JsonbBuf ka, kb;
+            jsonb_buf_init(&ka);
+            jsonb_buf_init(&kb);
+            jsonb_segment_key(&sa, &ka);
+            jsonb_segment_key(&sb, &kb);
+            int equal = ka.len == kb.len && (ka.len == 0 || memcmp(ka.data, kb.data, ka.len) == 0);
+            int oom = ka.oom || kb.oom;
+            jsonb_buf_free(&ka);
+            jsonb_buf_free(&kb);
+            if (oom) {
+                return -1;
+            }
+            if (!equal) {
+                return 0;
+            }
+        }
+    }
+}
+
+// crdt_path_covers(a, b)
+//
+// 1 if a change to JSON path a also changes path b, that is a is b or one
+// of its ancestors. The per path clocks of 'paths' mode use it to find the
+// clocks a change is ordered against.
+static void crdt_path_covers(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *a = (const char *)sqlite3_value_text(argv[0]);
+    const char *b = (const char *)sqlite3_value_text(argv[1]);
+    if (a == NULL || b == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    int covers = crdt_path_covers_text(a, b);
+    if (covers < 0) {
+        sqlite3_result_error(context, "crdt_path_covers: malformed JSON path", -1);
+        return;
+    }
+    sqlite3_result_int(context, covers);
+}
+
+static int crdt_compare_length(const void *a, const void *b) {
+    size_t la = strlen(*(const char *const *)a), lb = strlen(*(const char *const *)b);
+    return la < lb ? -1 : la > lb;
+}
+
+// Copy the value at every path of a JSONB array of paths from old into
+// data, or remove it from data where old has none. Ancestors are restored
+// before their descendants. Returns a JSONB_* result code, the document is
+// in out on JSONB_CHANGED.
+static int crdt_restore_jsonb(const unsigned char *data, size_t data_len, const unsigned char *old, size_t old_len,
+                              const unsigned char *paths, size_t paths_len, JsonbBuf *out) {
+    int type;
+    size_t payload;
+    size_t hdr = jsonb_header(paths, paths_len, 0, &type, &payload);
+    if (hdr == 0 || type != JSONB_ARRAY) {
+        return JSONB_MALFORMED;
+    }
+
+    // Unescaped, NUL terminated paths in one buffer
+    JsonbBuf text;
+    jsonb_buf_init(&text);
+    int count = 0;
+    size_t end = hdr + payload;
+    for (size_t i = hdr; i < end; count++) {
+        size_t len;
+        size_t h = jsonb_header(paths, end, i, &type, &len);
+        if (h == 0 || type < JSONB_TEXT || type > JSONB_TEXTRAW) {
+            jsonb_buf_free(&text);
+            return JSONB_MALFORMED;
+        }
+        jsonb_unescape(&text, type, paths + i + h, len);
+        jsonb_buf_append(&text, "", 1);
+        i += h + len;
+    }
+    const char **list = count ? (const char **)sqlite3_malloc64((sqlite3_uint64)count * sizeof(char *)) : NULL;
+    if (text.oom || (count && list == NULL)) {
+        jsonb_buf_free(&text);
+        return JSONB_NOMEM;
+    }
+    for (int k = 0, i = 0; k < count; k++) {
+        list[k] = (const char *)text.data + i;
+        i += (int)strlen(list[k]) + 1;
+    }
+    qsort(list, (size_t)count, sizeof(char *), crdt_compare_length);
+
+    // Each edit reads the document the previous one wrote
+    JsonbBuf doc;
+    jsonb_buf_init(&doc);
+    int rc = JSONB_UNCHANGED;
+    for (int k = 0; k < count && rc >= 0 && rc != JSONB_REMOVED; k++) {
+        JsonbLocation loc;
+        if (old == NULL) {
+            loc.found = 0;
+        } else if (jsonb_locate(old, old_len, list[k], &loc) != 0) {
+            rc = JSONB_MALFORMED;
+            break;
+        }
+        const unsigned char *z = rc == JSONB_CHANGED ? doc.data : data;
+        size_t n = rc == JSONB_CHANGED ? doc.len : data_len;
+        JsonbBuf next;
+        jsonb_buf_init(&next);
+        int edit = loc.found
+            ? jsonb_edit(z, n, list[k], JSONB_EDIT_SET, old + loc.start, loc.end - loc.start, &next)
+            : jsonb_edit(z, n, list[k], JSONB_EDIT_REMOVE, NULL, 0, &next);
+        if (edit == JSONB_CHANGED) {
+            jsonb_buf_free(&doc);
+            doc = next;
+            rc = JSONB_CHANGED;
+        } else {
+            jsonb_buf_free(&next);
+            if (edit != JSONB_UNCHANGED) rc = edit;
+        }
+    }
+    sqlite3_free(list);
+    jsonb_buf_free(&text);
+    if (rc == JSONB_CHANGED) {
+        *out = doc;
+    } else {
+        jsonb_buf_free(&doc);
+    }
+    return rc;
+}
+
+// crdt_restore(data, old, paths)
+//
+// Undo a merge below the paths that have a newer clock than the change:
+// the values of old at paths, a JSONB array of JSON paths, are copied back
+// into data, and removed from it where old has none. A NULL data or old is
+// a deleted record, whose fields are all older than the delete, so the
+// newer fields of a record the change deletes are kept in an otherwise
+// empty document. NULL paths returns data.
+static void crdt_restore(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    static const unsigned char empty[] = { JSONB_OBJECT }; // {}
+    if (sqlite3_value_type(argv[2]) == SQLITE_NULL) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    int deleted = sqlite3_value_type(argv[0]) == SQLITE_NULL;
+    if ((!deleted && sqlite3_value_type(argv[0]) != SQLITE_BLOB)
+        || (sqlite3_value_type(argv[1]) != SQLITE_NULL && sqlite3_value_type(argv[1]) != SQLITE_BLOB)
+        || sqlite3_value_type(argv[2]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "crdt_restore expects JSONB blobs", -1);
+        return;
+    }
+    JsonbBuf out;
+    jsonb_buf_init(&out);
+    const unsigned char *data = deleted ? empty : sqlite3_value_blob(argv[0]);
+    size_t data_len = deleted ? sizeof(empty) : (size_t)sqlite3_value_bytes(argv[0]);
+    int rc = crdt_restore_jsonb(data, data_len,
+                                sqlite3_value_blob(argv[1]), (size_t)sqlite3_value_bytes(argv[1]),
+                                sqlite3_value_blob(argv[2]), (size_t)sqlite3_value_bytes(argv[2]), &out);
+    switch (rc) {
+        case JSONB_CHANGED:
+            sqlite3_result_blob(context, out.data, (int)out.len, free);
+            jsonb_buf_init(&out); // Ownership passed to SQLite
+            break;
+        case JSONB_UNCHANGED:
+            if (deleted) {
+                sqlite3_result_blob(context, empty, sizeof(empty), SQLITE_STATIC);
+            } else {
+                sqlite3_result_value(context, argv[0]);
+            }
+            break;
+        case JSONB_REMOVED:
+            sqlite3_result_null(context);
+            break;
+        case JSONB_NOMEM:
+            sqlite3_result_error_nomem(context);
+            break;
+        default:
+            sqlite3_result_error(context, "crdt_restore: malformed JSONB or JSON path", -1);
+            break;
+    }
+    jsonb_buf_free(&out);
+}
+
+// crdt_overlay(data, values)
+//
+// Set every member of the JSONB object values in data, the label is the
+// JSON path and the value what goes there. The crdt_changes triggers use it
+// to write the sums of the crdt_counters of a record over its document, so
+// no other change can overwrite a counter. A NULL data or values returns
+// data.
+static void crdt_overlay(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "crdt_overlay expects JSONB blobs", -1);
+        return;
+    }
+    const unsigned char *values = sqlite3_value_blob(argv[1]);
+    size_t n = (size_t)sqlite3_value_bytes(argv[1]);
+    int type;
+    size_t payload;
+    size_t hdr = jsonb_header(values, n, 0, &type, &payload);
+    int rc = hdr == 0 || type != JSONB_OBJECT ? JSONB_MALFORMED : JSONB_UNCHANGED;
+
+    JsonbBuf doc, path;
+    jsonb_buf_init(&doc);
+    jsonb_buf_init(&path);
+    size_t end = hdr + payload;
+    for (size_t i = hdr; i < end && rc >= 0 && rc != JSONB_REMOVED;) {
+        int label_type, value_type;
+        size_t label_size, value_size;
+        size_t lh = jsonb_header(values, end, i, &label_type, &label_size);
+        size_t value = i + lh + label_size;
+        size_t vh = lh ? jsonb_header(values, end, value, &value_type, &value_size) : 0;
+        if (vh == 0 || label_type < JSONB_TEXT || label_type > JSONB_TEXTRAW) {
+            rc = JSONB_MALFORMED;
+            break;
+        }
+        path.len = 0;
+        jsonb_unescape(&path, label_type, values + i + lh, label_size);
+        jsonb_buf_append(&path, "", 1);
+        if (path.oom) {
+            rc = JSONB_NOMEM;
+            break;
+        }
+        // Each edit reads the document the previous one wrote
+        const unsigned char *z = rc == JSONB_CHANGED ? doc.data : sqlite3_value_blob(argv[0]);
+        size_t zn = rc == JSONB_CHANGED ? doc.len : (size_t)sqlite3_value_bytes(argv[0]);
+        JsonbBuf next;
+        jsonb_buf_init(&next);
+        int edit = jsonb_edit(z, zn, (const char *)path.data, JSONB_EDIT_SET, values + value, vh + value_size, &next);
+        if (edit == JSONB_CHANGED) {
+            jsonb_buf_free(&doc);
+            doc = next;
+            rc = JSONB_CHANGED;
+        } else {
+            jsonb_buf_free(&next);
+            if (edit != JSONB_UNCHANGED) rc = edit;
+        }
+        i = value + vh + value_size;
+    }
+    jsonb_buf_free(&path);
+    crdt_result_jsonb(context, rc, &doc, argv[0], "crdt_overlay: malformed JSONB or JSON path");
+}
+
+// Per-connection state shared by the crdt functions
+typedef struct {
+    int applying; // Set while crdt_apply_changes writes to crdt_changes
+    int refCount; // Number of SQL functions holding the state
+} CrdtConnection;
+
+static CrdtConnection *crdt_connection_create(void) {
+    CrdtConnection *conn = (CrdtConnection *)sqlite3_malloc(sizeof(CrdtConnection));
+    if (conn == NULL) {
+        return NULL;
+    }
+    memset(conn, 0, sizeof(CrdtConnection));
+    return conn;
+}
+
+static void crdt_connection_release(void *arg) {
+    CrdtConnection *conn = (CrdtConnection *)arg;
+    if (conn != NULL && --conn->refCount <= 0) {
+        sqlite3_free(conn);
+    }
+}
+
+// crdt_applying()
+//
+// Returns 1 while crdt_apply_changes is logging a batch to crdt_changes. The
+// crdt_changes trigger skips those rows because the batch has already
+// applied them to crdt_records.
+static void crdt_applying(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    (void)argv;
+    CrdtConnection *conn = (CrdtConnection *)sqlite3_user_data(context);
+    sqlite3_result_int(context, conn->applying);
+}
+
+// One change of a crdt_apply_changes batch. Strings are NUL terminated and
+// live in the batch arena, data points into the JSONB batch itself.
+typedef struct {
+    const char *pk;
+    const char *tbl;
+    const char *path;
+    const char *op;
+    const char *hlc;
+    const unsigned char *key;  // hlc_pack(hlc), orders like hlc_compare, set by changesets
+    int key_len;
+    const unsigned char *data; // JSONB element, NULL deletes the record
+    int data_len;
+    const char *dedicated;     // tbl of a 'dedicated' table, NULL for crdt_records
+    int index;                 // Position in the batch, keeps the sort stable
+} CrdtChange;
+
+// Longest hlc_pack() blob, 8 bytes of time and counter and a node ID
+#define CRDT_KEY_SIZE (8 + 64)
+
+// hlc_pack() of an HLC into key, which has room for CRDT_KEY_SIZE bytes.
+// Returns SQLITE_OK, SQLITE_FORMAT if it does not pack or the error of pack.
+static int crdt_pack_key(sqlite3_stmt *pack, const char *hlc, unsigned char *key, int *key_len) {
+#ifdef CRDT_ALL
+    // Built with hlc.c by crdt_all.c, no statement needed
+    (void)pack;
+    Hlc parsed;
+    int len = hlc_parse_into(hlc, &parsed) == 0 ? hlc_pack(&parsed, key) : -1;
+    if (len < 0) {
+        return SQLITE_FORMAT;
+    }
+    *key_len = len;
+    return SQLITE_OK;
+#else
+    int rc = SQLITE_FORMAT;
+    sqlite3_bind_text(pack, 1, hlc, -1, SQLITE_STATIC);
+    if (sqlite3_step(pack) == SQLITE_ROW) {
+        int len = sqlite3_column_bytes(pack, 0);
+        if (len > 0 && len <= CRDT_KEY_SIZE) {
+            memcpy(key, sqlite3_column_blob(pack, 0), (size_t)len);
+            *key_len = len;
+            rc = SQLITE_OK;
+        }
+    }
+    int reset = sqlite3_reset(pack);
+    return reset != SQLITE_OK ? reset : rc;
+#endif
+}
+
+// Compare the records tables two changes go to, crdt_records first
+static int crdt_dedicated_compare(const CrdtChange *x, const CrdtChange *y) {
+    if (x->dedicated == NULL || y->dedicated == NULL) {
+        return (x->dedicated != NULL) - (y->dedicated != NULL);
+    }
+    return strcmp(x->dedicated, y->dedicated);
+}
+
+static int crdt_change_compare(const void *a, const void *b) {
+    const CrdtChange *x = (const CrdtChange *)a, *y = (const CrdtChange *)b;
+    int c = crdt_dedicated_compare(x, y);
+    if (c == 0) c = strcmp(x->pk, y->pk);
+    if (c == 0) {
+        c = memcmp(x->key, y->key, (size_t)(x->key_len < y->key_len ? x->key_len : y->key_len));
+        if (c == 0) c = x->key_len - y->key_len;
+        if (c == 0) c = x->index - y->index;
+    }
+    return c;
+}
+
+// How far hlc_recv lets a remote HLC run ahead of the wall clock, MAX_DRIFT
+// in hlc.c
+#define CRDT_MAX_DRIFT 60000
+
+// Returns non-zero if the hlc_pack() blob key is more than CRDT_MAX_DRIFT
+// ahead of now, the wall clock in milliseconds since the epoch. Its first 6
+// bytes are the milliseconds, big endian.
+static int crdt_key_skewed(const unsigned char *key, int key_len, sqlite3_int64 now) {
+    sqlite3_int64 millis = 0;
+    for (int i = 0; i < 6 && i < key_len; i++) {
+        millis = (millis << 8) | key[i];
+    }
+    return key_len >= 6 && millis - now > CRDT_MAX_DRIFT;
+}
+
+// The wall clock of the default VFS in milliseconds since the epoch, the
+// clock SQLite's 'now' reads
+static sqlite3_int64 crdt_wall_millis(void) {
+    sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+    sqlite3_int64 julian = 0;
+    if (vfs != NULL && vfs->iVersion >= 2 && vfs->xCurrentTimeInt64 != NULL) {
+        vfs->xCurrentTimeInt64(vfs, &julian);
+    } else if (vfs != NULL) {
+        double days = 0;
+        vfs->xCurrentTime(vfs, &days);
+        julian = (sqlite3_int64)(days * 86400000.0);
+    }
+    return julian - 210866760000000LL; // Julian day milliseconds of the epoch
+}
+
+// Compare two hlc_pack() blobs the way SQLite orders BLOBs
+static int crdt_key_compare(const unsigned char *a, int len_a, const unsigned char *b, int len_b) {
+    int c = memcmp(a, b, (size_t)(len_a < len_b ? len_a : len_b));
+    return c != 0 ? c : len_a - len_b;
+}
+
+// Copy the scalar element at z[i] to the arena as NUL terminated text,
+// returns its offset or -1 if it is missing, null or a container.
+static long crdt_arena_text(JsonbBuf *arena, const unsigned char *z, size_t n, size_t i) {
+    size_t start = arena->len;
+    if (i == 0 || !jsonb_to_text(z, n, i, arena)) {
+        return -1;
+    }
+    jsonb_buf_append(arena, "", 1);
+    return (long)start;
+}
+
+// Parse a JSONB array of change objects into changes, strings go to the
+// arena as offsets that are turned into pointers once it stops growing.
+// Returns SQLITE_OK, SQLITE_NOMEM or SQLITE_FORMAT.
+static int crdt_parse_batch(const unsigned char *z, size_t n, CrdtChange **changes, int *count, JsonbBuf *arena) {
+    static const char *const names[] = { "pk", "tbl", "data", "path", "op", "hlc" };
+    int type;
+    size_t payload;
+    size_t hdr = jsonb_header(z, n, 0, &type, &payload);
+    if (hdr == 0 || hdr + payload != n || type != JSONB_ARRAY) {
+        return SQLITE_FORMAT;
+    }
+    int cap = 0;
+    *count = 0;
+    *changes = NULL;
+    for (size_t i = hdr; i < n;) {
+        size_t object_size;
+        size_t h = jsonb_header(z, n, i, &type, &object_size);
+        if (h == 0 || type != JSONB_OBJECT) {
+            return SQLITE_FORMAT;
+        }
+        // Offsets of the member values, 0 when missing
+        size_t fields[6] = { 0 };
+        size_t end = i + h + object_size;
+        for (size_t m = i + h; m < end;) {
+            int label_type, value_type;
+            size_t label_size, value_size;
+            size_t lh = jsonb_header(z, end, m, &label_type, &label_size);
+            size_t value = m + lh + label_size;
+            size_t vh = lh ? jsonb_header(z, end, value, &value_type, &value_size) : 0;
+            if (vh == 0) {
+                return SQLITE_FORMAT;
+            }
+            for (int f = 0; f < 6; f++) {
+                if (jsonb_label_equals(z, m, lh, label_size, label_type, names[f], strlen(names[f]))) {
+                    fields[f] = value;
+                }
+            }
+            m = value + vh + value_size;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            CrdtChange *grown = (CrdtChange *)sqlite3_realloc64(*changes, (sqlite3_uint64)cap * sizeof(CrdtChange));
+            if (grown == NULL) {
+                return SQLITE_NOMEM;
+            }
+            *changes = grown;
+        }
+        CrdtChange *change = &(*changes)[(*count)++];
+        memset(change, 0, sizeof(CrdtChange));
+        change->index = *count;
+        // Offsets for now, -1 marks a missing value
+        change->pk = (const char *)(intptr_t)crdt_arena_text(arena, z, n, fields[0]);
+        change->tbl = (const char *)(intptr_t)crdt_arena_text(arena, z, n, fields[1]);
+        change->path = (const char *)(intptr_t)crdt_arena_text(arena, z, n, fields[3]);
+        change->op = (const char *)(intptr_t)crdt_arena_text(arena, z, n, fields[4]);
+        change->hlc = (const char *)(intptr_t)crdt_arena_text(arena, z, n, fields[5]);
+        if (fields[2] != 0 && (z[fields[2]] & 0x0F) != JSONB_NULL) {
+            size_t data_size;
+            size_t dh = jsonb_header(z, n, fields[2], &type, &data_size);
+            change->data = z + fields[2];
+            change->data_len = (int)(dh + data_size);
+        }
+        i = end;
+    }
+    return arena->oom ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+// Binary changesets of crdt_export and crdt_import
+//
+// A changeset starts with CRDT_CHANGESET_MAGIC followed by its changes up
+// to the end of the blob, each one as
+//
+//     tbl, pk, node_id, path, op   string references
+//     millis                       zigzag varint, minus the previous change's
+//     counter                      varint
+//     data                         varint 0 for NULL, else the JSONB size + 1
+//                                  followed by the JSONB
+//
+// where millis, counter and node_id are the parts of the HLC. Varints are
+// little endian base 128. A string reference is a varint of index << 1 for
+// a string that came earlier in the changeset, or of length << 1 | 1
+// followed by the bytes of a new string, which takes the next index. Each
+// changeset stands on its own so crdt_export can stream them.
+#define CRDT_CHANGESET_MAGIC "CRX\x01"
+#define CRDT_CHANGESET_MAGIC_SIZE 4
+
+static void crdt_put_varint(JsonbBuf *buf, sqlite3_uint64 v) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n++] = (unsigned char)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+    jsonb_buf_append(buf, bytes, (size_t)n);
+}
+
+// Read the varint at *i, returns 0 if it runs past n
+static int crdt_get_varint(const unsigned char *z, size_t n, size_t *i, sqlite3_uint64 *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *i < n; shift += 7) {
+        unsigned char b = z[(*i)++];
+        *v |= (sqlite3_uint64)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A string of a changeset, at offset in the changeset while writing and in
+// the arena while reading
+typedef struct {
+    size_t offset;
+    size_t len;
+} CrdtString;
+
+// A changeset being written, with the strings it has so far in a hash
+// table of their index + 1
+typedef struct {
+    JsonbBuf out;
+    CrdtString *strings;
+    int count;
+    int cap;
+    int *slots;
+    int slot_count;             // Power of two, at least twice count
+    sqlite3_int64 millis;       // Of the previous change
+} CrdtChangesetWriter;
+
+static sqlite3_uint64 crdt_string_hash(const unsigned char *z, size_t n) {
+    sqlite3_uint64 hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ z[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Start a new changeset
+static void crdt_changeset_reset(CrdtChangesetWriter *w) {
+    w->out.len = 0;
+    jsonb_buf_append(&w->out, CRDT_CHANGESET_MAGIC, CRDT_CHANGESET_MAGIC_SIZE);
+    w->count = 0;
+    if (w->slots != NULL) {
+        memset(w->slots, 0, (size_t)w->slot_count * sizeof(int));
+    }
+    w->millis = 0;
+}
+
+static void crdt_changeset_free(CrdtChangesetWriter *w) {
+    jsonb_buf_free(&w->out);
+    sqlite3_free(w->strings);
+    sqlite3_free(w->slots);
+    memset(w, 0, sizeof(CrdtChangesetWriter));
+}
+
+// Find the slot of z in the hash table, empty if it is not there
+static int crdt_changeset_slot(const CrdtChangesetWriter *w, const unsigned char *z, size_t n) {
+    int mask = w->slot_count - 1;
+    for (int s = (int)(crdt_string_hash(z, n) & (sqlite3_uint64)mask);; s = (s + 1) & mask) {
+        int index = w->slots[s] - 1;
+        if (index < 0 || (w->strings[index].len == n && memcmp(w->out.data + w->strings[index].offset, z, n) == 0)) {
+            return s;
+        }
+    }
+}
+
+// Write a reference to the string z, adding it if it is new
+static void crdt_changeset_string(CrdtChangesetWriter *w, const void *z, size_t n) {
+    if (w->out.oom) {
+        return;
+    }
+    if ((w->count + 1) * 2 > w->slot_count) {
+        int slot_count = w->slot_count ? w->slot_count * 2 : 256;
+        int *slots = (int *)sqlite3_malloc64((sqlite3_uint64)slot_count * sizeof(int));
+        if (slots == NULL) {
+            w->out.oom = 1;
+            return;
+        }
+        memset(slots, 0, (size_t)slot_count * sizeof(int));
+        sqlite3_free(w->slots);
+        w->slots = slots;
+        w->slot_count = slot_count;
+        for (int i = 0; i < w->count; i++) {
+            w->slots[crdt_changeset_slot(w, w->out.data + w->strings[i].offset, w->strings[i].len)] = i + 1;
+        }
+    }
+    int s = crdt_changeset_slot(w, (const unsigned char *)z, n);
+    if (w->slots[s] != 0) {
+        crdt_put_varint(&w->out, (sqlite3_uint64)(w->slots[s] - 1) << 1);
+        return;
+    }
+    if (w->count == w->cap) {
+        int cap = w->cap ? w->cap * 2 : 128;
+        CrdtString *grown = (CrdtString *)sqlite3_realloc64(w->strings, (sqlite3_uint64)cap * sizeof(CrdtString));
+        if (grown == NULL) {
+            w->out.oom = 1;
+            return;
+        }
+        w->strings = grown;
+        w->cap = cap;
+    }
+    crdt_put_varint(&w->out, (sqlite3_uint64)n << 1 | 1);
+    w->strings[w->count].offset = w->out.len;
+    w->strings[w->count].len = n;
+    jsonb_buf_append(&w->out, z, n);
+    w->slots[s] = ++w->count;
+}
+
+// Append a change, key is its HLC as hlc_pack()
+static void crdt_changeset_add(CrdtChangesetWriter *w, const char *tbl, const char *pk, const unsigned char *key,
+                               int key_len, const char *path, const char *op, const unsigned char *data, int data_len) {
+    sqlite3_int64 millis = 0;
+    for (int i = 0; i < 6; i++) {
+        millis = (millis << 8) | key[i];
+    }
+    crdt_changeset_string(w, tbl, strlen(tbl));
+    crdt_changeset_string(w, pk, strlen(pk));
+    crdt_changeset_string(w, key + 8, (size_t)key_len - 8);
+    crdt_changeset_string(w, path, strlen(path));
+    crdt_changeset_string(w, op, strlen(op));
+    sqlite3_int64 delta = millis - w->millis;
+    crdt_put_varint(&w->out, ((sqlite3_uint64)delta << 1) ^ (sqlite3_uint64)(delta >> 63));
+    crdt_put_varint(&w->out, (sqlite3_uint64)((key[6] << 8) | key[7]));
+    crdt_put_varint(&w->out, data != NULL ? (sqlite3_uint64)data_len + 1 : 0);
+    if (data != NULL) {
+        jsonb_buf_append(&w->out, data, (size_t)data_len);
+    }
+    w->millis = millis;
+}
+
+// Read the string reference at *i into the arena, new strings are copied
+// once and every reference to them shares the copy. Returns the arena
+// offset of the string or -1 if the reference is malformed.
+static long crdt_changeset_read_string(const unsigned char *z, size_t n, size_t *i, CrdtString **strings, int *count,
+                                       int *cap, JsonbBuf *arena, size_t *len) {
+    sqlite3_uint64 v;
+    if (!crdt_get_varint(z, n, i, &v)) {
+        return -1;
+    }
+    if ((v & 1) == 0) {
+        if ((v >> 1) >= (sqlite3_uint64)*count) {
+            return -1;
+        }
+        *len = (*strings)[v >> 1].len;
+        return (long)(*strings)[v >> 1].offset;
+    }
+    v >>= 1;
+    if (v > n - *i) {
+        return -1;
+    }
+    if (*count == *cap) {
+        int grown_cap = *cap ? *cap * 2 : 128;
+        CrdtString *grown = (CrdtString *)sqlite3_realloc64(*strings, (sqlite3_uint64)grown_cap * sizeof(CrdtString));
+        if (grown == NULL) {
+            arena->oom = 1;
+            return -1;
+        }
+        *strings = grown;
+        *cap = grown_cap;
+    }
+    size_t start = arena->len;
+    jsonb_buf_append(arena, z + *i, (size_t)v);
+    jsonb_buf_append(arena, "", 1);
+    (*strings)[*count].offset = start;
+    (*strings)[*count].len = (size_t)v;
+    (*count)++;
+    *i += (size_t)v;
+    *len = (size_t)v;
+    return (long)start;
+}
+
+// Parse a changeset into changes like crdt_parse_batch, with the packed
+// HLCs in the arena as well. unpack turns them back into text, without it
+// the HLCs are left empty for databases that store them packed. Returns
+// SQLITE_OK, SQLITE_NOMEM, SQLITE_FORMAT or the error of unpack.
+static int crdt_parse_changeset(const unsigned char *z, size_t n, sqlite3_stmt *unpack, CrdtChange **changes,
+                                int *count, JsonbBuf *arena) {
+    *count = 0;
+    *changes = NULL;
+    if (n < CRDT_CHANGESET_MAGIC_SIZE || memcmp(z, CRDT_CHANGESET_MAGIC, CRDT_CHANGESET_MAGIC_SIZE) != 0) {
+        return SQLITE_FORMAT;
+    }
+    CrdtString *strings = NULL;
+    int string_count = 0, string_cap = 0, cap = 0;
+    int rc = SQLITE_OK;
+    sqlite3_int64 millis = 0;
+    unsigned char key[8 + 64];
+    long empty = (long)arena->len;
+    jsonb_buf_append(arena, "", 1);
+    for (size_t i = CRDT_CHANGESET_MAGIC_SIZE; i < n && rc == SQLITE_OK;) {
+        long fields[5];
+        size_t len = 0, node_len = 0;
+        for (int f = 0; f < 5 && rc == SQLITE_OK; f++) {
+            fields[f] = crdt_changeset_read_string(z, n, &i, &strings, &string_count, &string_cap, arena,
+                                                   f == 2 ? &node_len : &len);
+            if (fields[f] < 0) rc = arena->oom ? SQLITE_NOMEM : SQLITE_FORMAT;
+        }
+        sqlite3_uint64 delta, counter, data_len;
+        if (rc == SQLITE_OK && (!crdt_get_varint(z, n, &i, &delta) || !crdt_get_varint(z, n, &i, &counter)
+                                || !crdt_get_varint(z, n, &i, &data_len) || data_len > n - i + 1)) {
+            rc = SQLITE_FORMAT;
+        }
+        if (rc == SQLITE_OK) {
+            millis += (sqlite3_int64)(delta >> 1) ^ -(sqlite3_int64)(delta & 1);
+            if (millis < 0 || millis >= ((sqlite3_int64)1 << 48) || counter > 0xFFFF || node_len > sizeof(key) - 8) {
+                rc = SQLITE_FORMAT;
+            }
+        }
+        if (rc == SQLITE_OK && *count == cap) {
+            cap = cap ? cap * 2 : 64;
+            CrdtChange *grown = (CrdtChange *)sqlite3_realloc64(*changes, (sqlite3_uint64)cap * sizeof(CrdtChange));
+            if (grown == NULL) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            *changes = grown;
+        }
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        for (int b = 5; b >= 0; b--) {
+            key[5 - b] = (unsigned char)(millis >> (b * 8));
+        }
+        key[6] = (unsigned char)(counter >> 8);
+        key[7] = (unsigned char)counter;
+        memcpy(key + 8, arena->data + fields[2], node_len);
+        long key_offset = (long)arena->len;
+        jsonb_buf_append(arena, key, 8 + node_len);
+        long hlc = empty;
+        if (unpack != NULL) {
+#ifdef CRDT_ALL
+            Hlc unpacked;
+            char text[HLC_TEXT_MAX_SIZE];
+            int text_len = -1;
+            hlc = -1;
+            if (hlc_unpack(key, (int)(8 + node_len), &unpacked) != 0 ||
+                (text_len = hlc_str(&unpacked, text, NULL)) < 0) {
+                rc = SQLITE_FORMAT;
+            } else {
+                hlc = (long)arena->len;
+                jsonb_buf_append(arena, text, (size_t)text_len + 1);
+            }
+#else
+            sqlite3_bind_blob(unpack, 1, key, (int)(8 + node_len), SQLITE_STATIC);
+            hlc = -1;
+            if (sqlite3_step(unpack) == SQLITE_ROW) {
+                hlc = (long)arena->len;
+                jsonb_buf_append(arena, sqlite3_column_text(unpack, 0), (size_t)sqlite3_column_bytes(unpack, 0));
+                jsonb_buf_append(arena, "", 1);
+            }
+            rc = sqlite3_reset(unpack);
+#endif
+        }
+
+        CrdtChange *change = &(*changes)[(*count)++];
+        memset(change, 0, sizeof(CrdtChange));
+        change->index = *count;
+        // Offsets like crdt_parse_batch
+        change->tbl = (const char *)(intptr_t)fields[0];
+        change->pk = (const char *)(intptr_t)fields[1];
+        change->path = (const char *)(intptr_t)fields[3];
+        change->op = (const char *)(intptr_t)fields[4];
+        change->hlc = (const char *)(intptr_t)hlc;
+        change->key = (const unsigned char *)(intptr_t)key_offset;
+        change->key_len = (int)(8 + node_len);
+        if (data_len > 0) {
+            change->data = z + i;
+            change->data_len = (int)(data_len - 1);
+            i += (size_t)(data_len - 1);
+        }
+    }
+    sqlite3_free(strings);
+    return rc == SQLITE_OK && arena->oom ? SQLITE_NOMEM : rc;
+}
+
+// The record a run of sorted changes is folded into before it is written
+typedef struct {
+    int exists;                 // In crdt_records or created earlier in the run
+    const CrdtChange *last;     // Newest change applied, NULL if none was
+    const unsigned char *key;   // HLC of the record as hlc_pack()
+    int key_len;
+    const unsigned char *data;  // JSONB document, NULL when deleted
+    size_t data_len;
+    JsonbBuf owned_data;        // Storage for data when it is not in the batch
+    JsonbBuf owned_key;         // Storage for key when loaded from crdt_records
+} CrdtFold;
+
+static void crdt_fold_reset(CrdtFold *fold) {
+    jsonb_buf_free(&fold->owned_data);
+    jsonb_buf_free(&fold->owned_key);
+    memset(fold, 0, sizeof(CrdtFold));
+}
+
+// Load the current state of record pk into a reset fold
+static int crdt_fold_load(CrdtFold *fold, sqlite3_stmt *load, const char *pk) {
+    sqlite3_bind_text(load, 1, pk, -1, SQLITE_STATIC);
+    if (sqlite3_step(load) == SQLITE_ROW) {
+        fold->exists = 1;
+        if (sqlite3_column_type(load, 0) != SQLITE_NULL) {
+            jsonb_buf_append(&fold->owned_data, sqlite3_column_blob(load, 0), (size_t)sqlite3_column_bytes(load, 0));
+            jsonb_buf_reserve(&fold->owned_data, 1);
+            fold->data = fold->owned_data.data;
+            fold->data_len = fold->owned_data.len;
+        }
+        jsonb_buf_append(&fold->owned_key, sqlite3_column_blob(load, 1), (size_t)sqlite3_column_bytes(load, 1));
+        fold->key = fold->owned_key.data;
+        fold->key_len = (int)fold->owned_key.len;
+    }
+    int rc = sqlite3_reset(load);
+    if (rc == SQLITE_OK && (fold->owned_data.oom || fold->owned_key.oom)) {
+        rc = SQLITE_NOMEM;
+    }
+    return rc;
+}
+
+// Apply one change to the fold, same rules as crdt_changes_trigger: the
+// first change creates the record, later ones are merged only if their HLC
+// is newer. Returns SQLITE_FORMAT for malformed JSONB or paths.
+static int crdt_fold_apply(CrdtFold *fold, const CrdtChange *change) {
+    if (!fold->exists) {
+        fold->exists = 1;
+        fold->data = change->data;
+        fold->data_len = (size_t)change->data_len;
+    } else if (crdt_key_compare(change->key, change->key_len, fold->key, fold->key_len) <= 0) {
+        return SQLITE_OK; // An older change loses to the record
+    } else if (change->data == NULL) {
+        fold->data = NULL;
+    } else if (fold->data != NULL) {
+        CrdtOp op = crdt_op_lookup(change->op);
+        JsonbBuf out;
+        jsonb_buf_init(&out);
+        int merged = op == CRDT_OP_UNKNOWN ? JSONB_UNCHANGED
+            : crdt_merge_jsonb(fold->data, fold->data_len, change->data, (size_t)change->data_len, change->path, op, &out,
+                               fold->data == fold->owned_data.data ? fold->owned_data.data : NULL);
+        if (merged == JSONB_CHANGED) {
+            jsonb_buf_free(&fold->owned_data);
+            fold->owned_data = out;
+            fold->data = out.data;
+            fold->data_len = out.len;
+        } else {
+            jsonb_buf_free(&out);
+            if (merged == JSONB_REMOVED) {
+                fold->data = NULL;
+            } else if (merged == JSONB_NOMEM) {
+                return SQLITE_NOMEM;
+            } else if (merged == JSONB_MALFORMED) {
+                return SQLITE_FORMAT;
+            }
+        }
+    }
+    fold->key = change->key;
+    fold->key_len = change->key_len;
+    fold->last = change;
+    return SQLITE_OK;
+}
+
+// Write a folded record back to crdt_records
+static int crdt_fold_save(CrdtFold *fold, sqlite3_stmt *save, const CrdtChange *first, int packed) {
+    const CrdtChange *last = fold->last;
+    if (last == NULL) {
+        return SQLITE_OK;
+    }
+    sqlite3_bind_text(save, 1, first->pk, -1, SQLITE_STATIC);
+    sqlite3_bind_text(save, 2, first->tbl, -1, SQLITE_STATIC);
+    if (fold->data != NULL) {
+        sqlite3_bind_blob(save, 3, fold->data, (int)fold->data_len, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(save, 3);
+    }
+    if (packed) {
+        sqlite3_bind_blob(save, 4, last->key, last->key_len, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_text(save, 4, last->hlc, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_text(save, 5, last->op, -1, SQLITE_STATIC);
+    sqlite3_bind_text(save, 6, last->path, -1, SQLITE_STATIC);
+    sqlite3_step(save);
+    return sqlite3_reset(save);
+}
+
+// Statements used by crdt_apply_changes, prepared once per batch
+enum {
+    CRDT_BATCH_JSONB,  // The batch as JSONB
+    CRDT_BATCH_PACK,   // hlc_pack() of a change HLC
+    CRDT_BATCH_LOAD,   // Current state of a record
+    CRDT_BATCH_LOG,    // Append a change to crdt_changes
+    CRDT_BATCH_SAVE,   // Write a folded record
+    CRDT_BATCH_RECV,   // Advance the local clock
+    CRDT_BATCH_UNPACK, // hlc_unpack() of a changeset HLC
+    CRDT_BATCH_ORDER,  // CRDT_ORDER_SQL
+    CRDT_BATCH_COUNT
+};
+
+// Moves the clock of the connection past the newest crdt_changes.id before
+// it logs changes. Without 'rowid' the ids are HLCs from the clock of the
+// connection that logged them, another connection's clock may be ahead
+// after an hlc_recv or issue the same millisecond and counter, so ids would
+// not follow commit order and crdt_changes_since could pass over a change
+// committed after a peer's watermark. Run in the writing transaction, the
+// ids logged next sort after every committed one. 'rowid' ids are in order
+// already and skipped.
+#define CRDT_ORDER_SQL \
+    "SELECT hlc_recv(id) FROM (SELECT id FROM crdt_changes ORDER BY id DESC LIMIT 1) WHERE typeof(id) IN ('text', 'blob')"
+
+// INSERT into crdt_changes for rows changes of six parameters each
+static char *crdt_log_sql(int rows) {
+    char *sql = sqlite3_mprintf("INSERT INTO crdt_changes (pk, tbl, data, path, op, hlc) VALUES (?, ?, ?, ?, ?, ?)");
+    for (int r = 1; r < rows && sql != NULL; r++) {
+        char *more = sqlite3_mprintf("%s, (?, ?, ?, ?, ?, ?)", sql);
+        sqlite3_free(sql);
+        sql = more;
+    }
+    return sql;
+}
+
+// Rows per INSERT when logging a batch, one step per row costs more than
+// the row itself
+#define CRDT_LOG_ROWS 64
+
+// Append every change of a batch to crdt_changes, CRDT_LOG_ROWS at a time
+// with log and the rest with a statement prepared for the remainder, unless
+// log has as many rows as the remainder. order is CRDT_ORDER_SQL.
+static int crdt_log_changes(sqlite3 *db, sqlite3_stmt *log, sqlite3_stmt *order, const CrdtChange *changes, int count,
+                            int packed) {
+    sqlite3_stmt *tail = NULL;
+    sqlite3_step(order);
+    int rc = sqlite3_reset(order);
+    for (int i = 0; i < count && rc == SQLITE_OK; i += CRDT_LOG_ROWS) {
+        int rows = count - i < CRDT_LOG_ROWS ? count - i : CRDT_LOG_ROWS;
+        sqlite3_stmt *stmt = log;
+        if (sqlite3_bind_parameter_count(log) != rows * 6) {
+            char *sql = crdt_log_sql(rows);
+            rc = sql ? sqlite3_prepare_v2(db, sql, -1, &tail, NULL) : SQLITE_NOMEM;
+            sqlite3_free(sql);
+            stmt = tail;
+        }
+        for (int r = 0; r < rows && rc == SQLITE_OK; r++) {
+            const CrdtChange *change = &changes[i + r];
+            int p = r * 6;
+            sqlite3_bind_text(stmt, p + 1, change->pk, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, p + 2, change->tbl, -1, SQLITE_STATIC);
+            if (change->data != NULL) {
+                sqlite3_bind_blob(stmt, p + 3, change->data, change->data_len, SQLITE_STATIC);
+            } else {
+                sqlite3_bind_null(stmt, p + 3);
+            }
+            sqlite3_bind_text(stmt, p + 4, change->path, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, p + 5, change->op, -1, SQLITE_STATIC);
+            if (packed) {
+                sqlite3_bind_blob(stmt, p + 6, change->key, change->key_len, SQLITE_STATIC);
+            } else {
+                sqlite3_bind_text(stmt, p + 6, change->hlc, -1, SQLITE_STATIC);
+            }
+        }
+        if (rc == SQLITE_OK) {
+            sqlite3_step(stmt);
+            rc = sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_finalize(tail);
+    return rc;
+}
+
+// Apply a parsed batch: resolve the arena offsets, pack the HLCs and log
+// the changes, then sort by record and HLC and fold and save each record.
+static int crdt_compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Expression for the document doc of record id of tbl with the sums of its
+// crdt_counters written over it. Most records have no counters, which
+// costs one lookup. Free with sqlite3_free.
+static char *crdt_counters_sql(const char *doc, const char *tbl, const char *id) {
+    return sqlite3_mprintf(
+        "CASE WHEN EXISTS (SELECT 1 FROM crdt_counters WHERE tbl = %s AND id = %s) THEN crdt_overlay(%s, (\n"
+        "        SELECT jsonb_group_object(path, total) FROM (\n"
+        "            SELECT path, sum(p) - sum(n) AS total FROM crdt_counters WHERE tbl = %s AND id = %s GROUP BY path\n"
+        "        )\n"
+        "    )) ELSE %s END",
+        tbl, id, doc, tbl, id, doc);
+}
+
+// The CRDT_BATCH_SAVE statement for a records table. The fold skips 'pn'
+// changes, the sums of the counters of the record go over its document as
+// in the crdt_changes triggers.
+static char *crdt_save_sql(const char *records, int with_tbl) {
+    char *counters = crdt_counters_sql("?3", "?2", "?1");
+    char *sql = counters == NULL ? NULL : sqlite3_mprintf(
+        "INSERT INTO %w (id, %sdata, hlc, op, path) VALUES (?1, %s%s, ?4, ?5, ?6)\n"
+        "ON CONFLICT (id) DO UPDATE SET\n"
+        "    data = excluded.data, hlc = excluded.hlc, op = excluded.op, path = excluded.path",
+        records, with_tbl ? "tbl, " : "", with_tbl ? "?2, " : "", counters);
+    sqlite3_free(counters);
+    return sql;
+}
+
+// Prepare the CRDT_BATCH_LOAD and CRDT_BATCH_SAVE statements for the
+// records table of a 'dedicated' table, with the same parameters
+static int crdt_prepare_dedicated(sqlite3 *db, const char *tbl, sqlite3_stmt **load, sqlite3_stmt **save) {
+    char *load_sql = sqlite3_mprintf("SELECT data, hlc_pack(hlc) FROM %w_records WHERE id = ?1", tbl);
+    char *records = sqlite3_mprintf("%s_records", tbl);
+    char *save_sql = records ? crdt_save_sql(records, 0) : NULL;
+    sqlite3_free(records);
+    int rc = load_sql && save_sql ? SQLITE_OK : SQLITE_NOMEM;
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, load_sql, -1, load, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, save_sql, -1, save, NULL);
+    sqlite3_free(load_sql);
+    sqlite3_free(save_sql);
+    return rc;
+}
+
+// applying is the crdt_applying() flag of the connection, while it is
+// set the crdt_changes triggers leave the logged changes to the fold.
+static int crdt_apply_batch(sqlite3_stmt **stmts, CrdtChange *changes, int *applied, JsonbBuf *arena, int packed,
+                            int *applying, sqlite3_context *context) {
+    int count = *applied;
+    sqlite3 *db = sqlite3_db_handle(stmts[CRDT_BATCH_LOG]);
+    int dedicated_count;
+    char **dedicated = crdt_dedicated_tables(db, &dedicated_count);
+    if (dedicated_count < 0) {
+        return SQLITE_NOMEM;
+    }
+    int rc = SQLITE_OK;
+    for (int i = 0; i < count; i++) {
+        CrdtChange *change = &changes[i];
+        long pk = (long)(intptr_t)change->pk, tbl = (long)(intptr_t)change->tbl, hlc = (long)(intptr_t)change->hlc;
+        long path = (long)(intptr_t)change->path, op = (long)(intptr_t)change->op;
+        if (pk < 0 || tbl < 0 || hlc < 0) {
+            sqlite3_result_error(context, "Every change needs a pk, tbl and hlc", -1);
+            crdt_free_names(dedicated, dedicated_count);
+            return SQLITE_ABORT;
+        }
+        change->pk = (const char *)arena->data + pk;
+        change->tbl = (const char *)arena->data + tbl;
+        change->hlc = (const char *)arena->data + hlc;
+        change->path = path < 0 ? "$" : (const char *)arena->data + path;
+        change->op = op < 0 ? "=" : (const char *)arena->data + op;
+        change->key = change->key_len > 0 ? arena->data + (intptr_t)change->key : NULL;
+        // The fold only knows record clocks, counter changes go through
+        // the triggers like per path clocks
+        if (strcmp(change->op, "pn") == 0) {
+            *applying = 0;
+        }
+        if (dedicated_count > 0 && bsearch(&change->tbl, dedicated, (size_t)dedicated_count, sizeof(char *), crdt_compare_names)) {
+            change->dedicated = change->tbl;
+        }
+    }
+
+    // The packed HLCs go to a second arena, the first one is referenced now
+    JsonbBuf keys;
+    jsonb_buf_init(&keys);
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        if (changes[i].key != NULL) {
+            size_t offset = keys.len;
+            jsonb_buf_append(&keys, changes[i].key, (size_t)changes[i].key_len);
+            changes[i].key = (const unsigned char *)(intptr_t)offset;
+            continue;
+        }
+        unsigned char key[CRDT_KEY_SIZE];
+        rc = crdt_pack_key(stmts[CRDT_BATCH_PACK], changes[i].hlc, key, &changes[i].key_len);
+        if (rc == SQLITE_FORMAT) {
+            sqlite3_result_error(context, "crdt_apply_changes failed: Invalid HLC provided for packing", -1);
+            rc = SQLITE_ABORT;
+        }
+        if (rc == SQLITE_OK) {
+            changes[i].key = (const unsigned char *)(intptr_t)keys.len;
+            jsonb_buf_append(&keys, key, (size_t)changes[i].key_len);
+        }
+    }
+    if (rc == SQLITE_OK && keys.oom) {
+        rc = SQLITE_NOMEM;
+    }
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        changes[i].key = keys.data + (intptr_t)changes[i].key;
+    }
+    // A change more than CRDT_MAX_DRIFT ahead of the local clock is left
+    // out: hlc_recv refuses its HLC, and kept it would win against every
+    // local write until the clock caught up. The rest of the batch still
+    // goes in, *applied tells the caller how many did.
+    if (rc == SQLITE_OK) {
+        sqlite3_int64 now = crdt_wall_millis();
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (!crdt_key_skewed(changes[i].key, changes[i].key_len, now)) {
+                changes[kept++] = changes[i];
+            }
+        }
+        count = *applied = kept;
+    }
+    // Logged in batch order, usually HLC order, which keeps the inserts into
+    // the crdt_changes indexes on hlc appends rather than random writes
+    if (rc == SQLITE_OK) {
+        rc = crdt_log_changes(sqlite3_db_handle(stmts[CRDT_BATCH_LOG]), stmts[CRDT_BATCH_LOG], stmts[CRDT_BATCH_ORDER],
+                              changes, count, packed);
+    }
+    // With per path clocks or counter changes the triggers applied every
+    // change as it was logged
+    if (!*applying) {
+        jsonb_buf_free(&keys);
+        crdt_free_names(dedicated, dedicated_count);
+        return rc;
+    }
+    if (rc == SQLITE_OK) {
+        qsort(changes, (size_t)count, sizeof(CrdtChange), crdt_change_compare);
+    }
+
+    // Changes are sorted by records table, so the statements of a
+    // 'dedicated' table are prepared once when its first change comes up
+    sqlite3_stmt *load = stmts[CRDT_BATCH_LOAD], *save = stmts[CRDT_BATCH_SAVE];
+    sqlite3_stmt *dedicated_load = NULL, *dedicated_save = NULL;
+    CrdtFold fold;
+    memset(&fold, 0, sizeof(CrdtFold));
+    const CrdtChange *first = NULL;
+    const CrdtChange *newest = NULL;
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        const CrdtChange *change = &changes[i];
+        // A new record starts, write back the previous one
+        int new_table = first == NULL || crdt_dedicated_compare(first, change) != 0;
+        if (new_table || strcmp(first->pk, change->pk) != 0) {
+            if (first != NULL) rc = crdt_fold_save(&fold, save, first, packed);
+            crdt_fold_reset(&fold);
+            first = change;
+            if (rc == SQLITE_OK && new_table && change->dedicated != NULL) {
+                sqlite3_finalize(dedicated_load);
+                sqlite3_finalize(dedicated_save);
+                dedicated_load = dedicated_save = NULL;
+                rc = crdt_prepare_dedicated(db, change->dedicated, &dedicated_load, &dedicated_save);
+                load = dedicated_load;
+                save = dedicated_save;
+            }
+            if (rc == SQLITE_OK) rc = crdt_fold_load(&fold, load, change->pk);
+        }
+        if (rc == SQLITE_OK) {
+            rc = crdt_fold_apply(&fold, change);
+        }
+        if (newest == NULL || crdt_key_compare(change->key, change->key_len, newest->key, newest->key_len) > 0) {
+            newest = change;
+        }
+    }
+    if (rc == SQLITE_OK && first != NULL) {
+        rc = crdt_fold_save(&fold, save, first, packed);
+    }
+    crdt_fold_reset(&fold);
+    sqlite3_finalize(dedicated_load);
+    sqlite3_finalize(dedicated_save);
+    crdt_free_names(dedicated, dedicated_count);
+
+    // Move the local clock past the newest change, like the trigger does
+    // for every change it applies
+    if (rc == SQLITE_OK && newest != NULL) {
+        sqlite3_bind_blob(stmts[CRDT_BATCH_RECV], 1, newest->key, newest->key_len, SQLITE_STATIC);
+        sqlite3_step(stmts[CRDT_BATCH_RECV]);
+        rc = sqlite3_reset(stmts[CRDT_BATCH_RECV]);
+    }
+    jsonb_buf_free(&keys);
+    return rc;
+}
+
+// crdt_apply_changes(batch)
+//
+// Apply a batch of remote changes in one savepoint. batch is a JSON array
+// (text or JSONB) of objects with the crdt_changes columns:
+//
+//     [{"pk": "1", "tbl": "people", "data": {...}, "path": "$", "op": "=", "hlc": "..."}]
+//
+// A missing or null data deletes the record. The batch is sorted by record
+// and HLC and every record is folded in memory, so it is read and written
+// once no matter how many changes the batch has for it. Every change is
+// still logged to crdt_changes. With 'paths' clocks the changes are only
+// logged and the crdt_changes triggers apply them. Changes with an HLC more
+// than a minute ahead of the local clock are skipped. Returns the number of
+// changes applied.
+//
+// crdt_import(changeset) applies a changeset of crdt_export the same way.
+static void crdt_apply(sqlite3_context *context, sqlite3_value *input, const char *name, int changeset) {
+    CrdtConnection *conn = (CrdtConnection *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (sqlite3_value_type(input) == SQLITE_NULL) {
+        sqlite3_result_int(context, 0);
+        return;
+    }
+    char *err = NULL;
+    if (changeset && sqlite3_value_type(input) != SQLITE_BLOB) {
+        err = sqlite3_mprintf("%s expects a changeset blob from crdt_export", name);
+    } else if (conn->applying) {
+        err = sqlite3_mprintf("%s cannot be nested", name);
+    }
+    if (err != NULL) {
+        sqlite3_result_error(context, err, -1);
+        sqlite3_free(err);
+        return;
+    }
+
+    // Databases created before crdt_applying() existed would apply every
+    // change twice, once here and once more in the trigger
+    if (!crdt_schema_current(db)) {
+        err = sqlite3_mprintf("%s needs the crdt tables from crdt_create, run crdt_create again to upgrade them", name);
+        sqlite3_result_error(context, err, -1);
+        sqlite3_free(err);
+        return;
+    }
+
+    int packed = uses_packed_hlc(db);
+    int path_clocks = uses_path_clocks(db);
+    static const char *const sql[CRDT_BATCH_COUNT] = {
+        "SELECT jsonb(?1)",
+        "SELECT hlc_pack(?1)",
+        "SELECT data, hlc_pack(hlc) FROM crdt_records WHERE id = ?1",
+        NULL, // crdt_log_sql(CRDT_LOG_ROWS)
+        NULL, // crdt_save_sql("crdt_records", 1)
+        "SELECT hlc_recv(?1)",
+        "SELECT hlc_unpack(?1)",
+        CRDT_ORDER_SQL,
+    };
+    sqlite3_stmt *stmts[CRDT_BATCH_COUNT] = { NULL };
+    CrdtChange *changes = NULL;
+    int count = 0;
+    JsonbBuf arena;
+    jsonb_buf_init(&arena);
+
+    int rc = sqlite3_exec(db, "SAVEPOINT crdt_apply_changes", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+    // With per path clocks the crdt_changes triggers apply the batch as it
+    // is logged, crdt_apply_batch clears it for counter changes too
+    conn->applying = !path_clocks;
+
+    char *log_sql = crdt_log_sql(CRDT_LOG_ROWS);
+    char *save_sql = crdt_save_sql("crdt_records", 1);
+    if (log_sql == NULL || save_sql == NULL) {
+        rc = SQLITE_NOMEM;
+    }
+    for (int i = 0; i < CRDT_BATCH_COUNT && rc == SQLITE_OK; i++) {
+        rc = sqlite3_prepare_v2(db, sql[i] ? sql[i] : i == CRDT_BATCH_LOG ? log_sql : save_sql, -1, &stmts[i], NULL);
+    }
+    sqlite3_free(log_sql);
+    sqlite3_free(save_sql);
+    if (rc == SQLITE_OK && changeset) {
+        rc = crdt_parse_changeset(sqlite3_value_blob(input), (size_t)sqlite3_value_bytes(input),
+                                  packed ? NULL : stmts[CRDT_BATCH_UNPACK], &changes, &count, &arena);
+        if (rc == SQLITE_OK) {
+            rc = crdt_apply_batch(stmts, changes, &count, &arena, packed, &conn->applying, context);
+        }
+    } else if (rc == SQLITE_OK) {
+        // The batch is parsed once in C, not once per field with ->>
+        sqlite3_stmt *batch = stmts[CRDT_BATCH_JSONB];
+        sqlite3_bind_value(batch, 1, input);
+        if (sqlite3_step(batch) == SQLITE_ROW) {
+            rc = crdt_parse_batch(sqlite3_column_blob(batch, 0), (size_t)sqlite3_column_bytes(batch, 0),
+                                  &changes, &count, &arena);
+        } else {
+            rc = sqlite3_reset(batch);
+        }
+        if (rc == SQLITE_OK) {
+            rc = crdt_apply_batch(stmts, changes, &count, &arena, packed, &conn->applying, context);
+        }
+    }
+    conn->applying = 0;
+    sqlite3_free(changes);
+    jsonb_buf_free(&arena);
+    for (int i = 0; i < CRDT_BATCH_COUNT; i++) {
+        if (rc == SQLITE_OK) rc = sqlite3_reset(stmts[i]);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "RELEASE crdt_apply_changes", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        // Report before finalizing, which clears the error message
+        if (rc == SQLITE_NOMEM) {
+            sqlite3_result_error_nomem(context);
+        } else if (rc == SQLITE_FORMAT) {
+            err = sqlite3_mprintf("%s: malformed %s, JSONB or JSON path", name, changeset ? "changeset" : "batch");
+            sqlite3_result_error(context, err, -1);
+            sqlite3_free(err);
+        } else if (rc != SQLITE_ABORT) {
+            err = sqlite3_mprintf("%s failed: %s", name, sqlite3_errmsg(db));
+            sqlite3_result_error(context, err ? err : sqlite3_errmsg(db), -1);
+            sqlite3_free(err);
+        }
+    }
+    for (int i = 0; i < CRDT_BATCH_COUNT; i++) {
+        sqlite3_finalize(stmts[i]);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK TO crdt_apply_changes; RELEASE crdt_apply_changes", NULL, NULL, NULL);
+        return;
+    }
+    sqlite3_result_int(context, count);
+}
+
+static void crdt_apply_changes(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    crdt_apply(context, argv[0], "crdt_apply_changes", 0);
+}
+
+static void crdt_import(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    crdt_apply(context, argv[0], "crdt_import", 1);
+}
+
+// SQLite session changesets for crdt_capture
+//
+// sqlite3session_changeset() writes a list of tables, each one as 'T' ('P'
+// in a patchset), a varint column count, one byte per column that is 1 for
+// the primary key and the NUL terminated table name, followed by its
+// changes. A change is the op (SQLITE_INSERT, SQLITE_UPDATE or
+// SQLITE_DELETE), the indirect flag and its records: the new row of an
+// INSERT, the old row of a DELETE (only its primary key in a patchset) and
+// the old and the new row of an UPDATE (only the new one in a patchset). A
+// record has a value per column, a type byte (0 for a column the change
+// left alone) followed by 8 big endian bytes for an integer or a real, or
+// by a varint size and the bytes of a text or a blob. These varints are
+// SQLite's, big endian with up to 9 bytes.
+typedef struct {
+    int type;               // SQLITE_INTEGER to SQLITE_NULL, 0 if left alone
+    const unsigned char *z; // Bytes of a text or a blob
+    size_t n;
+} CrdtSessionValue;
+
+static int crdt_session_varint(const unsigned char *z, size_t n, size_t *i, sqlite3_uint64 *v) {
+    *v = 0;
+    for (int k = 0; k < 9 && *i < n; k++) {
+        unsigned char b = z[(*i)++];
+        if (k == 8) {
+            *v = (*v << 8) | b;
+            return 1;
+        }
+        *v = (*v << 7) | (b & 0x7F);
+        if ((b & 0x80) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read the record at *i into values, only its primary key columns if
+// pk_only is set. Returns 0 if it is malformed.
+static int crdt_session_record(const unsigned char *z, size_t n, size_t *i, int columns, const unsigned char *pk,
+                               int pk_only, CrdtSessionValue *values) {
+    for (int c = 0; c < columns; c++) {
+        CrdtSessionValue *value = &values[c];
+        memset(value, 0, sizeof(CrdtSessionValue));
+        if (pk_only && !pk[c]) {
+            continue;
+        }
+        if (*i >= n) {
+            return 0;
+        }
+        value->type = z[(*i)++];
+        if (value->type == SQLITE_INTEGER || value->type == SQLITE_FLOAT) {
+            if (n - *i < 8) return 0;
+            *i += 8;
+        } else if (value->type == SQLITE_TEXT || value->type == SQLITE_BLOB) {
+            sqlite3_uint64 size;
+            if (!crdt_session_varint(z, n, i, &size) || size > n - *i) return 0;
+            value->z = z + *i;
+            value->n = (size_t)size;
+            *i += (size_t)size;
+        } else if (value->type != 0 && value->type != SQLITE_NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Position of the id, tbl and hlc columns of records in its changeset
+// rows of columns values, -1 for a missing one. Depending on the SQLite
+// version sessions leave the generated columns out or keep them, the
+// number of columns tells which.
+static int crdt_capture_columns(sqlite3 *db, const char *records, int columns, int positions[3]) {
+    static const char *const names[3] = { "id", "tbl", "hlc" };
+    static const char *const sql[2] = {
+        "SELECT name FROM pragma_table_info(?1)",
+        "SELECT name FROM pragma_table_xinfo(?1)",
+    };
+    for (int s = 0; s < 2; s++) {
+        sqlite3_stmt *stmt = NULL;
+        int rc = sqlite3_prepare_v2(db, sql[s], -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        sqlite3_bind_text(stmt, 1, records, -1, SQLITE_STATIC);
+        int c = 0;
+        positions[0] = positions[1] = positions[2] = -1;
+        for (; sqlite3_step(stmt) == SQLITE_ROW; c++) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 0);
+            for (int f = 0; f < 3; f++) {
+                if (name != NULL && strcmp(name, names[f]) == 0) positions[f] = c;
+            }
+        }
+        rc = sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        if (c == columns) {
+            return positions[0] >= 0 && positions[2] >= 0 ? SQLITE_OK : SQLITE_FORMAT;
+        }
+    }
+    return SQLITE_FORMAT;
+}
+
+// The records table of a changeset table and its statements
+typedef struct {
+    char *tbl;              // tbl of a 'dedicated' table, NULL for crdt_records
+    int id, tbl_column, hlc; // Positions in the changeset rows
+    sqlite3_stmt *load;      // Current row of a record
+    sqlite3_stmt *stamp;     // New HLC for a row written without one
+    sqlite3_stmt *tombstone; // Tombstone for a deleted row
+} CrdtCaptureTable;
+
+static void crdt_capture_table_reset(CrdtCaptureTable *table) {
+    sqlite3_free(table->tbl);
+    sqlite3_finalize(table->load);
+    sqlite3_finalize(table->stamp);
+    sqlite3_finalize(table->tombstone);
+    memset(table, 0, sizeof(CrdtCaptureTable));
+}
+
+// Set up table for the changeset table name of columns columns. Returns
+// SQLITE_DONE for a table that holds no crdt records.
+static int crdt_capture_table(sqlite3 *db, const char *name, int columns, int packed, CrdtCaptureTable *table) {
+    size_t len = strlen(name);
+    int with_tbl = strcmp(name, "crdt_records") == 0;
+    if (!with_tbl) {
+        if (len <= 8 || strcmp(name + len - 8, "_records") != 0) {
+            return SQLITE_DONE;
+        }
+        table->tbl = sqlite3_mprintf("%.*s", (int)(len - 8), name);
+        if (table->tbl == NULL) {
+            return SQLITE_NOMEM;
+        }
+        if (!crdt_is_dedicated(db, table->tbl)) {
+            return SQLITE_DONE;
+        }
+    }
+    int positions[3];
+    int rc = crdt_capture_columns(db, name, columns, positions);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    table->id = positions[0];
+    table->tbl_column = positions[1];
+    table->hlc = positions[2];
+
+    const char *hlc = packed ? "hlc_pack(hlc)" : "hlc";
+    const char *pack = packed ? "hlc_pack" : "";
+    char *load = sqlite3_mprintf("SELECT data, %s, %s FROM %w WHERE id = ?1", hlc, with_tbl ? "tbl" : "NULL", name);
+    char *stamp = sqlite3_mprintf("UPDATE %w SET hlc = %s(hlc_now(?2)) WHERE id = ?1 RETURNING %s", name, pack, hlc);
+    char *tombstone = sqlite3_mprintf("INSERT INTO %w (id, %sdata, hlc) VALUES (?1, %sNULL, %s(hlc_now(?2))) RETURNING %s",
+                                      name, with_tbl ? "tbl, " : "", with_tbl ? "?3, " : "", pack, hlc);
+    rc = load && stamp && tombstone ? SQLITE_OK : SQLITE_NOMEM;
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, load, -1, &table->load, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, stamp, -1, &table->stamp, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, tombstone, -1, &table->tombstone, NULL);
+    sqlite3_free(load);
+    sqlite3_free(stamp);
+    sqlite3_free(tombstone);
+    return rc;
+}
+
+// Copy column of the current row of stmt to the arena, NUL terminated if
+// text is set, and return its offset
+static long crdt_arena_column(JsonbBuf *arena, sqlite3_stmt *stmt, int column, int text) {
+    size_t start = arena->len;
+    const void *z = text ? (const void *)sqlite3_column_text(stmt, column) : sqlite3_column_blob(stmt, column);
+    jsonb_buf_append(arena, z, (size_t)sqlite3_column_bytes(stmt, column));
+    if (text) {
+        jsonb_buf_append(arena, "", 1);
+    }
+    return (long)start;
+}
+
+// Turn the row of id that a change of the session touched into a '$'
+// change holding the row as it is now. A row the change gave no HLC gets
+// a new one and a deleted row becomes a tombstone. deleted_tbl is the tbl
+// of a row deleted from crdt_records, if the changeset has it.
+static int crdt_capture_row(CrdtCaptureTable *table, const CrdtSessionValue *id, const CrdtSessionValue *deleted_tbl,
+                            int has_hlc, const char *node_id, int packed, JsonbBuf *arena, CrdtChange *change) {
+    memset(change, 0, sizeof(CrdtChange));
+    change->path = "$";
+    change->op = "=";
+    change->data_len = -1;
+    sqlite3_stmt *load = table->load;
+    sqlite3_bind_text(load, 1, (const char *)id->z, (int)id->n, SQLITE_STATIC);
+    sqlite3_stmt *row = NULL;
+    int rc = SQLITE_OK;
+    if (sqlite3_step(load) == SQLITE_ROW) {
+        if (sqlite3_column_type(load, 0) != SQLITE_NULL) {
+            change->data_len = sqlite3_column_bytes(load, 0);
+            change->data = (const unsigned char *)(intptr_t)crdt_arena_column(arena, load, 0, 0);
+        }
+        if (table->tbl == NULL) {
+            change->tbl = (const char *)(intptr_t)crdt_arena_column(arena, load, 2, 1);
+        }
+        row = load;
+        if (!has_hlc) {
+            sqlite3_bind_text(table->stamp, 1, (const char *)id->z, (int)id->n, SQLITE_STATIC);
+            sqlite3_bind_text(table->stamp, 2, node_id, -1, SQLITE_STATIC);
+            row = sqlite3_step(table->stamp) == SQLITE_ROW ? table->stamp : NULL;
+        }
+    } else if ((rc = sqlite3_reset(load)) == SQLITE_OK) {
+        if (table->tbl == NULL && (deleted_tbl == NULL || deleted_tbl->type != SQLITE_TEXT)) {
+            rc = SQLITE_MISUSE;
+        } else {
+            sqlite3_stmt *tombstone = table->tombstone;
+            sqlite3_bind_text(tombstone, 1, (const char *)id->z, (int)id->n, SQLITE_STATIC);
+            sqlite3_bind_text(tombstone, 2, node_id, -1, SQLITE_STATIC);
+            if (table->tbl == NULL) {
+                sqlite3_bind_text(tombstone, 3, (const char *)deleted_tbl->z, (int)deleted_tbl->n, SQLITE_STATIC);
+                change->tbl = (const char *)(intptr_t)arena->len;
+                jsonb_buf_append(arena, deleted_tbl->z, deleted_tbl->n);
+                jsonb_buf_append(arena, "", 1);
+            }
+            row = sqlite3_step(tombstone) == SQLITE_ROW ? tombstone : NULL;
+        }
+    }
+    if (row != NULL) {
+        int column = row == load ? 1 : 0;
+        if (packed) {
+            change->key_len = sqlite3_column_bytes(row, column);
+            change->key = (const unsigned char *)(intptr_t)crdt_arena_column(arena, row, column, 0);
+        } else {
+            change->hlc = (const char *)(intptr_t)crdt_arena_column(arena, row, column, 1);
+        }
+    }
+    change->pk = (const char *)(intptr_t)arena->len;
+    jsonb_buf_append(arena, id->z, id->n);
+    jsonb_buf_append(arena, "", 1);
+    if (table->tbl != NULL) {
+        change->tbl = (const char *)(intptr_t)arena->len;
+        jsonb_buf_append(arena, table->tbl, strlen(table->tbl) + 1);
+    }
+
+    sqlite3_stmt *stmts[3] = { table->stamp, table->tombstone, load };
+    for (int i = 0; i < 3; i++) {
+        int reset = sqlite3_reset(stmts[i]);
+        if (rc == SQLITE_OK) rc = reset;
+    }
+    if (rc == SQLITE_OK && row == NULL) {
+        rc = SQLITE_ERROR;
+    }
+    return rc == SQLITE_OK && arena->oom ? SQLITE_NOMEM : rc;
+}
+
+// Read a session changeset and capture every row its direct changes to
+// crdt records tables touched. Indirect changes were made by triggers,
+// the crdt_changes triggers among them, which log their own writes.
+static int crdt_capture_changeset(sqlite3 *db, const unsigned char *z, size_t n, const char *node_id, int packed,
+                                  CrdtChange **changes, int *count, JsonbBuf *arena) {
+    CrdtCaptureTable table;
+    memset(&table, 0, sizeof(CrdtCaptureTable));
+    CrdtSessionValue *old_row = NULL, *new_row = NULL;
+    int cap = 0;
+    int rc = SQLITE_OK;
+    for (size_t i = 0; i < n && rc == SQLITE_OK;) {
+        // Table header
+        int patchset = z[i] == 'P';
+        sqlite3_uint64 columns;
+        if ((z[i] != 'T' && !patchset) || (++i, !crdt_session_varint(z, n, &i, &columns))
+                || columns == 0 || columns > n - i) {
+            rc = SQLITE_FORMAT;
+            break;
+        }
+        const unsigned char *pk = z + i;
+        i += (size_t)columns;
+        const unsigned char *end = memchr(z + i, 0, n - i);
+        if (end == NULL) {
+            rc = SQLITE_FORMAT;
+            break;
+        }
+        const char *name = (const char *)z + i;
+        i = (size_t)(end - z) + 1;
+
+        crdt_capture_table_reset(&table);
+        sqlite3_free(old_row);
+        sqlite3_free(new_row);
+        old_row = (CrdtSessionValue *)sqlite3_malloc64(columns * sizeof(CrdtSessionValue));
+        new_row = (CrdtSessionValue *)sqlite3_malloc64(columns * sizeof(CrdtSessionValue));
+        rc = old_row && new_row ? crdt_capture_table(db, name, (int)columns, packed, &table) : SQLITE_NOMEM;
+        int captured = rc == SQLITE_OK;
+        if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+        }
+
+        // Its changes, up to the next table
+        while (rc == SQLITE_OK && i < n && z[i] != 'T' && z[i] != 'P') {
+            int op = z[i++];
+            int indirect = i < n ? z[i++] : -1;
+            int ok = indirect == 0 || indirect == 1;
+            if (ok && op == SQLITE_INSERT) {
+                ok = crdt_session_record(z, n, &i, (int)columns, pk, 0, new_row);
+            } else if (ok && op == SQLITE_DELETE) {
+                ok = crdt_session_record(z, n, &i, (int)columns, pk, patchset, old_row);
+            } else if (ok && op == SQLITE_UPDATE) {
+                ok = (patchset || crdt_session_record(z, n, &i, (int)columns, pk, 0, old_row))
+                    && crdt_session_record(z, n, &i, (int)columns, pk, 0, new_row);
+            } else {
+                ok = 0;
+            }
+            if (!ok) {
+                rc = SQLITE_FORMAT;
+                break;
+            }
+            if (!captured || indirect) {
+                continue;
+            }
+            const CrdtSessionValue *row = op == SQLITE_DELETE || (op == SQLITE_UPDATE && !patchset) ? old_row : new_row;
+            const CrdtSessionValue *id = &row[table.id];
+            if (id->type != SQLITE_TEXT) {
+                rc = SQLITE_FORMAT;
+                break;
+            }
+            if (*count == cap) {
+                cap = cap ? cap * 2 : 64;
+                CrdtChange *grown = (CrdtChange *)sqlite3_realloc64(*changes, (sqlite3_uint64)cap * sizeof(CrdtChange));
+                if (grown == NULL) {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                *changes = grown;
+            }
+            int has_hlc = op == SQLITE_INSERT || (op == SQLITE_UPDATE && new_row[table.hlc].type != 0);
+            const CrdtSessionValue *deleted_tbl = op == SQLITE_DELETE && table.tbl_column >= 0 ? &old_row[table.tbl_column] : NULL;
+            rc = crdt_capture_row(&table, id, deleted_tbl, has_hlc, node_id, packed, arena, &(*changes)[(*count)++]);
+        }
+    }
+    crdt_capture_table_reset(&table);
+    sqlite3_free(old_row);
+    sqlite3_free(new_row);
+    return rc;
+}
+
+// crdt_capture(changeset, node_id)
+//
+// Log the writes an SQLite session recorded on crdt_records or on the
+// records table of a 'dedicated' table. Writing the records tables
+// directly skips the INSTEAD OF and crdt_changes triggers, the session
+// notes the rows written without running anything per row and at the end
+// of the transaction crdt_capture logs each of them once, in the same
+// batched INSERTs as crdt_apply_changes. Every row becomes a '=' change at
+// '$' holding the row as it is now and its HLC. A row written without an
+// HLC gets one from hlc_now(node_id) and a deleted row is put back as a
+// tombstone. With 'paths' clocks the row's clocks are replaced by one at
+// '$'. Returns the number of changes logged.
+static void crdt_capture(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    CrdtConnection *conn = (CrdtConnection *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_int(context, 0);
+        return;
+    }
+    const char *node_id = (const char *)sqlite3_value_text(argv[1]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || node_id == NULL) {
+        sqlite3_result_error(context, "crdt_capture expects a session changeset blob and a node_id", -1);
+        return;
+    }
+    if (conn->applying) {
+        sqlite3_result_error(context, "crdt_capture cannot be nested", -1);
+        return;
+    }
+
+    int packed = uses_packed_hlc(db);
+    int path_clocks = uses_path_clocks(db);
+    CrdtChange *changes = NULL;
+    int count = 0;
+    JsonbBuf arena;
+    jsonb_buf_init(&arena);
+    sqlite3_stmt *log = NULL, *order = NULL, *clear = NULL, *clock = NULL;
+
+    int rc = sqlite3_exec(db, "SAVEPOINT crdt_capture", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+    char *log_sql = crdt_log_sql(CRDT_LOG_ROWS);
+    rc = log_sql ? sqlite3_prepare_v2(db, log_sql, -1, &log, NULL) : SQLITE_NOMEM;
+    sqlite3_free(log_sql);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, CRDT_ORDER_SQL, -1, &order, NULL);
+    }
+    if (rc == SQLITE_OK && path_clocks) {
+        rc = sqlite3_prepare_v2(db, "DELETE FROM crdt_clocks WHERE tbl = ?1 AND id = ?2", -1, &clear, NULL);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_prepare_v2(db, "INSERT INTO crdt_clocks (tbl, id, path, hlc) VALUES (?1, ?2, '$', ?3)", -1, &clock, NULL);
+        }
+    }
+    if (rc == SQLITE_OK) {
+        rc = crdt_capture_changeset(db, sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]), node_id,
+                                    packed, &changes, &count, &arena);
+    }
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        CrdtChange *change = &changes[i];
+        change->pk = (const char *)arena.data + (intptr_t)change->pk;
+        change->tbl = (const char *)arena.data + (intptr_t)change->tbl;
+        if (packed) {
+            change->key = arena.data + (intptr_t)change->key;
+        } else {
+            change->hlc = (const char *)arena.data + (intptr_t)change->hlc;
+        }
+        if (change->data_len < 0) {
+            change->data_len = 0;
+        } else {
+            change->data = arena.data + (intptr_t)change->data;
+        }
+        if (clear != NULL) {
+            sqlite3_bind_text(clear, 1, change->tbl, -1, SQLITE_STATIC);
+            sqlite3_bind_text(clear, 2, change->pk, -1, SQLITE_STATIC);
+            sqlite3_step(clear);
+            rc = sqlite3_reset(clear);
+            sqlite3_bind_text(clock, 1, change->tbl, -1, SQLITE_STATIC);
+            sqlite3_bind_text(clock, 2, change->pk, -1, SQLITE_STATIC);
+            if (packed) {
+                sqlite3_bind_blob(clock, 3, change->key, change->key_len, SQLITE_STATIC);
+            } else {
+                sqlite3_bind_text(clock, 3, change->hlc, -1, SQLITE_STATIC);
+            }
+            if (rc == SQLITE_OK) {
+                sqlite3_step(clock);
+                rc = sqlite3_reset(clock);
+            }
+        }
+    }
+    // The records already hold the changes, the crdt_changes triggers
+    // skip them like a batch of crdt_apply_changes
+    if (rc == SQLITE_OK) {
+        conn->applying = 1;
+        rc = crdt_log_changes(db, log, order, changes, count, packed);
+        conn->applying = 0;
+    }
+    sqlite3_free(changes);
+    jsonb_buf_free(&arena);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "RELEASE crdt_capture", NULL, NULL, NULL);
+    }
+    if (rc == SQLITE_NOMEM) {
+        sqlite3_result_error_nomem(context);
+    } else if (rc == SQLITE_FORMAT) {
+        sqlite3_result_error(context, "crdt_capture: malformed changeset", -1);
+    } else if (rc == SQLITE_MISUSE) {
+        sqlite3_result_error(context, "crdt_capture: a patchset leaves out the tbl of rows deleted from crdt_records, record a changeset", -1);
+    } else if (rc != SQLITE_OK) {
+        char *err = sqlite3_mprintf("crdt_capture failed: %s", sqlite3_errmsg(db));
+        sqlite3_result_error(context, err ? err : sqlite3_errmsg(db), -1);
+        sqlite3_free(err);
+    }
+    sqlite3_finalize(log);
+    sqlite3_finalize(order);
+    sqlite3_finalize(clear);
+    sqlite3_finalize(clock);
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK TO crdt_capture; RELEASE crdt_capture", NULL, NULL, NULL);
+        return;
+    }
+    sqlite3_result_int(context, count);
+}
+
+// Rows crdt_compact removes per call unless it is given a limit
+#define CRDT_COMPACT_LIMIT 10000
+
+// crdt_compact(before_hlc [, limit])
+//
+// Remove dead history older than before_hlc: crdt_changes rows that no
+// longer make up the state of their record, and tombstones in
+// crdt_records. A change is superseded once its record was last written
+// whole, '=' at '$', by a newer change; the rest of the log still builds
+// the records for a peer that joins later or reads crdt_export. Superseded
+// changes go once every peer with a crdt_changes_since watermark has been
+// sent them, without watermarks none do. Tombstones older than before_hlc
+// are past their grace period, a change for the record older than that
+// would bring it back, and they go with all of their changes, up to the
+// watermarks if there are any.
+//
+// At most limit rows are removed so the write transaction stays short,
+// call it until it returns 0 to compact everything.
+static void crdt_compact(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1 && argc != 2) {
+        sqlite3_result_error(context, "crdt_compact requires 1 or 2 arguments", -1);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "before_hlc cannot be NULL", -1);
+        return;
+    }
+    sqlite3_int64 limit = argc == 2 ? sqlite3_value_int64(argv[1]) : CRDT_COMPACT_LIMIT;
+    if (limit <= 0) {
+        sqlite3_result_int(context, 0);
+        return;
+    }
+
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    int packed = uses_packed_hlc(db);
+    const char *older = packed ? "hlc < hlc_pack(?1)" : "hlc_compare(hlc, ?1) < 0";
+
+    // Tombstones of 'dedicated' tables are in their own records tables
+    int dedicated_count;
+    char **dedicated = crdt_dedicated_tables(db, &dedicated_count);
+
+    // Changes are scanned in id order, each one next to its record: the
+    // records of 'dedicated' tables are in their own tables, the others in
+    // crdt_records
+#define CRDT_WATERMARK "(SELECT min(value) FROM crdt_kv WHERE key LIKE 'watermark:%%')"
+    char *others = sqlite3_mprintf("");
+    for (int i = 0; i < dedicated_count && others != NULL; i++) {
+        char *more = sqlite3_mprintf("%s%s%Q", others, i ? ", " : "c.tbl NOT IN (", dedicated[i]);
+        sqlite3_free(others);
+        others = more;
+    }
+    char *changes = NULL;
+    for (int i = -1; i < dedicated_count && others != NULL; i++) {
+        char *records = i < 0 ? sqlite3_mprintf("crdt_records") : sqlite3_mprintf("%s_records", dedicated[i]);
+        char *tbl = i < 0 ? sqlite3_mprintf("%s%s", others, dedicated_count ? ")" : "true")
+                          : sqlite3_mprintf("c.tbl = %Q", dedicated[i]);
+        char *branch = records && tbl ? sqlite3_mprintf(
+            "SELECT c.id, c.hlc FROM crdt_changes c LEFT JOIN %w r ON r.id = c.pk\n"
+            "    WHERE c.id <= IFNULL(" CRDT_WATERMARK ", (SELECT max(id) FROM crdt_changes))\n"
+            "    AND %s AND %s\n"
+            "    AND (r.id IS NULL OR r.deleted = 1 AND %s\n"
+            "        OR c.id <= " CRDT_WATERMARK " AND c.op IS NOT 'pn' AND r.op = '=' AND r.path = '$' AND %s)",
+            records,
+            packed ? "c.hlc < hlc_pack(?1)" : "hlc_compare(c.hlc, ?1) < 0", tbl,
+            packed ? "r.hlc < hlc_pack(?1)" : "hlc_compare(r.hlc, ?1) < 0",
+            packed ? "c.hlc < r.hlc" : "hlc_compare(c.hlc, r.hlc) < 0") : NULL;
+        char *more = branch == NULL ? NULL : changes == NULL ? sqlite3_mprintf("%s", branch)
+                                                             : sqlite3_mprintf("%s\nUNION ALL\n%s", changes, branch);
+        sqlite3_free(records);
+        sqlite3_free(tbl);
+        sqlite3_free(branch);
+        sqlite3_free(changes);
+        changes = more;
+        if (changes == NULL) break;
+    }
+#undef CRDT_WATERMARK
+    sqlite3_free(others);
+    if (changes != NULL) {
+        char *ordered = sqlite3_mprintf("SELECT id, hlc FROM (%s) ORDER BY id LIMIT ?2", changes);
+        sqlite3_free(changes);
+        changes = ordered;
+    }
+    char *sql[2];
+    sql[0] = sqlite3_mprintf("DELETE FROM crdt_changes WHERE id IN (SELECT id FROM (%s))", changes);
+    sql[1] = sqlite3_mprintf(
+        "DELETE FROM crdt_records WHERE id IN (\n"
+        "    SELECT id FROM crdt_records WHERE deleted = 1 AND %s ORDER BY id LIMIT ?2\n"
+        ")",
+        older);
+
+    // With per path clocks the clocks of the tombstones go first, selected
+    // the same way, and so do their counters. Tables from before counters
+    // existed have none.
+    int path_clocks = uses_path_clocks(db);
+    int counters = sqlite3_table_column_metadata(db, "main", "crdt_counters", NULL, NULL, NULL, NULL, NULL, NULL) == SQLITE_OK;
+
+    // crdt_digest keeps the changes, crdt_create explains why
+    char *horizon = !uses_digest(db) ? NULL : sqlite3_mprintf(
+        "INSERT INTO crdt_kv (key, value)\n"
+        "SELECT 'digest_compacted', hlc_max(hlc) FROM (\n"
+        "    SELECT value AS hlc FROM crdt_kv WHERE key = 'digest_compacted'\n"
+        "    UNION ALL SELECT hlc FROM (%s)\n"
+        ") HAVING count(*) > 0",
+        changes);
+
+    int rc = changes && sql[0] && sql[1] && dedicated_count >= 0 ? SQLITE_OK : SQLITE_NOMEM;
+    if (rc == SQLITE_OK && horizon != NULL) {
+        sqlite3_stmt *stmt = NULL;
+        rc = sqlite3_prepare_v2(db, horizon, -1, &stmt, NULL);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_value(stmt, 1, argv[0]);
+            sqlite3_bind_int64(stmt, 2, limit);
+            sqlite3_step(stmt);
+            rc = sqlite3_finalize(stmt);
+        }
+    }
+    sqlite3_free(horizon);
+    sqlite3_free(changes);
+    sqlite3_int64 removed = 0;
+    for (int i = 0; i < 2 + dedicated_count && rc == SQLITE_OK && removed < limit; i++) {
+        char *tombstones = i < 2 ? NULL : sqlite3_mprintf(
+            "DELETE FROM %w_records WHERE id IN (\n"
+            "    SELECT id FROM %w_records WHERE deleted = 1 AND %s ORDER BY id LIMIT ?2\n"
+            ")",
+            dedicated[i - 2], dedicated[i - 2], older);
+        // Per record state of the tombstones, crdt_clocks and crdt_counters
+        char *state[2] = { NULL, NULL };
+        for (int k = 0; k < 2 && i > 0; k++) {
+            if (k == 0 ? !path_clocks : !counters) continue;
+            const char *table = k == 0 ? "crdt_clocks" : "crdt_counters";
+            state[k] = i == 1
+                ? sqlite3_mprintf(
+                    "DELETE FROM %s WHERE (tbl, id) IN (\n"
+                    "    SELECT tbl, id FROM crdt_records WHERE deleted = 1 AND %s ORDER BY id LIMIT ?2\n"
+                    ")",
+                    table, older)
+                : sqlite3_mprintf(
+                    "DELETE FROM %s WHERE tbl = %Q AND id IN (\n"
+                    "    SELECT id FROM %w_records WHERE deleted = 1 AND %s ORDER BY id LIMIT ?2\n"
+                    ")",
+                    table, dedicated[i - 2], dedicated[i - 2], older);
+            if (state[k] == NULL) {
+                rc = SQLITE_NOMEM;
+            }
+        }
+        if (i >= 2 && tombstones == NULL) {
+            rc = SQLITE_NOMEM;
+        }
+        for (int step = 0; step < 3 && rc == SQLITE_OK; step++) {
+            const char *delete = step < 2 ? state[step] : i < 2 ? sql[i] : tombstones;
+            if (delete == NULL) continue;
+            sqlite3_stmt *stmt = NULL;
+            rc = sqlite3_prepare_v2(db, delete, -1, &stmt, NULL);
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_value(stmt, 1, argv[0]);
+                sqlite3_bind_int64(stmt, 2, limit - removed);
+                sqlite3_step(stmt);
+                rc = sqlite3_finalize(stmt);
+            }
+            if (rc == SQLITE_OK && step == 2) {
+                removed += sqlite3_changes(db);
+            }
+        }
+        sqlite3_free(tombstones);
+        sqlite3_free(state[0]);
+        sqlite3_free(state[1]);
+    }
+    sqlite3_free(sql[0]);
+    sqlite3_free(sql[1]);
+    crdt_free_names(dedicated, dedicated_count);
+
+    if (rc == SQLITE_NOMEM) {
+        sqlite3_result_error_nomem(context);
+    } else if (rc != SQLITE_OK) {
+        char *err = sqlite3_mprintf("crdt_compact failed: %s", sqlite3_errmsg(db));
+        sqlite3_result_error(context, err ? err : sqlite3_errmsg(db), -1);
+        sqlite3_free(err);
+    } else {
+        sqlite3_result_int64(context, removed);
+    }
+}
+
+// Build the trigger that folds the changes inserted into crdt_changes into
+// a records table: crdt_records, or <tbl>_records for 'dedicated' tables
+// which have no tbl column. when selects the changes it applies.
+//
+// With path_clocks a change is ordered against the crdt_clocks of its path
+// and of the paths above it instead of the record HLC, so concurrent
+// changes to different paths both survive. The paths below it that have a
+// newer clock keep their values, and its own clock replaces the older
+// ones below it.
+static char *crdt_changes_trigger_sql(const char *trigger, const char *when, const char *records, int with_tbl,
+                                      int packed, int path_clocks) {
+    const char *pack = packed ? "hlc_pack" : "";
+    char *newer = packed
+        ? sqlite3_mprintf("hlc_pack(NEW.hlc) > %w.hlc", records)
+        : sqlite3_mprintf("hlc_compare(NEW.hlc, %w.hlc) > 0", records);
+    if (newer == NULL) {
+        return NULL;
+    }
+
+    char *data = NULL, *hlc = NULL, *where = NULL, *clocks = NULL;
+    if (path_clocks) {
+        // Clocks of tbl and pk whose HLC compares to the change's with op
+#define CRDT_CLOCKS(op) packed \
+            ? "FROM crdt_clocks WHERE tbl = NEW.tbl AND id = NEW.pk AND hlc " op " hlc_pack(NEW.hlc)" \
+            : "FROM crdt_clocks WHERE tbl = NEW.tbl AND id = NEW.pk AND hlc_compare(hlc, NEW.hlc) " op " 0"
+        // No clock at the path or above it is as new as the change
+        where = sqlite3_mprintf("NOT EXISTS (SELECT 1 %s AND crdt_path_covers(path, IFNULL(NEW.path, '$')))",
+                                CRDT_CLOCKS(">="));
+        // A deleted record is an empty document to the changes after it
+        data = sqlite3_mprintf(
+            "crdt_restore(\n"
+            "        crdt_merge(IFNULL(data, jsonb('{}')), excluded.data, excluded.path, excluded.op),\n"
+            "        data,\n"
+            "        (SELECT jsonb_group_array(path) %s AND crdt_path_covers(excluded.path, path) HAVING count(*))\n"
+            "    )",
+            CRDT_CLOCKS(">"));
+        hlc = sqlite3_mprintf("CASE WHEN %s THEN excluded.hlc ELSE %w.hlc END", newer, records);
+        // The guard is only evaluated by the records upsert, changes()
+        // tells the clock statements whether the change won
+        clocks = sqlite3_mprintf(
+            "    INSERT INTO crdt_clocks (tbl, id, path, hlc)\n"
+            "    SELECT NEW.tbl, NEW.pk, IFNULL(NEW.path, '$'), %s(NEW.hlc)\n"
+            "    WHERE changes() AND NEW.op IS NOT 'pn'\n"
+            "    ON CONFLICT (tbl, id, path) DO UPDATE SET hlc = excluded.hlc;\n"
+            "    DELETE %s AND changes() AND crdt_path_covers(IFNULL(NEW.path, '$'), path);\n",
+            pack, CRDT_CLOCKS("<"));
+#undef CRDT_CLOCKS
+    } else {
+        data = sqlite3_mprintf("crdt_merge(data, excluded.data, excluded.path, excluded.op)");
+        hlc = sqlite3_mprintf("excluded.hlc");
+        where = sqlite3_mprintf("%s", newer);
+        clocks = sqlite3_mprintf("");
+    }
+
+    // 'pn' changes carry the totals of the node of their HLC for the
+    // counter at their path. They merge into crdt_counters with max per
+    // node whatever their order, so they skip the HLC checks and leave the
+    // HLC, path and op of the record alone. The sums of the counters of a
+    // record are written over its document after every change.
+    char *merged = data ? sqlite3_mprintf("CASE WHEN NEW.op IS 'pn' THEN data ELSE %s END", data) : NULL;
+    char *inserted = crdt_counters_sql("CASE WHEN NEW.op IS 'pn' THEN jsonb('{}') ELSE jsonb(NEW.data) END", "NEW.tbl", "NEW.pk");
+    char *updated = merged ? crdt_counters_sql(merged, "NEW.tbl", "NEW.pk") : NULL;
+    char *sql = hlc && where && clocks && inserted && updated ? sqlite3_mprintf(
+        "DROP TRIGGER IF EXISTS %w;\n"
+        "CREATE TRIGGER %w\n"
+        "AFTER INSERT ON crdt_changes\n"
+        "WHEN %s\n"
+        "BEGIN\n"
+        "    SELECT hlc_recv(NEW.hlc);\n"
+        "    INSERT INTO crdt_counters (tbl, id, path, node_id, p, n)\n"
+        "    SELECT NEW.tbl, NEW.pk, IFNULL(NEW.path, '$'), hlc_node_id(NEW.hlc),\n"
+        "        IFNULL(json_extract(NEW.data, '$[0]'), 0), IFNULL(json_extract(NEW.data, '$[1]'), 0)\n"
+        "    WHERE NEW.op IS 'pn'\n"
+        "    ON CONFLICT (tbl, id, path, node_id) DO UPDATE SET p = max(p, excluded.p), n = max(n, excluded.n);\n"
+        "    INSERT INTO %w (id, %sdata, hlc, op, path)\n"
+        "    VALUES (\n"
+        "            NEW.pk,\n"
+        "            %s%s,\n"
+        "            %s(NEW.hlc),\n"
+        "            IFNULL(NEW.op, '='),\n"
+        "            IFNULL(NEW.path, '$')\n"
+        "        ) ON CONFLICT (id) DO\n"
+        "    UPDATE\n"
+        "    SET data = %s,\n"
+        "    hlc = CASE WHEN NEW.op IS 'pn' THEN %w.hlc ELSE %s END,\n"
+        "    path = CASE WHEN NEW.op IS 'pn' THEN %w.path ELSE excluded.path END,\n"
+        "    op = CASE WHEN NEW.op IS 'pn' THEN %w.op ELSE excluded.op END\n"
+        "    WHERE NEW.op IS 'pn' OR %s;\n"
+        "%s"
+        "END;\n",
+        trigger, trigger,       // DROP and CREATE TRIGGER %w
+        when,                   // changes it applies
+        records,                // INSERT INTO %w
+        with_tbl ? "tbl, " : "",
+        with_tbl ? "NEW.tbl,\n            " : "",
+        inserted,               // new record with its counter sums
+        pack,                   // records hlc value
+        updated,                // merged document with its counter sums
+        records, hlc,           // records hlc after the merge
+        records, records,       // path and op
+        where,                  // winning change condition
+        clocks                  // per path clocks
+    ) : NULL;
+    sqlite3_free(merged);
+    sqlite3_free(inserted);
+    sqlite3_free(updated);
+    sqlite3_free(newer);
+    sqlite3_free(data);
+    sqlite3_free(hlc);
+    sqlite3_free(where);
+    sqlite3_free(clocks);
+    return sql;
+}
+
+// The crdt_changes trigger of a 'dedicated' table, <tbl>_changes
+static char *crdt_dedicated_trigger_sql(const char *tbl, int packed, int path_clocks) {
+    char *records = sqlite3_mprintf("%s_records", tbl);
+    char *when = sqlite3_mprintf("NEW.tbl = %Q AND NOT crdt_applying()", tbl);
+    char *trigger = sqlite3_mprintf("%s_changes", tbl);
+    char *sql = records && when && trigger
+        ? crdt_changes_trigger_sql(trigger, when, records, 0, packed, path_clocks)
+        : NULL;
+    sqlite3_free(records);
+    sqlite3_free(when);
+    sqlite3_free(trigger);
+    return sql;
+}
+
+// Leaf buckets of crdt_digest span 2^16 ms (about a minute) of HLC time,
+// each level up groups 16 buckets of the level below. Level 8 is a single
+// bucket for every HLC up to hlc_pack()'s 48 bits of milliseconds.
+#define CRDT_DIGEST_SHIFT 16
+#define CRDT_DIGEST_FANOUT_BITS 4
+#define CRDT_DIGEST_LEVELS 8
+
+// Milliseconds, counter and node ID of an HLC as text or hlc_pack() blob,
+// so that both forms of an HLC hash and bucket the same. Returns 0, or -1
+// if it is not an HLC.
+static int crdt_hlc_fields(sqlite3_value *value, sqlite3_int64 *ms, int *counter, const unsigned char **node,
+                           int *node_len) {
+    const unsigned char *s = sqlite3_value_blob(value);
+    int n = sqlite3_value_bytes(value);
+    if (sqlite3_value_type(value) == SQLITE_BLOB) {
+        if (n < 8) {
+            return -1;
+        }
+        *ms = 0;
+        for (int i = 0; i < 6; i++) {
+            *ms = (*ms << 8) | s[i];
+        }
+        *counter = (s[6] << 8) | s[7];
+        *node = s + 8;
+        *node_len = n - 8;
+        return 0;
+    }
+    if (sqlite3_value_type(value) != SQLITE_TEXT || n < 29) {
+        return -1;
+    }
+    // YYYY-MM-DDTHH:MM:SS.mmm[Z]-CCCC-node, as hlc_str writes it
+    static const char layout[] = "dddd-dd-ddTdd:dd:dd.ddd";
+    int fields[7] = { 0 }, f = 0;
+    for (int i = 0; i < 23; i++) {
+        if (layout[i] != 'd') {
+            if (s[i] != (unsigned char)layout[i]) return -1;
+            f++;
+        } else if (s[i] < '0' || s[i] > '9') {
+            return -1;
+        } else {
+            fields[f] = fields[f] * 10 + (s[i] - '0');
+        }
+    }
+    int i = s[23] == 'Z' ? 24 : 23;
+    if (n < i + 6 || s[i] != '-' || s[i + 5] != '-') {
+        return -1;
+    }
+    *counter = 0;
+    for (int k = i + 1; k < i + 5; k++) {
+        int digit = s[k] >= '0' && s[k] <= '9' ? s[k] - '0'
+            : s[k] >= 'a' && s[k] <= 'f' ? s[k] - 'a' + 10
+            : s[k] >= 'A' && s[k] <= 'F' ? s[k] - 'A' + 10 : -1;
+        if (digit < 0) return -1;
+        *counter = *counter * 16 + digit;
+    }
+    int year = fields[0], month = fields[1], day = fields[2];
+    if (month < 1 || month > 12 || day < 1 || day > 31 || fields[3] > 23 || fields[4] > 59 || fields[5] > 59) {
+        return -1;
+    }
+    // Days since 1970-01-01 of a proleptic Gregorian date
+    int y = month <= 2 ? year - 1 : year;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    sqlite3_int64 days = (sqlite3_int64)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    *ms = ((days * 24 + fields[3]) * 60 + fields[4]) * 60000 + fields[5] * 1000 + fields[6];
+    *node = s + i + 6;
+    *node_len = n - i - 6;
+    return 0;
+}
+
+// crdt_digest_hash(hlc, tbl, pk)
+//
+// 64-bit hash of a change, the same for its HLC as text or packed. The
+// hash of a bucket is the XOR of the hashes of its changes, so a change
+// is added or removed in constant time and the order does not matter.
+static void crdt_digest_hash(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    sqlite3_int64 ms;
+    int counter, node_len;
+    const unsigned char *node;
+    if (crdt_hlc_fields(argv[0], &ms, &counter, &node, &node_len) != 0) {
+        sqlite3_result_error(context, "crdt_digest_hash: invalid HLC", -1);
+        return;
+    }
+    sqlite3_uint64 hash = 0xcbf29ce484222325ULL;
+#define CRDT_FNV(byte) (hash = (hash ^ (unsigned char)(byte)) * 0x100000001b3ULL)
+    for (int shift = 40; shift >= 0; shift -= 8) CRDT_FNV(ms >> shift);
+    CRDT_FNV(counter >> 8);
+    CRDT_FNV(counter);
+    for (int i = 0; i < node_len; i++) CRDT_FNV(node[i]);
+    for (int a = 1; a <= 2; a++) {
+        const unsigned char *s = sqlite3_value_text(argv[a]);
+        int n = sqlite3_value_bytes(argv[a]);
+        CRDT_FNV(0);
+        for (int i = 0; i < n; i++) CRDT_FNV(s[i]);
+    }
+#undef CRDT_FNV
+    // FNV-1a leaves the high bits weak for short keys, mix them like
+    // splitmix64 so XOR sums of different sets rarely collide
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    sqlite3_result_int64(context, (sqlite3_int64)hash);
+}
+
+// crdt_digest_bucket(hlc [, level])
+//
+// The crdt_digest bucket of an HLC at a level, 0 for the leaves
+static void crdt_digest_bucket(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    int level = argc == 2 ? sqlite3_value_int(argv[1]) : 0;
+    sqlite3_int64 ms;
+    int counter, node_len;
+    const unsigned char *node;
+    if (level < 0 || level > CRDT_DIGEST_LEVELS) {
+        sqlite3_result_error(context, "crdt_digest_bucket: level must be between 0 and 8", -1);
+    } else if (crdt_hlc_fields(argv[0], &ms, &counter, &node, &node_len) != 0) {
+        sqlite3_result_error(context, "crdt_digest_bucket: invalid HLC", -1);
+    } else {
+        sqlite3_result_int64(context, ms >> (CRDT_DIGEST_SHIFT + CRDT_DIGEST_FANOUT_BITS * level));
+    }
+}
+
+// crdt_digest(level, bucket)
+//
+// Hash of the changes in a bucket of crdt_digest at a level, 0 when it is
+// empty. Two peers whose digests of a bucket match hold the same changes
+// in it; when they differ the 16 buckets of the level below tell which
+// part, down to a leaf at level 0 whose changes are sent with
+// crdt_digest_bucket(hlc) = bucket. Needs crdt_create with 'digest'.
+static void crdt_digest(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    int level = sqlite3_value_int(argv[0]);
+    sqlite3_int64 bucket = sqlite3_value_int64(argv[1]);
+    if (level < 0 || level > CRDT_DIGEST_LEVELS) {
+        sqlite3_result_error(context, "crdt_digest: level must be between 0 and 8", -1);
+        return;
+    }
+    int shift = CRDT_DIGEST_FANOUT_BITS * level;
+    sqlite3_int64 limit = (sqlite3_int64)1 << (48 - CRDT_DIGEST_SHIFT - shift);
+    if (bucket < 0 || bucket >= limit) {
+        sqlite3_result_int64(context, 0);
+        return;
+    }
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT hash FROM crdt_digest WHERE bucket >= ?1 AND bucket < ?2", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        char *err = sqlite3_mprintf("crdt_digest: %s, run crdt_create with 'digest'", sqlite3_errmsg(db));
+        sqlite3_result_error(context, err ? err : "crdt_digest failed", -1);
+        sqlite3_free(err);
+        return;
+    }
+    sqlite3_bind_int64(stmt, 1, bucket << shift);
+    sqlite3_bind_int64(stmt, 2, (bucket + 1) << shift);
+    sqlite3_uint64 hash = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        hash ^= (sqlite3_uint64)sqlite3_column_int64(stmt, 0);
+    }
+    if (sqlite3_finalize(stmt) != SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+    sqlite3_result_int64(context, (sqlite3_int64)hash);
+}
+
+// crdt_node(hlc or node_id)
+//
+// The node number of an HLC, text or packed, or of a node ID: a 47-bit
+// hash of the node ID, so it is stored in 6 bytes and is the same on every
+// peer without a table to look it up in. With 'nodes' crdt_changes and
+// crdt_records keep it in their node column, and node_id is computed from
+// the HLC when it is read. Two node IDs can share a number, a query that
+// must not see another node's changes checks node_id too:
+//
+//     SELECT * FROM crdt_changes WHERE node = crdt_node(?1) AND node_id = ?1
+static void crdt_node(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    sqlite3_int64 ms;
+    int counter, node_len;
+    const unsigned char *node;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        return;
+    }
+    if (crdt_hlc_fields(argv[0], &ms, &counter, &node, &node_len) != 0) {
+        node = sqlite3_value_text(argv[0]);
+        node_len = sqlite3_value_bytes(argv[0]);
+        if (node == NULL) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+    }
+    sqlite3_uint64 hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < node_len; i++) {
+        hash = (hash ^ node[i]) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    sqlite3_result_int64(context, (sqlite3_int64)(hash >> 17));
+}
+
+// The node columns of crdt_changes and the records tables. With 'nodes'
+// the node of a change or record is stored and indexed as its crdt_node()
+// number instead of 36 bytes of node_id text, which is computed from the
+// HLC when it is read. The HLCs keep their node IDs: peers break ties
+// between HLCs on them, and must all pick the same.
+static const char *crdt_node_columns(int nodes) {
+    return nodes
+        ? "node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) VIRTUAL,\n"
+          "    node INTEGER NOT NULL GENERATED ALWAYS AS (crdt_node(hlc)) STORED"
+        : "node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) STORED";
+}
+
+static void crdt_create(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1 && argc != 2) {
+        sqlite3_result_error(context, "crdt_create requires 1 or 2 arguments", -1);
+        return;
+    }
+    const char *node_id = (const char *)sqlite3_value_text(argv[0]);
+
+    if (node_id == NULL) {
+        sqlite3_result_error(context, "node_id cannot be NULL", -1);
+        return;
+    }
+
+    unsigned int flags = 0;
+    if (argc == 2 && parse_options(context, crdt_create_options, (const char *)sqlite3_value_text(argv[1]), &flags) != SQLITE_OK) {
+        return;
+    }
+
+    // The HLC format is fixed once the tables exist
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    char *existing_format = get_kv(db, "hlc_format");
+    if (existing_format != NULL) {
+        int existing_packed = strcmp(existing_format, "packed") == 0;
+        int existing_rowid = uses_rowid_changes(db);
+        int existing_nodes = uses_node_numbers(db);
+        sqlite3_free(existing_format);
+        if (argc == 1) {
+            flags = (existing_packed ? CRDT_OPT_PACKED_HLC : 0) | (uses_path_clocks(db) ? CRDT_OPT_PATH_CLOCKS : 0) |
+                    (existing_rowid ? CRDT_OPT_ROWID_CHANGES : 0) | (uses_digest(db) ? CRDT_OPT_DIGEST : 0) |
+                    (existing_nodes ? CRDT_OPT_NODES : 0);
+        } else if (existing_packed != ((flags & CRDT_OPT_PACKED_HLC) != 0)) {
+            sqlite3_result_error(context, "CRDT tables already exist with a different HLC format", -1);
+            return;
+        } else if (existing_rowid != ((flags & CRDT_OPT_ROWID_CHANGES) != 0)) {
+            // Watermarks hold crdt_changes ids, so the key is fixed too
+            sqlite3_result_error(context, "CRDT tables already exist with a different crdt_changes key", -1);
+            return;
+        } else if (existing_nodes != ((flags & CRDT_OPT_NODES) != 0)) {
+            sqlite3_result_error(context, "CRDT tables already exist with a different node_id column", -1);
+            return;
+        }
+    }
+
+    // With 'packed' every stored HLC is a hlc_pack() blob, so the merge can
+    // compare HLCs with plain BLOB comparison instead of hlc_compare().
+    int packed = (flags & CRDT_OPT_PACKED_HLC) != 0;
+    const char *hlc_type = packed ? "BLOB" : "TEXT";
+    const char *pack = packed ? "hlc_pack" : "";
+
+    // With 'rowid' crdt_changes ids are integers from AUTOINCREMENT instead
+    // of HLCs: no UUID and HLC text per change and no separate index on a
+    // text key, every insert appends to the table. AUTOINCREMENT never
+    // hands out an id again after crdt_compact deleted the newest changes,
+    // which watermarks rely on.
+    char *id_column = (flags & CRDT_OPT_ROWID_CHANGES) != 0
+        ? sqlite3_mprintf("id INTEGER PRIMARY KEY AUTOINCREMENT")
+        : sqlite3_mprintf("id %s NOT NULL PRIMARY KEY DEFAULT (%s(hlc_now(%Q)))", hlc_type, pack, node_id);
+
+    int nodes = (flags & CRDT_OPT_NODES) != 0;
+    const char *node_columns = crdt_node_columns(nodes);
+
+    // With 'paths' every change is ordered by the clocks in crdt_clocks.
+    // Turning it on starts every record with a clock for its whole
+    // document, so nothing older than the record gets in; turning it off
+    // drops the clocks.
+    int path_clocks = (flags & CRDT_OPT_PATH_CLOCKS) != 0;
+    int was_path_clocks = uses_path_clocks(db);
+
+    // crdt_apply_changes has already applied its batch, and 'dedicated'
+    // tables have a trigger of their own
+    char *trigger = crdt_changes_trigger_sql("crdt_changes_trigger",
+        "NOT crdt_applying() AND NOT EXISTS (SELECT 1 FROM crdt_kv WHERE key = 'dedicated:' || NEW.tbl)",
+        "crdt_records", 1, packed, path_clocks);
+    char *clocks = sqlite3_mprintf(path_clocks && !was_path_clocks
+        ? "INSERT OR IGNORE INTO crdt_clocks (tbl, id, path, hlc) SELECT tbl, id, '$', hlc FROM crdt_records;\n"
+        : !path_clocks && was_path_clocks ? "DELETE FROM crdt_clocks;\n" : "");
+    int dedicated_count;
+    char **dedicated = crdt_dedicated_tables(db, &dedicated_count);
+    for (int i = 0; i < dedicated_count && trigger != NULL && clocks != NULL; i++) {
+        char *apply = crdt_dedicated_trigger_sql(dedicated[i], packed, path_clocks);
+        char *more = apply == NULL ? NULL : path_clocks && !was_path_clocks
+            ? sqlite3_mprintf("%s%sINSERT OR IGNORE INTO crdt_clocks (tbl, id, path, hlc) SELECT %Q, id, '$', hlc FROM %w_records;\n",
+                              clocks, apply, dedicated[i], dedicated[i])
+            : sqlite3_mprintf("%s%s", clocks, apply);
+        sqlite3_free(apply);
+        sqlite3_free(clocks);
+        clocks = more;
+    }
+    crdt_free_names(dedicated, dedicated_count);
+    if (trigger == NULL || clocks == NULL || id_column == NULL || dedicated_count < 0) {
+        sqlite3_free(trigger);
+        sqlite3_free(clocks);
+        sqlite3_free(id_column);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    // With 'digest' crdt_digest holds the XOR of the crdt_digest_hash() of
+    // the changes of every leaf bucket with any, kept by a trigger on
+    // crdt_changes inserts. A change logged twice, as a peer that sends it
+    // again does, counts once: its copies are found through
+    // crdt_changes_tbl. crdt_compact leaves the digest alone, so compacted
+    // and uncompacted peers match, and notes the newest HLC it removed under
+    // 'digest_compacted' in crdt_kv. Changes up to it are not hashed again
+    // when a peer sends them back. Turning it on hashes the changes already
+    // logged, turning it off drops it.
+#define CRDT_DIGEST_XOR "(hash | excluded.hash) & ~(hash & excluded.hash)"
+    int digest = (flags & CRDT_OPT_DIGEST) != 0;
+    int was_digest = uses_digest(db);
+    const char *digest_sql = digest
+        ? "CREATE TABLE IF NOT EXISTS crdt_digest (\n"
+          "    bucket INTEGER PRIMARY KEY,\n"
+          "    hash INTEGER NOT NULL,\n"
+          "    count INTEGER NOT NULL\n"
+          ");\n"
+          "DROP TRIGGER IF EXISTS crdt_digest_insert;\n"
+          "CREATE TRIGGER crdt_digest_insert AFTER INSERT ON crdt_changes\n"
+          "WHEN NOT EXISTS (SELECT 1 FROM crdt_changes WHERE tbl = NEW.tbl AND hlc = NEW.hlc AND pk = NEW.pk AND rowid != NEW.rowid)\n"
+          "AND NOT EXISTS (SELECT 1 FROM crdt_kv WHERE key = 'digest_compacted' AND hlc_compare(NEW.hlc, value) <= 0)\n"
+          "BEGIN\n"
+          "    INSERT INTO crdt_digest (bucket, hash, count)\n"
+          "    VALUES (crdt_digest_bucket(NEW.hlc), crdt_digest_hash(NEW.hlc, NEW.tbl, NEW.pk), 1)\n"
+          "    ON CONFLICT (bucket) DO UPDATE SET hash = " CRDT_DIGEST_XOR ", count = count + 1;\n"
+          "END;\n"
+          "DROP TRIGGER IF EXISTS crdt_digest_delete;\n"
+        : "DROP TRIGGER IF EXISTS crdt_digest_insert;\n"
+          "DROP TRIGGER IF EXISTS crdt_digest_delete;\n"
+          "DROP TABLE IF EXISTS crdt_digest;\n"
+          "DELETE FROM crdt_kv WHERE key = 'digest_compacted';\n";
+    const char *digest_fill = digest && !was_digest
+        ? "INSERT INTO crdt_digest (bucket, hash, count)\n"
+          "SELECT crdt_digest_bucket(hlc), crdt_digest_hash(hlc, tbl, pk), 1 FROM (SELECT DISTINCT tbl, hlc, pk FROM crdt_changes) WHERE true\n"
+          "ON CONFLICT (bucket) DO UPDATE SET hash = " CRDT_DIGEST_XOR ", count = count + 1;\n"
+        : "";
+#undef CRDT_DIGEST_XOR
+
+    // A generated column cannot change from VIRTUAL to STORED in place, so
+    // older tables are renamed, recreated and copied. legacy_alter_table
+    // leaves the views of crdt_create_table pointing at the new tables.
+    int upgrade = is_virtual_column(db, "crdt_changes", "deleted");
+    const char *rename = upgrade
+        ? "PRAGMA legacy_alter_table = ON;\n"
+          "DROP TRIGGER IF EXISTS crdt_changes_trigger;\n"
+          "ALTER TABLE crdt_changes RENAME TO crdt_changes_old;\n"
+          "ALTER TABLE crdt_records RENAME TO crdt_records_old;\n"
+          "PRAGMA legacy_alter_table = OFF;\n"
+        : "";
+    const char *copy = upgrade
+        ? "INSERT INTO crdt_changes (id, pk, tbl, data, path, op, hlc)\n"
+          "SELECT id, pk, tbl, data, path, op, hlc FROM crdt_changes_old;\n"
+          "DROP TABLE crdt_changes_old;\n"
+          "INSERT INTO crdt_records (id, tbl, data, hlc, path, op)\n"
+          "SELECT id, tbl, data, hlc, path, op FROM crdt_records_old;\n"
+          "DROP TABLE crdt_records_old;\n"
+        : "";
+
+    // Use %Q for SQL string literals - it handles NULL and escapes quotes.
+    // Escape the literal SQL modulo operator % as %%
+    char *sql = sqlite3_mprintf(
+        "SAVEPOINT crdt_create;\n"
+        "%s" // Upgrade: move the old tables aside
+        "\n"
+        "CREATE TABLE IF NOT EXISTS crdt_changes (\n"
+        "    %s,\n"
+        "    pk TEXT NOT NULL,\n"
+        "    tbl TEXT NOT NULL,\n"
+        "    data BLOB,\n"
+        "    path TEXT NOT NULL DEFAULT ('$'),\n"
+        "    op TEXT NOT NULL DEFAULT ('='),\n"
+        "    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) STORED,\n"
+        "    hlc %s NOT NULL,\n"
+        "    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,\n"
+        "    %s\n"
+        ");\n"
+        "\n"
+        "CREATE TABLE IF NOT EXISTS crdt_kv (\n"
+        "    key TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE,\n"
+        "    value\n"
+        ");\n"
+        "\n"
+        "INSERT OR IGNORE INTO crdt_kv (key, value) VALUES ('hlc_format', %Q);\n"
+        "\n"
+        "CREATE TABLE IF NOT EXISTS crdt_records (\n"
+        "    id TEXT NOT NULL PRIMARY KEY,\n"
+        "    tbl TEXT NOT NULL,\n"
+        "    data BLOB,\n"
+        "    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) STORED,\n"
+        "    hlc %s NOT NULL,\n"
+        "    path TEXT,\n"
+        "    op TEXT,\n"
+        "    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,\n"
+        "    %s\n"
+        ");\n"
+        "\n"
+        "%s" // Upgrade: copy the old tables
+        "\n"
+        "CREATE TABLE IF NOT EXISTS crdt_clocks (\n"
+        "    tbl TEXT NOT NULL,\n"
+        "    id TEXT NOT NULL,\n"
+        "    path TEXT NOT NULL,\n"
+        "    hlc %s NOT NULL,\n"
+        "    PRIMARY KEY (tbl, id, path)\n"
+        ") WITHOUT ROWID;\n"
+        "\n"
+        "INSERT INTO crdt_kv (key, value) VALUES ('clocks', %Q);\n"
+        "\n"
+        "CREATE TABLE IF NOT EXISTS crdt_counters (\n"
+        "    tbl TEXT NOT NULL,\n"
+        "    id TEXT NOT NULL,\n"
+        "    path TEXT NOT NULL,\n"
+        "    node_id TEXT NOT NULL,\n"
+        "    p NOT NULL DEFAULT 0,\n"
+        "    n NOT NULL DEFAULT 0,\n"
+        "    PRIMARY KEY (tbl, id, path, node_id)\n"
+        ") WITHOUT ROWID;\n"
+        "\n"
+        // Per table views, changes of a table and changes since a node's HLC
+        "CREATE INDEX IF NOT EXISTS crdt_records_tbl ON crdt_records (tbl, deleted, id);\n"
+        "CREATE INDEX IF NOT EXISTS crdt_changes_tbl ON crdt_changes (tbl, hlc);\n"
+        "CREATE INDEX IF NOT EXISTS crdt_changes_node_id ON crdt_changes (%s, hlc);\n"
+        "\n"
+        "%s" // crdt_changes_trigger
+        "%s" // Per path clocks and dedicated table triggers
+        "%s" // crdt_digest and its triggers
+        "%s" // Hashes of the logged changes
+        "\n"
+        "INSERT INTO crdt_kv (key, value) VALUES ('schema_version', %d);\n"
+        "RELEASE crdt_create;\n",
+        rename,                 // Upgrade: rename
+        id_column,              // crdt_changes.id
+        hlc_type,               // crdt_changes.hlc type
+        node_columns,           // crdt_changes.node_id
+        packed ? "packed" : "text", // hlc_format in crdt_kv
+        hlc_type,               // crdt_records.hlc type
+        node_columns,           // crdt_records.node_id
+        copy,                   // Upgrade: copy
+        hlc_type,               // crdt_clocks.hlc type
+        path_clocks ? "paths" : "records", // clocks in crdt_kv
+        nodes ? "node" : "node_id", // crdt_changes_node_id
+        trigger,                // crdt_changes_trigger
+        clocks,                 // crdt_clocks and dedicated triggers
+        digest_sql,             // crdt_digest
+        digest_fill,            // crdt_digest of the existing changes
+        CRDT_SCHEMA_VERSION     // schema_version in crdt_kv
+    );
+    sqlite3_free(trigger);
+    sqlite3_free(clocks);
+    sqlite3_free(id_column);
+
+    if (execute_sql(context, db, sql) != SQLITE_OK) { // Use helper to execute and handle errors/freeing
+        sqlite3_exec(db, "PRAGMA legacy_alter_table = OFF; ROLLBACK TO crdt_create; RELEASE crdt_create;", NULL, NULL, NULL);
+    }
+}
+
+// Build the script that (re)creates the view and INSTEAD OF triggers of a
+// crdt table, free with sqlite3_free. A 'dedicated' table keeps its
+// records in <tbl>_records with a crdt_changes trigger of its own, moving
+// them there from crdt_records, or back when was_dedicated is set.
+//
+// With counters the '+' and '-' writes of the view are logged as 'pn'
+// changes holding the new totals of this node for the counter at path.
+static char *crdt_table_sql(const char *tbl, const char *node_id, int packed, int path_clocks, int rowid_changes,
+                            int nodes, int dedicated, int was_dedicated, int counters) {
+    // In 'packed' mode the view exposes HLC text and the triggers pack it
+    const char *hlc_column = packed ? "hlc_unpack(hlc) AS hlc" : "hlc";
+    const char *pack = packed ? "hlc_pack" : "";
+    // With 'rowid' crdt_changes numbers the changes itself
+    const char *change_id = rowid_changes ? "NULL" : "hlc_now(uuid())";
+    const char *order = rowid_changes ? "" : CRDT_ORDER_SQL ";\n";
+    const char *change_pack = rowid_changes ? "" : pack;
+
+    // The totals of this node plus the increment or minus the decrement. A
+    // node only ever raises its own totals, so the HLC of an UPDATE, which
+    // is the record's when not set, is not used for them.
+    char *data = counters ? sqlite3_mprintf(
+        "CASE WHEN NEW.op IN ('+', '-') THEN (\n"
+        "            SELECT jsonb_array(IFNULL(c.p, 0) + max(d.v, 0), IFNULL(c.n, 0) + max(-d.v, 0))\n"
+        "            FROM (SELECT (CASE NEW.op WHEN '-' THEN -1 ELSE 1 END) * IFNULL(json_extract(jsonb(NEW.data), '$'), 0) AS v) AS d\n"
+        "            LEFT JOIN crdt_counters AS c\n"
+        "            ON c.tbl = %Q AND c.id = NEW.id AND c.path = IFNULL(NEW.path, '$') AND c.node_id = %Q\n"
+        "        ) ELSE jsonb(NEW.data) END",
+        tbl, node_id) : sqlite3_mprintf("jsonb(NEW.data)");
+    char *hlc = counters
+        ? sqlite3_mprintf("CASE WHEN NEW.op IN ('+', '-') THEN hlc_now(%Q) ELSE IFNULL(NEW.hlc, hlc_now(%Q)) END", node_id, node_id)
+        : sqlite3_mprintf("IFNULL(NEW.hlc, hlc_now(%Q))", node_id);
+    const char *op = counters ? "CASE WHEN NEW.op IN ('+', '-') THEN 'pn' ELSE IFNULL(NEW.op, %s) END" : "IFNULL(NEW.op, %s)";
+    char *insert_op = sqlite3_mprintf(op, "'='");
+    char *update_op = sqlite3_mprintf(op, "'patch'");
+
+    char *storage = NULL;
+    char *source = NULL;
+    if (dedicated) {
+        char *records = sqlite3_mprintf("%s_records", tbl);
+        char *apply = crdt_dedicated_trigger_sql(tbl, packed, path_clocks);
+        storage = apply == NULL ? NULL : sqlite3_mprintf(
+            "CREATE TABLE IF NOT EXISTS %w (\n"
+            "    id TEXT NOT NULL PRIMARY KEY,\n"
+            "    data BLOB,\n"
+            "    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) STORED,\n"
+            "    hlc %s NOT NULL,\n"
+            "    path TEXT,\n"
+            "    op TEXT,\n"
+            "    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,\n"
+            "    %s\n"
+            ");\n"
+            "INSERT OR IGNORE INTO %w (id, data, hlc, path, op)\n"
+            "SELECT id, data, hlc, path, op FROM crdt_records WHERE tbl = %Q;\n"
+            "DELETE FROM crdt_records WHERE tbl = %Q;\n"
+            "INSERT INTO crdt_kv (key, value) VALUES ('dedicated:' || %Q, 1);\n"
+            "%s"
+            "\n",
+            records, packed ? "BLOB" : "TEXT", // CREATE TABLE %w_records
+            crdt_node_columns(nodes),
+            records, tbl, tbl,                 // move from crdt_records
+            tbl,                               // dedicated:%Q
+            apply                              // %w_changes trigger
+        );
+        source = sqlite3_mprintf("FROM %w\nWHERE deleted = 0", records);
+        sqlite3_free(records);
+        sqlite3_free(apply);
+    } else {
+        storage = was_dedicated
+            ? sqlite3_mprintf(
+                "DROP TRIGGER IF EXISTS %w_changes;\n"
+                "INSERT OR IGNORE INTO crdt_records (id, tbl, data, hlc, path, op)\n"
+                "SELECT id, %Q, data, hlc, path, op FROM %w_records;\n"
+                "DROP TABLE %w_records;\n"
+                "DELETE FROM crdt_kv WHERE key = 'dedicated:' || %Q;\n"
+                "\n",
+                tbl, tbl, tbl, tbl, tbl)
+            : sqlite3_mprintf("");
+        source = sqlite3_mprintf("FROM crdt_records\nWHERE tbl = %Q\nAND deleted = 0", tbl);
+    }
+    if (storage == NULL || source == NULL || data == NULL || hlc == NULL || insert_op == NULL || update_op == NULL) {
+        sqlite3_free(storage);
+        sqlite3_free(source);
+        sqlite3_free(data);
+        sqlite3_free(hlc);
+        sqlite3_free(insert_op);
+        sqlite3_free(update_op);
+        return NULL;
+    }
+
+    // Use sqlite3_mprintf for dynamic allocation.
+    // Use %w for identifiers (table names, trigger names) - handles quoting if necessary.
+    // Use %Q for SQL string literals (values inside quotes).
+    char *sql = sqlite3_mprintf(
+        // Drop existing view/triggers first for idempotency
+        "DROP VIEW IF EXISTS %w;\n"
+        "DROP TRIGGER IF EXISTS %w_insert;\n"
+        "DROP TRIGGER IF EXISTS %w_update;\n"
+        "DROP TRIGGER IF EXISTS %w_delete;\n"
+        "\n"
+        "%s" // Records table of a dedicated table
+        // Create View
+        "CREATE VIEW %w AS\n"
+        "SELECT\n"
+        "  id,\n"
+        "  data,\n"
+        "  deleted,\n"
+        "  %s,\n"
+        "  path,\n"
+        "  op,\n"
+        "  json,\n"
+        "  node_id\n"
+        "%s;\n" // crdt_records rows of tbl or its dedicated records table
+        "\n"
+        // Insert Trigger
+        "CREATE TRIGGER %w_insert INSTEAD OF\n" // %w for trigger name
+        "INSERT ON %w BEGIN\n" // %w for view name
+        "%s" // CRDT_ORDER_SQL without 'rowid'
+        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
+        "VALUES (\n"
+        "        %s(%s), -- node_id was %Q\n" // Comment updated, value removed from args
+        "        NEW.id,\n"
+        "        %Q,\n" // %Q for table name literal
+        "        %s,\n"
+        "        %s,\n"
+        "        IFNULL(NEW.path, '$'),\n"
+        "        %s(%s)\n"
+        "    );\n"
+        "END;\n"
+        "\n"
+        // Update Trigger
+        "CREATE TRIGGER %w_update INSTEAD OF\n" // %w for trigger name
+        "UPDATE ON %w BEGIN\n" // %w for view name
+        "%s" // CRDT_ORDER_SQL without 'rowid'
+        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
+        "VALUES (\n"
+        "        %s(%s), -- node_id was %Q\n" // Comment updated
+        "        NEW.id,\n"
+        "        %Q,\n" // %Q for table name literal
+        "        %s,\n"
+        "        %s,\n" // Default op for UPDATE is 'patch'
+        "        IFNULL(NEW.path, '$'),\n"
+        "        %s(%s)\n"
+        "    );\n"
+        "END;\n"
+        "\n"
+        // Delete Trigger
+        "CREATE TRIGGER %w_delete INSTEAD OF DELETE ON %w BEGIN\n" // %w trigger, %w view
+        "%s" // CRDT_ORDER_SQL without 'rowid'
+        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
+        "VALUES (\n"
+        "        %s(%s), -- node_id was %Q\n" // Comment updated
+        "        OLD.id,\n"
+        "        %Q,\n" // %Q for table name literal
+        "        NULL,\n" // Data is NULL for delete
+        "        '=',\n"  // Op is '=' for delete (semantically replaces with NULL)
+        "        '$',\n"  // Path is '$' for delete (affects whole object)
+        "        %s(hlc_now(%Q))\n" // %Q for node_id literal
+        "    );\n"
+        "END;\n",
+        // Arguments for %w and %Q specifiers IN ORDER:
+        tbl, tbl, tbl, tbl, // DROP statements (%w)
+        storage,           // dedicated records table
+        tbl,               // CREATE VIEW %w
+        hlc_column,        // hlc column
+        source,            // FROM ... WHERE
+        tbl,               // CREATE TRIGGER %w_insert
+        tbl,               // INSERT ON %w
+        order,             // CRDT_ORDER_SQL
+        change_pack, change_id, node_id, // crdt_changes.id, comment node_id %Q (now just illustrative)
+        tbl,               // VALUES tbl = %Q
+        data, insert_op,   // VALUES data and op
+        pack, hlc,         // VALUES hlc
+        tbl,               // CREATE TRIGGER %w_update
+        tbl,               // UPDATE ON %w
+        order,             // CRDT_ORDER_SQL
+        change_pack, change_id, node_id, // crdt_changes.id, comment node_id %Q (now just illustrative)
+        tbl,               // VALUES tbl = %Q
+        data, update_op,   // VALUES data and op
+        pack, hlc,         // VALUES hlc
+        tbl,               // CREATE TRIGGER %w_delete
+        tbl,               // DELETE ON %w
+        order,             // CRDT_ORDER_SQL
+        change_pack, change_id, node_id, // crdt_changes.id, comment node_id %Q (now just illustrative)
+        tbl,               // VALUES tbl = %Q
+        pack, node_id      // VALUES hlc_now(%Q)
+    );
+    sqlite3_free(storage);
+    sqlite3_free(source);
+    sqlite3_free(data);
+    sqlite3_free(hlc);
+    sqlite3_free(insert_op);
+    sqlite3_free(update_op);
+    return sql;
+}
+
+// FNV-1a hash of a crdt_table_sql script as hex, crdt_kv keeps it under
+// 'table:' || tbl so crdt_create_tables can tell a table is up to date.
+static void crdt_table_hash(const char *sql, char out[17]) {
+    sqlite3_uint64 hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)sql; *p; p++) {
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    }
+    sqlite3_snprintf(17, out, "%016llx", hash);
+}
+
+// Returns an error message for an invalid crdt table name or NULL
+static const char *crdt_table_name_error(const char *tbl) {
+    if (tbl == NULL) {
+        return "tbl cannot be NULL";
+    }
+    // Basic validation: Ensure table name doesn't contain quotes to avoid issues
+    // with %w or manual quoting if used. A more robust check would disallow spaces, etc.
+    if (strchr(tbl, '"') != NULL || strchr(tbl, '\'') != NULL) {
+        return "Table name cannot contain quotes";
+    }
+    return NULL;
+}
+
+// Returns an error message if the crdt_create tables cannot hold 'dedicated'
+// tables yet, their crdt_changes_trigger would apply the changes as well
+static const char *crdt_dedicated_error(sqlite3 *db) {
+    return crdt_schema_current(db) ? NULL : "'dedicated' tables need the crdt tables from crdt_create, run crdt_create again to upgrade them";
+}
+
+static void crdt_create_table(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 2 && argc != 3) {
+        sqlite3_result_error(context, "crdt_create_table requires 2 or 3 arguments", -1);
+        return;
+    }
+    // Use sqlite3_value_dup if you need the value beyond the callback scope,
+    // but text is fine here as we use it immediately.
+    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
+    const char *node_id = (const char *)sqlite3_value_text(argv[1]);
+
+    if (tbl == NULL || node_id == NULL) {
+        sqlite3_result_error(context, "tbl or node_id cannot be NULL", -1);
+        return;
+    }
+    if (crdt_table_name_error(tbl) != NULL) {
+         sqlite3_result_error(context, crdt_table_name_error(tbl), -1);
+         return;
+    }
+
+    unsigned int flags = 0;
+    if (argc == 3 && parse_options(context, crdt_create_table_options, (const char *)sqlite3_value_text(argv[2]), &flags) != SQLITE_OK) {
+        return;
+    }
+    int dedicated = (flags & CRDT_OPT_DEDICATED) != 0;
+    int counters = (flags & CRDT_OPT_COUNTERS) != 0;
+
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (dedicated && crdt_dedicated_error(db) != NULL) {
+        sqlite3_result_error(context, crdt_dedicated_error(db), -1);
+        return;
+    }
+    if (counters && crdt_counters_error(db) != NULL) {
+        sqlite3_result_error(context, crdt_counters_error(db), -1);
+        return;
+    }
+    char *sql = crdt_table_sql(tbl, node_id, uses_packed_hlc(db), uses_path_clocks(db), uses_rowid_changes(db),
+                               uses_node_numbers(db), dedicated, crdt_is_dedicated(db, tbl), counters);
+    char hash[17];
+    if (sql != NULL) {
+        crdt_table_hash(sql, hash);
+    }
+    if (execute_sql(context, db, sql) == SQLITE_OK) { // Use helper to execute and handle errors/freeing
+        char *kv = sqlite3_mprintf("INSERT INTO crdt_kv (key, value) VALUES ('table:' || %Q, %Q)", tbl, hash);
+        sqlite3_exec(db, kv, NULL, NULL, NULL);
+        sqlite3_free(kv);
+    }
+}
+
+// Returns non-zero if the view of crdt table tbl exists
+static int crdt_view_exists(sqlite3 *db, const char *tbl) {
+    char *sql = sqlite3_mprintf("SELECT 0 FROM main.%w", tbl);
+    sqlite3_stmt *stmt = NULL;
+    int exists = sql != NULL && sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    return exists;
+}
+
+// crdt_create_tables(names, node_id [, options])
+//
+// crdt_create_table for every name in a JSON array, in one savepoint. A
+// table whose view exists and whose script hash in crdt_kv still matches
+// is skipped, so provisioning the same tables again on every start only
+// costs the lookups. The DDL itself cannot be prepared once and reused,
+// every statement names a different view, and SQLite rescans the schema
+// for every object it creates, so new tables still cost what
+// crdt_create_table costs. Returns the number of tables (re)created.
+static void crdt_create_tables(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    const char *node_id = (const char *)sqlite3_value_text(argv[1]);
+    if (node_id == NULL) {
+        sqlite3_result_error(context, "node_id cannot be NULL", -1);
+        return;
+    }
+    unsigned int flags = 0;
+    if (argc == 3 && parse_options(context, crdt_create_table_options, (const char *)sqlite3_value_text(argv[2]), &flags) != SQLITE_OK) {
+        return;
+    }
+    int dedicated = (flags & CRDT_OPT_DEDICATED) != 0;
+    int counters = (flags & CRDT_OPT_COUNTERS) != 0;
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (dedicated && crdt_dedicated_error(db) != NULL) {
+        sqlite3_result_error(context, crdt_dedicated_error(db), -1);
+        return;
+    }
+    if (counters && crdt_counters_error(db) != NULL) {
+        sqlite3_result_error(context, crdt_counters_error(db), -1);
+        return;
+    }
+    int packed = uses_packed_hlc(db);
+    int path_clocks = uses_path_clocks(db);
+    int rowid_changes = uses_rowid_changes(db);
+    int nodes = uses_node_numbers(db);
+
+    enum { NAMES, GET_HASH, PUT_HASH, COUNT };
+    static const char *const sql[COUNT] = {
+        "SELECT value FROM json_each(?1)",
+        "SELECT value FROM crdt_kv WHERE key = 'table:' || ?1",
+        "INSERT INTO crdt_kv (key, value) VALUES ('table:' || ?1, ?2)",
+    };
+    sqlite3_stmt *stmts[COUNT] = { NULL };
+    int rc = sqlite3_exec(db, "SAVEPOINT crdt_create_tables", NULL, NULL, NULL);
+    for (int i = 0; i < COUNT && rc == SQLITE_OK; i++) {
+        rc = sqlite3_prepare_v2(db, sql[i], -1, &stmts[i], NULL);
+    }
+
+    int created = 0;
+    const char *error = NULL;
+    // The names are read up front, moving a 'dedicated' table back drops
+    // its records table, which cannot happen while json_each is running
+    char **names = NULL;
+    int count = 0, cap = 0;
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_value(stmts[NAMES], 1, argv[0]);
+    }
+    while (rc == SQLITE_OK && error == NULL && sqlite3_step(stmts[NAMES]) == SQLITE_ROW) {
+        error = crdt_table_name_error((const char *)sqlite3_column_text(stmts[NAMES], 0));
+        if (error == NULL && count == cap) {
+            cap = cap ? cap * 2 : 8;
+            char **grown = (char **)sqlite3_realloc64(names, (sqlite3_uint64)cap * sizeof(char *));
+            if (grown == NULL) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            names = grown;
+        }
+        if (error == NULL) {
+            names[count] = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmts[NAMES], 0));
+            rc = names[count] ? SQLITE_OK : SQLITE_NOMEM;
+            if (rc == SQLITE_OK) count++;
+        }
+    }
+    if (rc == SQLITE_OK && error == NULL) {
+        rc = sqlite3_reset(stmts[NAMES]);
+    }
+    for (int i = 0; i < count && rc == SQLITE_OK && error == NULL; i++) {
+        const char *tbl = names[i];
+        char *script = crdt_table_sql(tbl, node_id, packed, path_clocks, rowid_changes, nodes, dedicated,
+                                      !dedicated && crdt_is_dedicated(db, tbl), counters);
+        if (script == NULL) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        char hash[17];
+        crdt_table_hash(script, hash);
+
+        // Compiling a query on the view looks it up in the parsed schema
+        // instead of scanning sqlite_master
+        int current = crdt_view_exists(db, tbl);
+        if (current) {
+            sqlite3_bind_text(stmts[GET_HASH], 1, tbl, -1, SQLITE_STATIC);
+            current = sqlite3_step(stmts[GET_HASH]) == SQLITE_ROW
+                && strcmp((const char *)sqlite3_column_text(stmts[GET_HASH], 0), hash) == 0;
+            rc = sqlite3_reset(stmts[GET_HASH]);
+        }
+        if (rc == SQLITE_OK && !current) {
+            rc = sqlite3_exec(db, script, NULL, NULL, NULL);
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_text(stmts[PUT_HASH], 1, tbl, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmts[PUT_HASH], 2, hash, -1, SQLITE_STATIC);
+                sqlite3_step(stmts[PUT_HASH]);
+                rc = sqlite3_reset(stmts[PUT_HASH]);
+                created++;
+            }
+        }
+        sqlite3_free(script);
+    }
+    crdt_free_names(names, count);
+    if (rc == SQLITE_OK && error == NULL) {
+        rc = sqlite3_exec(db, "RELEASE crdt_create_tables", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK || error != NULL) {
+        if (error != NULL) {
+            sqlite3_result_error(context, error, -1);
+        } else if (rc == SQLITE_NOMEM) {
+            sqlite3_result_error_nomem(context);
+        } else {
+            char *err = sqlite3_mprintf("crdt_create_tables failed: %s", sqlite3_errmsg(db));
+            sqlite3_result_error(context, err ? err : sqlite3_errmsg(db), -1);
+            sqlite3_free(err);
+        }
+    }
+    for (int i = 0; i < COUNT; i++) {
+        sqlite3_finalize(stmts[i]);
+    }
+    if (rc != SQLITE_OK || error != NULL) {
+        sqlite3_exec(db, "ROLLBACK TO crdt_create_tables; RELEASE crdt_create_tables", NULL, NULL, NULL);
+        return;
+    }
+    sqlite3_result_int(context, created);
+}
+
+
+static void crdt_remove_table(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(context, "crdt_remove_table requires 1 argument", -1);
+        return;
+    }
+
+    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
+    if (tbl == NULL) {
+        sqlite3_result_error(context, "tbl cannot be NULL", -1);
+        return;
+    }
+    // Basic validation
+    if (strchr(tbl, '"') != NULL || strchr(tbl, '\'') != NULL) {
+         sqlite3_result_error(context, "Table name cannot contain quotes", -1);
+         return;
+    }
+
+
+    // Use %w for identifiers (view/trigger names)
+    char *sql = sqlite3_mprintf(
+        "DROP VIEW IF EXISTS %w;\n"
+        "DROP TRIGGER IF EXISTS %w_insert;\n"
+        "DROP TRIGGER IF EXISTS %w_update;\n"
+        "DROP TRIGGER IF EXISTS %w_delete;\n"
+        // Optionally, remove records associated with this table?
+        // "DELETE FROM crdt_changes WHERE tbl = %Q;\n"
+        // "DELETE FROM crdt_records WHERE tbl = %Q;\n"
+        , tbl, tbl, tbl, tbl // Arguments for the 4 %w specifiers
+        // If uncommenting DELETE lines, add: , tbl, tbl
+    );
+
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (execute_sql(context, db, sql) == SQLITE_OK) { // Use helper
+        char *kv = sqlite3_mprintf("DELETE FROM crdt_kv WHERE key = 'table:' || %Q", tbl);
+        sqlite3_exec(db, kv, NULL, NULL, NULL);
+        sqlite3_free(kv);
+    }
+}
+
+static void crdt_remove(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 0) {
+        sqlite3_result_error(context, "crdt_remove requires 0 arguments", -1);
+        return;
+    }
+
+    // The records tables of 'dedicated' tables go with crdt_records, their
+    // triggers go with crdt_changes
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    int dedicated_count;
+    char **dedicated = crdt_dedicated_tables(db, &dedicated_count);
+    char *drop_dedicated = sqlite3_mprintf("");
+    for (int i = 0; i < dedicated_count && drop_dedicated != NULL; i++) {
+        char *more = sqlite3_mprintf("%sDROP TABLE IF EXISTS %w_records;\n", drop_dedicated, dedicated[i]);
+        sqlite3_free(drop_dedicated);
+        drop_dedicated = more;
+    }
+    crdt_free_names(dedicated, dedicated_count);
+
+    char *sql = dedicated_count < 0 || drop_dedicated == NULL ? NULL : sqlite3_mprintf(
+        "DROP TRIGGER IF EXISTS crdt_changes_trigger;\n" // Drop trigger before table
+        "DROP TABLE IF EXISTS crdt_changes;\n"
+        "DROP TABLE IF EXISTS crdt_kv;\n"
+        "DROP TABLE IF EXISTS crdt_records;\n"
+        "DROP TABLE IF EXISTS crdt_clocks;\n"
+        "DROP TABLE IF EXISTS crdt_counters;\n"
+        "DROP TABLE IF EXISTS crdt_digest;\n"
+        "%s"
+        // Note: This does NOT drop the individual table views/triggers created by crdt_create_table
+        // A more complete removal might involve querying sqlite_master for related views/triggers.
+        , drop_dedicated
+    );
+    sqlite3_free(drop_dedicated);
+
+    execute_sql(context, db, sql); // Use helper
+}
+
+// crdt_changes_since(peer)
+//
+// Eponymous virtual table streaming the crdt_changes rows a peer has not
+// seen yet. The watermark of a peer is the largest crdt_changes.id, the
+// local HLC a change was logged with, it was sent and lives in crdt_kv
+// under 'watermark:' || peer. A scan reads the range from the watermark to
+// the newest change at its start through the primary key and only moves
+// the watermark there once it returned the last row, so the move is
+// committed or rolled back with the caller's transaction. Scans stopped
+// early by a LIMIT leave it alone, crdt_ack(peer, id) then moves it to the
+// last id the peer got.
+//
+//     SELECT pk, tbl, data, path, op, hlc FROM crdt_changes_since('peer');
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} CrdtSinceVtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *stmt;
+    char *peer;        // Peer of the scan
+    sqlite3_value *to; // Newest id of the range, the watermark at the end
+    int eof;
+} CrdtSinceCursor;
+
+// Moves the watermark of peer forward to id, never back, returns an
+// SQLite result code
+static int crdt_watermark_advance(sqlite3 *db, const char *peer, sqlite3_value *id) {
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db,
+        "INSERT INTO crdt_kv (key, value) SELECT 'watermark:' || ?1, ?2\n"
+        "WHERE NOT EXISTS (SELECT 1 FROM crdt_kv WHERE key = 'watermark:' || ?1 AND value >= ?2)", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_text(stmt, 1, peer, -1, SQLITE_STATIC);
+    sqlite3_bind_value(stmt, 2, id);
+    sqlite3_step(stmt);
+    return sqlite3_finalize(stmt);
+}
+
+// crdt_ack(peer, id)
+//
+// Moves the crdt_changes_since watermark of peer to id, the id of the last
+// change the peer received, for scans that did not run to the end. Returns
+// 1 if the watermark moved and 0 if it already was at or past id.
+static void crdt_ack(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *peer = (const char *)sqlite3_value_text(argv[0]);
+    if (peer == NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "crdt_ack requires a peer and an id", -1);
+        return;
+    }
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    int rc = crdt_watermark_advance(db, peer, argv[1]);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        return;
+    }
+    sqlite3_result_int(context, sqlite3_changes(db) > 0);
+}
+
+#define CRDT_SINCE_PEER 10 // Column number of the hidden peer argument
+
+static int crdt_since_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab,
+                              char **err) {
+    (void)aux; (void)argc; (void)argv; (void)err;
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(id, pk, tbl, data, path, op, deleted, hlc, json, node_id, peer HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    CrdtSinceVtab *since = (CrdtSinceVtab *)sqlite3_malloc(sizeof(CrdtSinceVtab));
+    if (since == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(since, 0, sizeof(CrdtSinceVtab));
+    since->db = db;
+    // A scan writes the watermark, keep it out of triggers and views
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+    *vtab = &since->base;
+    return SQLITE_OK;
+}
+
+static int crdt_since_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int crdt_since_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    (void)vtab;
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (c->iColumn != CRDT_SINCE_PEER || c->op != SQLITE_INDEX_CONSTRAINT_EQ) {
+            continue;
+        }
+        if (!c->usable) {
+            return SQLITE_CONSTRAINT;
+        }
+        info->aConstraintUsage[i].argvIndex = 1;
+        info->aConstraintUsage[i].omit = 1;
+        info->idxNum = 1;
+        info->estimatedCost = 1000;
+        // Rows come in crdt_changes.id order
+        if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == 0 && !info->aOrderBy[0].desc) {
+            info->orderByConsumed = 1;
+        }
+        return SQLITE_OK;
+    }
+    // Without a peer there is nothing to scan, xFilter reports the error
+    info->estimatedCost = 1e99;
+    return SQLITE_OK;
+}
+
+static int crdt_since_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    (void)vtab;
+    CrdtSinceCursor *cur = (CrdtSinceCursor *)sqlite3_malloc(sizeof(CrdtSinceCursor));
+    if (cur == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(cur, 0, sizeof(CrdtSinceCursor));
+    cur->eof = 1;
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int crdt_since_close(sqlite3_vtab_cursor *cursor) {
+    CrdtSinceCursor *cur = (CrdtSinceCursor *)cursor;
+    sqlite3_finalize(cur->stmt);
+    sqlite3_free(cur->peer);
+    sqlite3_value_free(cur->to);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+// Set the error of the virtual table from the connection and return rc
+static int crdt_since_error(sqlite3_vtab *vtab, sqlite3 *db, int rc) {
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("crdt_changes_since failed: %s", sqlite3_errmsg(db));
+    return rc;
+}
+
+static int crdt_since_next(sqlite3_vtab_cursor *cursor) {
+    CrdtSinceCursor *cur = (CrdtSinceCursor *)cursor;
+    int rc = sqlite3_step(cur->stmt);
+    if (rc == SQLITE_ROW) {
+        return SQLITE_OK;
+    }
+    cur->eof = 1;
+    rc = sqlite3_reset(cur->stmt);
+    // Every change up to the end of the range was returned
+    if (rc == SQLITE_OK) {
+        rc = crdt_watermark_advance(((CrdtSinceVtab *)cursor->pVtab)->db, cur->peer, cur->to);
+    }
+    return rc == SQLITE_OK ? rc : crdt_since_error(cursor->pVtab, ((CrdtSinceVtab *)cursor->pVtab)->db, rc);
+}
+
+static int crdt_since_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc,
+                             sqlite3_value **argv) {
+    (void)idxStr; (void)argc;
+    CrdtSinceCursor *cur = (CrdtSinceCursor *)cursor;
+    sqlite3_vtab *vtab = cursor->pVtab;
+    sqlite3 *db = ((CrdtSinceVtab *)vtab)->db;
+    sqlite3_finalize(cur->stmt);
+    cur->stmt = NULL;
+    sqlite3_free(cur->peer);
+    cur->peer = NULL;
+    sqlite3_value_free(cur->to);
+    cur->to = NULL;
+    cur->eof = 1;
+    if (idxNum == 0) {
+        sqlite3_free(vtab->zErrMsg);
+        vtab->zErrMsg = sqlite3_mprintf("crdt_changes_since requires a peer");
+        return SQLITE_ERROR;
+    }
+    const char *peer = (const char *)sqlite3_value_text(argv[0]);
+    if (peer == NULL) {
+        return SQLITE_OK;
+    }
+
+    // The range is (watermark, newest id], an empty string or blob sorts
+    // before every HLC and 0 before every 'rowid' id for peers without a
+    // watermark yet
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db,
+        "SELECT (SELECT value FROM crdt_kv WHERE key = 'watermark:' || ?1),\n"
+        "       (SELECT max(id) FROM crdt_changes)", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return crdt_since_error(vtab, db, rc);
+    }
+    sqlite3_bind_text(stmt, 1, peer, -1, SQLITE_STATIC);
+    sqlite3_value *from = NULL, *to = NULL;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+        from = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+        to = sqlite3_value_dup(sqlite3_column_value(stmt, 1));
+        if (from == NULL || to == NULL) rc = SQLITE_NOMEM;
+    }
+    int step_rc = sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK) rc = step_rc;
+    if (rc == SQLITE_OK && to != NULL) {
+        cur->peer = sqlite3_mprintf("%s", peer);
+        if (cur->peer == NULL) rc = SQLITE_NOMEM;
+    }
+    if (rc == SQLITE_OK && to != NULL) {
+        rc = sqlite3_prepare_v2(db,
+            "SELECT id, pk, tbl, data, path, op, deleted, hlc, json, node_id FROM crdt_changes\n"
+            "WHERE id > ?1 AND id <= ?2 ORDER BY id", -1, &cur->stmt, NULL);
+        if (rc == SQLITE_OK) {
+            if (sqlite3_value_type(from) != SQLITE_NULL) {
+                sqlite3_bind_value(cur->stmt, 1, from);
+            } else if (sqlite3_value_type(to) == SQLITE_BLOB) {
+                sqlite3_bind_zeroblob(cur->stmt, 1, 0);
+            } else if (sqlite3_value_type(to) == SQLITE_INTEGER) {
+                sqlite3_bind_int64(cur->stmt, 1, 0);
+            } else {
+                sqlite3_bind_text(cur->stmt, 1, "", 0, SQLITE_STATIC);
+            }
+            sqlite3_bind_value(cur->stmt, 2, to);
+            cur->to = to;
+            to = NULL;
+            cur->eof = 0;
+        }
+    }
+    sqlite3_value_free(from);
+    sqlite3_value_free(to);
+    if (rc != SQLITE_OK) {
+        return rc == SQLITE_NOMEM ? rc : crdt_since_error(vtab, db, rc);
+    }
+    return cur->eof ? SQLITE_OK : crdt_since_next(cursor);
+}
+
+static int crdt_since_eof(sqlite3_vtab_cursor *cursor) {
+    return ((CrdtSinceCursor *)cursor)->eof;
+}
+
+static int crdt_since_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    CrdtSinceCursor *cur = (CrdtSinceCursor *)cursor;
+    if (column < CRDT_SINCE_PEER) {
+        sqlite3_result_value(context, sqlite3_column_value(cur->stmt, column));
+    }
+    return SQLITE_OK;
+}
+
+static int crdt_since_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+    (void)cursor;
+    *rowid = 0;
+    return SQLITE_OK;
+}
+
+static sqlite3_module crdt_since_module = {
+    0,                      // iVersion
+    NULL,                   // xCreate, eponymous only
+    crdt_since_connect,     // xConnect
+    crdt_since_best_index,  // xBestIndex
+    crdt_since_disconnect,  // xDisconnect
+    NULL,                   // xDestroy
+    crdt_since_open,        // xOpen
+    crdt_since_close,       // xClose
+    crdt_since_filter,      // xFilter
+    crdt_since_next,        // xNext
+    crdt_since_eof,         // xEof
+    crdt_since_column,      // xColumn
+    crdt_since_rowid,       // xRowid
+};
+
+// Changesets crdt_export closes once they reach this many bytes
+#define CRDT_EXPORT_SIZE (8 << 20)
+
+// crdt_export(since_hlc [, size])
+//
+// Eponymous virtual table streaming the crdt_changes rows with an HLC
+// after since_hlc, or all of them when it is NULL or missing, as binary
+// changesets for crdt_import. A changeset is closed once it holds size
+// bytes, so an export of any size only keeps one changeset in memory.
+// Changes come in crdt_changes.id order, the order they were logged in.
+//
+//     SELECT changeset FROM crdt_export('2024-01-01T00:00:00.000-0000-peer');
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} CrdtExportVtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *stmt;
+    CrdtChangesetWriter writer;
+    sqlite3_int64 size;
+    sqlite3_int64 rowid;
+    int done;                   // stmt has no more changes
+    int eof;
+} CrdtExportCursor;
+
+#define CRDT_EXPORT_SINCE 1 // Column number of the hidden since_hlc argument
+#define CRDT_EXPORT_LIMIT 2 // Column number of the hidden size argument
+
+static int crdt_export_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab,
+                               char **err) {
+    (void)aux; (void)argc; (void)argv; (void)err;
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(changeset, since_hlc HIDDEN, size HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    CrdtExportVtab *export = (CrdtExportVtab *)sqlite3_malloc(sizeof(CrdtExportVtab));
+    if (export == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(export, 0, sizeof(CrdtExportVtab));
+    export->db = db;
+    *vtab = &export->base;
+    return SQLITE_OK;
+}
+
+static int crdt_export_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+// idxNum has bit 0 set when since_hlc is given and bit 1 for size, they
+// are passed to xFilter in that order
+static int crdt_export_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    (void)vtab;
+    int args[2] = { -1, -1 };
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if ((c->iColumn != CRDT_EXPORT_SINCE && c->iColumn != CRDT_EXPORT_LIMIT) || c->op != SQLITE_INDEX_CONSTRAINT_EQ) {
+            continue;
+        }
+        if (!c->usable) {
+            return SQLITE_CONSTRAINT;
+        }
+        args[c->iColumn - CRDT_EXPORT_SINCE] = i;
+    }
+    int argv_index = 0;
+    info->idxNum = 0;
+    for (int a = 0; a < 2; a++) {
+        if (args[a] >= 0) {
+            info->aConstraintUsage[args[a]].argvIndex = ++argv_index;
+            info->aConstraintUsage[args[a]].omit = 1;
+            info->idxNum |= 1 << a;
+        }
+    }
+    info->estimatedCost = 1000;
+    return SQLITE_OK;
+}
+
+static int crdt_export_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    (void)vtab;
+    CrdtExportCursor *cur = (CrdtExportCursor *)sqlite3_malloc(sizeof(CrdtExportCursor));
+    if (cur == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(cur, 0, sizeof(CrdtExportCursor));
+    jsonb_buf_init(&cur->writer.out);
+    cur->eof = 1;
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int crdt_export_close(sqlite3_vtab_cursor *cursor) {
+    CrdtExportCursor *cur = (CrdtExportCursor *)cursor;
+    sqlite3_finalize(cur->stmt);
+    crdt_changeset_free(&cur->writer);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+// Set the error of the virtual table from the connection and return rc
+static int crdt_export_error(sqlite3_vtab *vtab, sqlite3 *db, int rc) {
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("crdt_export failed: %s", sqlite3_errmsg(db));
+    return rc;
+}
+
+// Write the next changeset
+static int crdt_export_next(sqlite3_vtab_cursor *cursor) {
+    CrdtExportCursor *cur = (CrdtExportCursor *)cursor;
+    CrdtChangesetWriter *w = &cur->writer;
+    crdt_changeset_reset(w);
+    int rc = SQLITE_OK;
+    // Every changeset gets at least one change
+    while (!cur->done && (w->out.len == CRDT_CHANGESET_MAGIC_SIZE || (sqlite3_int64)w->out.len < cur->size)
+           && !w->out.oom) {
+        if (sqlite3_step(cur->stmt) != SQLITE_ROW) {
+            cur->done = 1;
+            rc = sqlite3_reset(cur->stmt);
+            break;
+        }
+        sqlite3_stmt *stmt = cur->stmt;
+        int data = sqlite3_column_type(stmt, 5) != SQLITE_NULL;
+        crdt_changeset_add(w, (const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1),
+                           sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2),
+                           (const char *)sqlite3_column_text(stmt, 3), (const char *)sqlite3_column_text(stmt, 4),
+                           data ? sqlite3_column_blob(stmt, 5) : NULL, data ? sqlite3_column_bytes(stmt, 5) : 0);
+    }
+    if (w->out.oom) {
+        return SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        return crdt_export_error(cursor->pVtab, ((CrdtExportVtab *)cursor->pVtab)->db, rc);
+    }
+    cur->eof = w->out.len == CRDT_CHANGESET_MAGIC_SIZE;
+    cur->rowid++;
+    return SQLITE_OK;
+}
+
+static int crdt_export_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc,
+                              sqlite3_value **argv) {
+    (void)idxStr; (void)argc;
+    CrdtExportCursor *cur = (CrdtExportCursor *)cursor;
+    sqlite3 *db = ((CrdtExportVtab *)cursor->pVtab)->db;
+    sqlite3_finalize(cur->stmt);
+    cur->stmt = NULL;
+    cur->done = 0;
+    cur->rowid = 0;
+    sqlite3_value *since = (idxNum & 1) ? argv[0] : NULL;
+    sqlite3_value *size = (idxNum & 2) ? argv[(idxNum & 1) ? 1 : 0] : NULL;
+    cur->size = size != NULL && sqlite3_value_int64(size) > 0 ? sqlite3_value_int64(size) : CRDT_EXPORT_SIZE;
+    if (since != NULL && sqlite3_value_type(since) == SQLITE_NULL) {
+        since = NULL;
+    }
+
+    // Changes inserted into crdt_changes directly can hold JSON text and
+    // text HLCs in 'packed' mode
+    int packed = uses_packed_hlc(db);
+    char *sql = sqlite3_mprintf(
+        "SELECT tbl, pk, hlc_pack(hlc), path, op, jsonb(data) FROM crdt_changes%s ORDER BY id",
+        since == NULL ? "" : packed ? " WHERE hlc > hlc_pack(?1)" : " WHERE hlc_compare(hlc, ?1) > 0");
+    int rc = sql ? sqlite3_prepare_v2(db, sql, -1, &cur->stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        cur->eof = 1;
+        return rc == SQLITE_NOMEM ? rc : crdt_export_error(cursor->pVtab, db, rc);
+    }
+    if (since != NULL) {
+        sqlite3_bind_value(cur->stmt, 1, since);
+    }
+    return crdt_export_next(cursor);
+}
+
+static int crdt_export_eof(sqlite3_vtab_cursor *cursor) {
+    return ((CrdtExportCursor *)cursor)->eof;
+}
+
+static int crdt_export_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    CrdtExportCursor *cur = (CrdtExportCursor *)cursor;
+    if (column == 0) {
+        sqlite3_result_blob(context, cur->writer.out.data, (int)cur->writer.out.len, SQLITE_TRANSIENT);
+    }
+    return SQLITE_OK;
+}
+
+static int crdt_export_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+    *rowid = ((CrdtExportCursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module crdt_export_module = {
+    0,                      // iVersion
+    NULL,                   // xCreate, eponymous only
+    crdt_export_connect,    // xConnect
+    crdt_export_best_index, // xBestIndex
+    crdt_export_disconnect, // xDisconnect
+    NULL,                   // xDestroy
+    crdt_export_open,       // xOpen
+    crdt_export_close,      // xClose
+    crdt_export_filter,     // xFilter
+    crdt_export_next,       // xNext
+    crdt_export_eof,        // xEof
+    crdt_export_column,     // xColumn
+    crdt_export_rowid,      // xRowid
+};
+
+// CREATE VIRTUAL TABLE people USING crdt(node_id)
+//
+// A crdt table as a virtual table instead of a crdt_create_table view: the
+// rows of crdt_records with tbl 'people' that are not deleted, with the
+// columns of the view. Lookups and ranges on id go to the crdt_records
+// primary key through cached statements, and writes are logged to
+// crdt_changes and folded into the record in C like crdt_apply_changes
+// does, with hlc_now(node_id) as the HLC unless one is given. With 'paths'
+// clocks, or for 'pn' changes, the crdt_changes triggers apply the change.
+// An UPDATE that sets neither hlc nor op gets a new HLC and op 'patch'.
+// Dropping the table keeps its records.
+// Read statements kept per table, one for each query shape in use
+#define CRDT_VTAB_PLANS 16
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    CrdtConnection *conn;
+    char *tbl;
+    char *node_id;
+    int packed;
+    struct {
+        int plan;               // idxNum the statement was prepared for
+        sqlite3_stmt *stmt;     // Idle, NULL while a cursor has it
+    } plans[CRDT_VTAB_PLANS];
+    sqlite3_stmt **stmts;       // Write statements, prepared by the first write
+} CrdtVtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *stmt;
+    int plan;                   // idxNum of stmt, for crdt_vtab_release
+    int eof;
+} CrdtVtabCursor;
+
+// Columns of the table, as in the view of crdt_create_table
+enum {
+    CRDT_VTAB_ID,
+    CRDT_VTAB_DATA,
+    CRDT_VTAB_DELETED,
+    CRDT_VTAB_HLC,
+    CRDT_VTAB_PATH,
+    CRDT_VTAB_OP,
+    CRDT_VTAB_JSON,
+    CRDT_VTAB_NODE_ID
+};
+
+// idxNum bits, the id constraints in argv order and the ORDER BY. The
+// columns the query uses are the bits from CRDT_VTAB_COLUMNS up, the
+// others are left out of the SELECT: the generated json column costs a
+// json_extract per row and a scan of ids only is covered by
+// crdt_records_tbl.
+#define CRDT_VTAB_EQ 0x01
+#define CRDT_VTAB_GT 0x02
+#define CRDT_VTAB_GE 0x04
+#define CRDT_VTAB_LT 0x08
+#define CRDT_VTAB_LE 0x10
+#define CRDT_VTAB_ASC 0x20
+#define CRDT_VTAB_DESC 0x40
+#define CRDT_VTAB_COLUMNS 8
+
+// Statements of a write
+enum {
+    CRDT_VTAB_STAMP, // HLC of the change, the clocks in use and the data as JSONB
+    CRDT_VTAB_PACK,  // hlc_pack() of the HLC
+    CRDT_VTAB_LOG,   // Append the change to crdt_changes
+    CRDT_VTAB_LOAD,  // Current state of the record
+    CRDT_VTAB_SAVE,  // Write the folded record
+    CRDT_VTAB_ORDER, // CRDT_ORDER_SQL
+    CRDT_VTAB_COUNT
+};
+
+static int crdt_vtab_disconnect(sqlite3_vtab *vtab) {
+    CrdtVtab *vt = (CrdtVtab *)vtab;
+    for (int i = 0; i < CRDT_VTAB_PLANS; i++) {
+        sqlite3_finalize(vt->plans[i].stmt);
+    }
+    if (vt->stmts != NULL) {
+        for (int i = 0; i < CRDT_VTAB_COUNT; i++) {
+            sqlite3_finalize(vt->stmts[i]);
+        }
+        sqlite3_free(vt->stmts);
+    }
+    crdt_connection_release(vt->conn);
+    sqlite3_free(vt->tbl);
+    sqlite3_free(vt->node_id);
+    sqlite3_free(vt);
+    return SQLITE_OK;
+}
+
+static int crdt_vtab_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab,
+                             char **err) {
+    if (argc != 4) {
+        *err = sqlite3_mprintf("crdt requires a node_id: CREATE VIRTUAL TABLE %s USING crdt(node_id)", argv[2]);
+        return SQLITE_ERROR;
+    }
+    char *format = get_kv(db, "hlc_format");
+    if (format == NULL) {
+        *err = sqlite3_mprintf("crdt: no crdt tables, run crdt_create first");
+        return SQLITE_ERROR;
+    }
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(id TEXT PRIMARY KEY, data, deleted, hlc, path, op, json, node_id) WITHOUT ROWID");
+    if (rc != SQLITE_OK) {
+        sqlite3_free(format);
+        return rc;
+    }
+    CrdtVtab *vt = (CrdtVtab *)sqlite3_malloc(sizeof(CrdtVtab));
+    if (vt == NULL) {
+        sqlite3_free(format);
+        return SQLITE_NOMEM;
+    }
+    memset(vt, 0, sizeof(CrdtVtab));
+    vt->db = db;
+    vt->conn = (CrdtConnection *)aux;
+    vt->conn->refCount++;
+    vt->packed = strcmp(format, "packed") == 0;
+    sqlite3_free(format);
+    // The node ID may be quoted like any other module argument
+    const char *node_id = argv[3];
+    size_t len = strlen(node_id);
+    vt->tbl = sqlite3_mprintf("%s", argv[2]);
+    if (len >= 2 && (node_id[0] == '\'' || node_id[0] == '"') && node_id[len - 1] == node_id[0]) {
+        vt->node_id = sqlite3_malloc((int)len);
+        if (vt->node_id != NULL) {
+            size_t n = 0;
+            for (size_t i = 1; i < len - 1; i++) {
+                vt->node_id[n++] = node_id[i];
+                if (node_id[i] == node_id[0] && node_id[i + 1] == node_id[0]) i++;
+            }
+            vt->node_id[n] = '\0';
+        }
+    } else {
+        vt->node_id = sqlite3_mprintf("%s", node_id);
+    }
+    if (vt->tbl == NULL || vt->node_id == NULL) {
+        crdt_vtab_disconnect(&vt->base);
+        return SQLITE_NOMEM;
+    }
+    *vtab = &vt->base;
+    return SQLITE_OK;
+}
+
+static int crdt_vtab_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    (void)vtab;
+    static const struct { unsigned char op; int flag; } ops[] = {
+        { SQLITE_INDEX_CONSTRAINT_EQ, CRDT_VTAB_EQ },
+        { SQLITE_INDEX_CONSTRAINT_GT, CRDT_VTAB_GT },
+        { SQLITE_INDEX_CONSTRAINT_GE, CRDT_VTAB_GE },
+        { SQLITE_INDEX_CONSTRAINT_LT, CRDT_VTAB_LT },
+        { SQLITE_INDEX_CONSTRAINT_LE, CRDT_VTAB_LE },
+    };
+    int plan = 0, argv_index = 0;
+    // One constraint of each kind on id in the order of ops, with an
+    // equality the ranges are left to SQLite
+    for (int k = 0; k < 5; k++) {
+        if (k > 0 && (plan & CRDT_VTAB_EQ)) break;
+        for (int i = 0; i < info->nConstraint; i++) {
+            const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+            if (!c->usable || c->iColumn != CRDT_VTAB_ID || c->op != ops[k].op ||
+                sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY") != 0) {
+                continue;
+            }
+            plan |= ops[k].flag;
+            info->aConstraintUsage[i].argvIndex = ++argv_index;
+            info->aConstraintUsage[i].omit = 1;
+            break;
+        }
+    }
+    // Records come in id order from either crdt_records index
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == CRDT_VTAB_ID) {
+        plan |= info->aOrderBy[0].desc ? CRDT_VTAB_DESC : CRDT_VTAB_ASC;
+        info->orderByConsumed = 1;
+    }
+    plan |= (int)(info->colUsed & 0xFF) << CRDT_VTAB_COLUMNS;
+    if (plan & CRDT_VTAB_EQ) {
+        info->estimatedCost = 1;
+        info->estimatedRows = 1;
+        info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    } else if (plan & (CRDT_VTAB_GT | CRDT_VTAB_GE | CRDT_VTAB_LT | CRDT_VTAB_LE)) {
+        info->estimatedCost = 1000;
+        info->estimatedRows = 1000;
+    } else {
+        info->estimatedCost = 1000000;
+        info->estimatedRows = 1000000;
+    }
+    info->idxNum = plan;
+    return SQLITE_OK;
 }
 
-static void crdt_create_table(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 2) {
-        sqlite3_result_error(context, "crdt_create_table requires 2 arguments", -1);
-        return;
+static int crdt_vtab_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    (void)vtab;
+    CrdtVtabCursor *cur = (CrdtVtabCursor *)sqlite3_malloc(sizeof(CrdtVtabCursor));
+    if (cur == NULL) {
+        return SQLITE_NOMEM;
     }
-    // Use sqlite3_value_dup if you need the value beyond the callback scope,
-    // but text is fine here as we use it immediately.
-    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
-    const char *node_id = (const char *)sqlite3_value_text(argv[1]);
+    memset(cur, 0, sizeof(CrdtVtabCursor));
+    cur->eof = 1;
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
 
-    if (tbl == NULL || node_id == NULL) {
-        sqlite3_result_error(context, "tbl or node_id cannot be NULL", -1);
+// Hand the statement of a cursor back to the plans of the table, or
+// finalize it when they are full
+static void crdt_vtab_release(CrdtVtabCursor *cur) {
+    CrdtVtab *vt = (CrdtVtab *)cur->base.pVtab;
+    if (cur->stmt == NULL) {
         return;
     }
-    // Basic validation: Ensure table name doesn't contain quotes to avoid issues
-    // with %w or manual quoting if used. A more robust check would disallow spaces, etc.
-    if (strchr(tbl, '"') != NULL || strchr(tbl, '\'') != NULL) {
-         sqlite3_result_error(context, "Table name cannot contain quotes", -1);
-         return;
+    sqlite3_reset(cur->stmt);
+    sqlite3_clear_bindings(cur->stmt);
+    for (int i = 0; i < CRDT_VTAB_PLANS; i++) {
+        if (vt->plans[i].stmt == NULL) {
+            vt->plans[i].plan = cur->plan;
+            vt->plans[i].stmt = cur->stmt;
+            cur->stmt = NULL;
+            return;
+        }
     }
+    sqlite3_finalize(cur->stmt);
+    cur->stmt = NULL;
+}
 
-
-    // Use sqlite3_mprintf for dynamic allocation.
-    // Use %w for identifiers (table names, trigger names) - handles quoting if necessary.
-    // Use %Q for SQL string literals (values inside quotes).
-    char *sql = sqlite3_mprintf(
-        // Drop existing view/triggers first for idempotency
-        "DROP VIEW IF EXISTS %w;\n"
-        "DROP TRIGGER IF EXISTS %w_insert;\n"
-        "DROP TRIGGER IF EXISTS %w_update;\n"
-        "DROP TRIGGER IF EXISTS %w_delete;\n"
-        "\n"
-        // Create View
-        "CREATE VIEW %w AS\n"
-        "SELECT\n"
-        "  id,\n"
-        "  data,\n"
-        "  deleted,\n"
-        "  hlc,\n"
-        "  path,\n"
-        "  op,\n"
-        "  json,\n"
-        "  node_id\n"
-        "FROM crdt_records\n"
-        "WHERE tbl = %Q\n" // %Q for table name literal in WHERE clause
-        "AND deleted = 0;\n"
-        "\n"
-        // Insert Trigger
-        "CREATE TRIGGER %w_insert INSTEAD OF\n" // %w for trigger name
-        "INSERT ON %w BEGIN\n" // %w for view name
-        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
-        "VALUES (\n"
-        "        hlc_now(uuid()), -- node_id was %Q\n" // Comment updated, value removed from args
-        "        NEW.id,\n"
-        "        %Q,\n" // %Q for table name literal
-        "        jsonb(NEW.data),\n" // Assuming jsonb exists
-        "        IFNULL(NEW.op, '='),\n"
-        "        IFNULL(NEW.path, '$'),\n"
-        "        IFNULL(NEW.hlc, hlc_now(%Q))\n" // %Q for node_id literal
-        "    );\n"
-        "END;\n"
-        "\n"
-        // Update Trigger
-        "CREATE TRIGGER %w_update INSTEAD OF\n" // %w for trigger name
-        "UPDATE ON %w BEGIN\n" // %w for view name
-        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
-        "VALUES (\n"
-        "        hlc_now(uuid()), -- node_id was %Q\n" // Comment updated
-        "        NEW.id,\n"
-        "        %Q,\n" // %Q for table name literal
-        "        jsonb(NEW.data),\n" // Assuming jsonb exists
-        "        IFNULL(NEW.op, 'patch'),\n" // Default op for UPDATE is 'patch'
-        "        IFNULL(NEW.path, '$'),\n"
-        "        IFNULL(NEW.hlc, hlc_now(%Q))\n" // %Q for node_id literal
-        "    );\n"
-        "END;\n"
-        "\n"
-        // Delete Trigger
-        "CREATE TRIGGER %w_delete INSTEAD OF DELETE ON %w BEGIN\n" // %w trigger, %w view
-        "INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)\n"
-        "VALUES (\n"
-        "        hlc_now(uuid()), -- node_id was %Q\n" // Comment updated
-        "        OLD.id,\n"
-        "        %Q,\n" // %Q for table name literal
-        "        NULL,\n" // Data is NULL for delete
-        "        '=',\n"  // Op is '=' for delete (semantically replaces with NULL)
-        "        '$',\n"  // Path is '$' for delete (affects whole object)
-        "        hlc_now(%Q)\n" // %Q for node_id literal
-        "    );\n"
-        "END;\n",
-        // Arguments for %w and %Q specifiers IN ORDER:
-        tbl, tbl, tbl, tbl, // DROP statements (%w)
-        tbl,               // CREATE VIEW %w
-        tbl,               // WHERE tbl = %Q
-        tbl,               // CREATE TRIGGER %w_insert
-        tbl,               // INSERT ON %w
-        node_id,           // comment node_id %Q (now just illustrative)
-        tbl,               // VALUES tbl = %Q
-        node_id,           // VALUES hlc_now(%Q)
-        tbl,               // CREATE TRIGGER %w_update
-        tbl,               // UPDATE ON %w
-        node_id,           // comment node_id %Q (now just illustrative)
-        tbl,               // VALUES tbl = %Q
-        node_id,           // VALUES hlc_now(%Q)
-        tbl,               // CREATE TRIGGER %w_delete
-        tbl,               // DELETE ON %w
-        node_id,           // comment node_id %Q (now just illustrative)
-        tbl,               // VALUES tbl = %Q
-        node_id            // VALUES hlc_now(%Q)
-    );
-
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    execute_sql(context, db, sql); // Use helper to execute and handle errors/freeing
+static int crdt_vtab_close(sqlite3_vtab_cursor *cursor) {
+    CrdtVtabCursor *cur = (CrdtVtabCursor *)cursor;
+    crdt_vtab_release(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
 }
 
+// Set the error of the table from the connection and return rc
+static int crdt_vtab_error(CrdtVtab *vt, int rc) {
+    sqlite3_free(vt->base.zErrMsg);
+    vt->base.zErrMsg = rc == SQLITE_FORMAT
+        ? sqlite3_mprintf("%s: malformed JSON, JSONB, JSON path or HLC", vt->tbl)
+        : sqlite3_mprintf("%s failed: %s", vt->tbl, sqlite3_errmsg(vt->db));
+    return rc == SQLITE_FORMAT ? SQLITE_ERROR : rc;
+}
 
-static void crdt_remove_table(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 1) {
-        sqlite3_result_error(context, "crdt_remove_table requires 1 argument", -1);
-        return;
+static int crdt_vtab_next(sqlite3_vtab_cursor *cursor) {
+    CrdtVtabCursor *cur = (CrdtVtabCursor *)cursor;
+    int rc = sqlite3_step(cur->stmt);
+    if (rc == SQLITE_ROW) {
+        return SQLITE_OK;
     }
+    cur->eof = 1;
+    rc = sqlite3_reset(cur->stmt);
+    return rc == SQLITE_OK ? rc : crdt_vtab_error((CrdtVtab *)cursor->pVtab, rc);
+}
 
-    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
-    if (tbl == NULL) {
-        sqlite3_result_error(context, "tbl cannot be NULL", -1);
-        return;
+static int crdt_vtab_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc,
+                            sqlite3_value **argv) {
+    (void)idxStr;
+    CrdtVtabCursor *cur = (CrdtVtabCursor *)cursor;
+    CrdtVtab *vt = (CrdtVtab *)cursor->pVtab;
+    crdt_vtab_release(cur);
+    cur->eof = 1;
+    cur->plan = idxNum;
+    for (int i = 0; i < CRDT_VTAB_PLANS && cur->stmt == NULL; i++) {
+        if (vt->plans[i].stmt != NULL && vt->plans[i].plan == idxNum) {
+            cur->stmt = vt->plans[i].stmt;
+            vt->plans[i].stmt = NULL;
+        }
     }
-    // Basic validation
-    if (strchr(tbl, '"') != NULL || strchr(tbl, '\'') != NULL) {
-         sqlite3_result_error(context, "Table name cannot contain quotes", -1);
-         return;
+    if (cur->stmt == NULL) {
+        int plan = idxNum, p = 2;
+        const char *columns[] = {
+            "id", "data", "deleted", vt->packed ? "hlc_unpack(hlc)" : "hlc", "path", "op", "json", "node_id"
+        };
+        char *sql = sqlite3_mprintf("SELECT id");
+        for (int c = 1; c < 8 && sql != NULL; c++) {
+            char *more = sqlite3_mprintf("%s, %s", sql, plan & (1 << (CRDT_VTAB_COLUMNS + c)) ? columns[c] : "NULL");
+            sqlite3_free(sql);
+            sql = more;
+        }
+        if (sql != NULL) {
+            char *more = sqlite3_mprintf("%s FROM crdt_records WHERE tbl = ?1 AND deleted = 0", sql);
+            sqlite3_free(sql);
+            sql = more;
+        }
+        static const char *const ops[] = { "=", ">", ">=", "<", "<=" };
+        for (int k = 0; k < 5 && sql != NULL; k++) {
+            if (plan & (1 << k)) {
+                char *more = sqlite3_mprintf("%s AND id %s ?%d", sql, ops[k], p++);
+                sqlite3_free(sql);
+                sql = more;
+            }
+        }
+        if (sql != NULL && (plan & (CRDT_VTAB_ASC | CRDT_VTAB_DESC))) {
+            char *more = sqlite3_mprintf("%s ORDER BY id%s", sql, plan & CRDT_VTAB_DESC ? " DESC" : "");
+            sqlite3_free(sql);
+            sql = more;
+        }
+        int rc = sql ? sqlite3_prepare_v3(vt->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &cur->stmt, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) {
+            return rc == SQLITE_NOMEM ? rc : crdt_vtab_error(vt, rc);
+        }
+    }
+    sqlite3_bind_text(cur->stmt, 1, vt->tbl, -1, SQLITE_STATIC);
+    for (int i = 0; i < argc; i++) {
+        sqlite3_bind_value(cur->stmt, i + 2, argv[i]);
     }
+    cur->eof = 0;
+    return crdt_vtab_next(cursor);
+}
 
+static int crdt_vtab_eof(sqlite3_vtab_cursor *cursor) {
+    return ((CrdtVtabCursor *)cursor)->eof;
+}
 
-    // Use %w for identifiers (view/trigger names)
-    char *sql = sqlite3_mprintf(
-        "DROP VIEW IF EXISTS %w;\n"
-        "DROP TRIGGER IF EXISTS %w_insert;\n"
-        "DROP TRIGGER IF EXISTS %w_update;\n"
-        "DROP TRIGGER IF EXISTS %w_delete;\n"
-        // Optionally, remove records associated with this table?
-        // "DELETE FROM crdt_changes WHERE tbl = %Q;\n"
-        // "DELETE FROM crdt_records WHERE tbl = %Q;\n"
-        , tbl, tbl, tbl, tbl // Arguments for the 4 %w specifiers
-        // If uncommenting DELETE lines, add: , tbl, tbl
-    );
+static int crdt_vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    CrdtVtabCursor *cur = (CrdtVtabCursor *)cursor;
+    // An UPDATE only needs the columns it writes, the ones it leaves alone
+    // tell crdt_vtab_update to use the defaults
+    if (column != CRDT_VTAB_ID && column != CRDT_VTAB_DATA && sqlite3_vtab_nochange(context)) {
+        return SQLITE_OK;
+    }
+    sqlite3_result_value(context, sqlite3_column_value(cur->stmt, column));
+    return SQLITE_OK;
+}
 
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    execute_sql(context, db, sql); // Use helper
+static int crdt_vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+    (void)cursor;
+    *rowid = 0; // WITHOUT ROWID, never called
+    return SQLITE_OK;
 }
 
-static void crdt_remove(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 0) {
-        sqlite3_result_error(context, "crdt_remove requires 0 arguments", -1);
-        return;
+// Prepare the write statements of the table
+static int crdt_vtab_prepare(CrdtVtab *vt) {
+    if (vt->stmts != NULL) {
+        return SQLITE_OK;
     }
+    sqlite3_stmt **stmts = (sqlite3_stmt **)sqlite3_malloc(CRDT_VTAB_COUNT * sizeof(sqlite3_stmt *));
+    if (stmts == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(stmts, 0, CRDT_VTAB_COUNT * sizeof(sqlite3_stmt *));
+    // A given HLC moves the clock past it like the crdt_changes trigger
+    // does, hlc_now already did
+    static const char *const sql[CRDT_VTAB_COUNT] = {
+        "SELECT IFNULL(?2, hlc_now(?1)), CASE WHEN ?2 IS NOT NULL THEN hlc_recv(?2) END,\n"
+        "       IFNULL((SELECT value = 'paths' FROM crdt_kv WHERE key = 'clocks'), 0), jsonb(?3)",
+        "SELECT hlc_pack(?1)",
+        NULL, // crdt_log_sql(1)
+        "SELECT data, hlc_pack(hlc) FROM crdt_records WHERE id = ?1",
+        NULL, // crdt_save_sql("crdt_records", 1)
+        CRDT_ORDER_SQL,
+    };
+    char *log_sql = crdt_log_sql(1);
+    char *save_sql = crdt_save_sql("crdt_records", 1);
+    int rc = log_sql && save_sql ? SQLITE_OK : SQLITE_NOMEM;
+    for (int i = 0; i < CRDT_VTAB_COUNT && rc == SQLITE_OK; i++) {
+        rc = sqlite3_prepare_v3(vt->db, sql[i] ? sql[i] : i == CRDT_VTAB_LOG ? log_sql : save_sql, -1,
+                                SQLITE_PREPARE_PERSISTENT, &stmts[i], NULL);
+    }
+    sqlite3_free(log_sql);
+    sqlite3_free(save_sql);
+    if (rc != SQLITE_OK) {
+        for (int i = 0; i < CRDT_VTAB_COUNT; i++) {
+            sqlite3_finalize(stmts[i]);
+        }
+        sqlite3_free(stmts);
+        return rc;
+    }
+    vt->stmts = stmts;
+    return SQLITE_OK;
+}
 
-    // No dynamic parts, but use mprintf for consistency and ease of modification
-    // Or just use a static string literal directly with execute_sql if preferred
-    char *sql = sqlite3_mprintf(
-        "DROP TRIGGER IF EXISTS crdt_changes_trigger;\n" // Drop trigger before table
-        "DROP TABLE IF EXISTS crdt_changes;\n"
-        "DROP TABLE IF EXISTS crdt_kv;\n"
-        "DROP TABLE IF EXISTS crdt_records;\n"
-        // Note: This does NOT drop the individual table views/triggers created by crdt_create_table
-        // A more complete removal might involve querying sqlite_master for related views/triggers.
-    );
+// Log one change written through the table and fold it into its record.
+// hlc is the given HLC, NULL or an SQL NULL for a new one.
+static int crdt_vtab_write(CrdtVtab *vt, const char *pk, sqlite3_value *data, const char *path, const char *op,
+                           sqlite3_value *hlc) {
+    int rc = crdt_vtab_prepare(vt);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_stmt **stmts = vt->stmts;
+    CrdtChange change;
+    memset(&change, 0, sizeof(CrdtChange));
+    change.pk = pk;
+    change.tbl = vt->tbl;
+    change.path = path;
+    change.op = op;
 
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    execute_sql(context, db, sql); // Use helper
+    // The HLC and the JSONB stay in the stamp until the record is saved
+    sqlite3_stmt *stamp = stmts[CRDT_VTAB_STAMP];
+    int paths = 0;
+    sqlite3_bind_text(stamp, 1, vt->node_id, -1, SQLITE_STATIC);
+    if (hlc != NULL) {
+        sqlite3_bind_value(stamp, 2, hlc);
+    }
+    if (data != NULL) {
+        sqlite3_bind_value(stamp, 3, data);
+    }
+    if (sqlite3_step(stamp) == SQLITE_ROW) {
+        change.hlc = (const char *)sqlite3_column_text(stamp, 0);
+        paths = sqlite3_column_int(stamp, 2);
+        if (sqlite3_column_type(stamp, 3) != SQLITE_NULL) {
+            change.data = (const unsigned char *)sqlite3_column_blob(stamp, 3);
+            change.data_len = sqlite3_column_bytes(stamp, 3);
+        }
+    } else {
+        rc = sqlite3_reset(stamp);
+    }
+    unsigned char key[CRDT_KEY_SIZE];
+    if (rc == SQLITE_OK) {
+        rc = change.hlc != NULL ? crdt_pack_key(stmts[CRDT_VTAB_PACK], change.hlc, key, &change.key_len) : SQLITE_FORMAT;
+        change.key = key;
+    }
+
+    // Folded here unless the triggers apply the change, as with
+    // crdt_apply_changes
+    int applying = vt->conn->applying;
+    int fold = !paths && strcmp(op, "pn") != 0;
+    if (rc == SQLITE_OK) {
+        vt->conn->applying = fold;
+        rc = crdt_log_changes(vt->db, stmts[CRDT_VTAB_LOG], stmts[CRDT_VTAB_ORDER], &change, 1, vt->packed);
+        vt->conn->applying = applying;
+    }
+    if (rc == SQLITE_OK && fold) {
+        CrdtFold record;
+        memset(&record, 0, sizeof(CrdtFold));
+        rc = crdt_fold_load(&record, stmts[CRDT_VTAB_LOAD], pk);
+        if (rc == SQLITE_OK) rc = crdt_fold_apply(&record, &change);
+        if (rc == SQLITE_OK) rc = crdt_fold_save(&record, stmts[CRDT_VTAB_SAVE], &change, vt->packed);
+        crdt_fold_reset(&record);
+    }
+    sqlite3_reset(stamp);
+    sqlite3_clear_bindings(stamp);
+    return rc;
+}
+
+// Text of an UPDATE column, NULL when the UPDATE leaves it alone
+static const char *crdt_vtab_text(sqlite3_value *value) {
+    return sqlite3_value_nochange(value) ? NULL : (const char *)sqlite3_value_text(value);
+}
+
+// INSERT writes NEW.data at NEW.path ('$') with NEW.op ('='), UPDATE the
+// same with op 'patch' by default and DELETE a tombstone, as the triggers
+// of the view do
+static int crdt_vtab_update(sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite_int64 *rowid) {
+    (void)rowid;
+    CrdtVtab *vt = (CrdtVtab *)vtab;
+    int rc;
+    if (argc == 1) {
+        const char *pk = (const char *)sqlite3_value_text(argv[0]);
+        rc = pk != NULL ? crdt_vtab_write(vt, pk, NULL, "$", "=", NULL) : SQLITE_NOMEM;
+    } else {
+        sqlite3_value **row = argv + 2;
+        int insert = sqlite3_value_type(argv[0]) == SQLITE_NULL;
+        const char *pk = (const char *)sqlite3_value_text(row[CRDT_VTAB_ID]);
+        if (pk == NULL) {
+            sqlite3_free(vt->base.zErrMsg);
+            vt->base.zErrMsg = sqlite3_mprintf("%s: id cannot be NULL", vt->tbl);
+            return SQLITE_CONSTRAINT_NOTNULL;
+        }
+        // An UPDATE of the id moves the record: the old id gets a tombstone
+        // and the new one the whole row, like a delete and an insert
+        const char *old = insert ? NULL : (const char *)sqlite3_value_text(argv[0]);
+        int moved = old != NULL && strcmp(old, pk) != 0;
+        const char *path = crdt_vtab_text(row[CRDT_VTAB_PATH]);
+        const char *op = crdt_vtab_text(row[CRDT_VTAB_OP]);
+        sqlite3_value *hlc = sqlite3_value_nochange(row[CRDT_VTAB_HLC]) ? NULL : row[CRDT_VTAB_HLC];
+        rc = moved ? crdt_vtab_write(vt, old, NULL, "$", "=", NULL) : SQLITE_OK;
+        if (rc == SQLITE_OK) {
+            rc = crdt_vtab_write(vt, pk, row[CRDT_VTAB_DATA], path ? path : "$", op ? op : insert || moved ? "=" : "patch", hlc);
+        }
+    }
+    return rc == SQLITE_OK || rc == SQLITE_NOMEM ? rc : crdt_vtab_error(vt, rc);
 }
 
+static sqlite3_module crdt_vtab_module = {
+    0,                      // iVersion
+    crdt_vtab_connect,      // xCreate
+    crdt_vtab_connect,      // xConnect
+    crdt_vtab_best_index,   // xBestIndex
+    crdt_vtab_disconnect,   // xDisconnect
+    crdt_vtab_disconnect,   // xDestroy, the records stay
+    crdt_vtab_open,         // xOpen
+    crdt_vtab_close,        // xClose
+    crdt_vtab_filter,       // xFilter
+    crdt_vtab_next,         // xNext
+    crdt_vtab_eof,          // xEof
+    crdt_vtab_column,       // xColumn
+    crdt_vtab_rowid,        // xRowid
+    crdt_vtab_update,       // xUpdate
+};
+
 #ifdef _WIN32
 DLLEXPORT // Macro already defines __declspec(dllexport)
 #endif
@@ -327,12 +4625,91 @@ int sqlite3_crdt_init(
     // sqlite3_finalize(stmt);
     // Similarly check for hlc_now, hlc_compare, hlc_node_id, uuid if they are separate extensions
 
+    // Called from the crdt_changes trigger, so it has to be innocuous
+    rc = sqlite3_create_function(db, "crdt_merge", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_merge, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_merge: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_jsonb_incr", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_jsonb_incr, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_jsonb_incr: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_path_covers", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_path_covers, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_path_covers: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_restore", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_restore, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_restore: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_overlay", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_overlay, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_overlay: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
+    // The connection state is shared by crdt_applying, crdt_apply_changes,
+    // crdt_import, crdt_capture and the crdt module and freed with the last one
+    CrdtConnection *conn = crdt_connection_create();
+    if (conn == NULL) return SQLITE_NOMEM;
+    conn->refCount = 5;
+
+    rc = sqlite3_create_function_v2(db, "crdt_applying", 0, SQLITE_UTF8 | SQLITE_INNOCUOUS, conn, crdt_applying, NULL, NULL, crdt_connection_release);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_applying: %s", sqlite3_errstr(rc));
+         // SQLite already released the crdt_applying reference
+         crdt_connection_release(conn);
+         crdt_connection_release(conn);
+         crdt_connection_release(conn);
+         crdt_connection_release(conn);
+         return rc;
+    }
+
+    rc = sqlite3_create_function_v2(db, "crdt_apply_changes", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, conn, crdt_apply_changes, NULL, NULL, crdt_connection_release);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_apply_changes: %s", sqlite3_errstr(rc));
+         crdt_connection_release(conn); // The crdt_import, crdt_capture and crdt module references
+         crdt_connection_release(conn);
+         crdt_connection_release(conn);
+         return rc;
+    }
+    rc = sqlite3_create_function_v2(db, "crdt_import", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, conn, crdt_import, NULL, NULL, crdt_connection_release);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_import: %s", sqlite3_errstr(rc));
+         crdt_connection_release(conn); // The crdt_capture and crdt module references
+         crdt_connection_release(conn);
+         return rc;
+    }
+    rc = sqlite3_create_function_v2(db, "crdt_capture", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, conn, crdt_capture, NULL, NULL, crdt_connection_release);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_capture: %s", sqlite3_errstr(rc));
+         crdt_connection_release(conn); // The crdt module reference
+         return rc;
+    }
+    // SQLite releases the reference of the module if this fails too
+    rc = sqlite3_create_module_v2(db, "crdt", &crdt_vtab_module, conn, crdt_connection_release);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create module crdt: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
     rc = sqlite3_create_function(db, "crdt_create", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create, NULL, NULL);
     if (rc != SQLITE_OK) {
          *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create: %s", sqlite3_errstr(rc));
          return rc;
     }
 
+    rc = sqlite3_create_function(db, "crdt_create", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create: %s", sqlite3_errstr(rc));
+         sqlite3_create_function(db, "crdt_create", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         return rc;
+    }
+
     rc = sqlite3_create_function(db, "crdt_create_table", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create_table, NULL, NULL);
     if (rc != SQLITE_OK) {
          *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create_table: %s", sqlite3_errstr(rc));
@@ -341,6 +4718,30 @@ int sqlite3_crdt_init(
          return rc;
     }
 
+    rc = sqlite3_create_function(db, "crdt_create_table", 3, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create_table, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create_table: %s", sqlite3_errstr(rc));
+         sqlite3_create_function(db, "crdt_create", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         sqlite3_create_function(db, "crdt_create_table", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         return rc;
+    }
+
+    rc = sqlite3_create_function(db, "crdt_create_tables", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create_tables, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create_tables: %s", sqlite3_errstr(rc));
+         sqlite3_create_function(db, "crdt_create", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         sqlite3_create_function(db, "crdt_create_table", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         return rc;
+    }
+
+    rc = sqlite3_create_function(db, "crdt_create_tables", 3, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_create_tables, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_create_tables: %s", sqlite3_errstr(rc));
+         sqlite3_create_function(db, "crdt_create", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         sqlite3_create_function(db, "crdt_create_table", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         return rc;
+    }
+
     rc = sqlite3_create_function(db, "crdt_remove_table", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_remove_table, NULL, NULL);
     if (rc != SQLITE_OK) {
          *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_remove_table: %s", sqlite3_errstr(rc));
@@ -360,6 +4761,63 @@ int sqlite3_crdt_init(
          return rc;
     }
 
+    // Called from the crdt_digest triggers
+    rc = sqlite3_create_function(db, "crdt_digest_hash", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_digest_hash, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_digest_hash: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_digest_bucket", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_digest_bucket, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_digest_bucket: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_digest_bucket", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_digest_bucket, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_digest_bucket: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_digest", 2, SQLITE_UTF8, NULL, crdt_digest, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_digest: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_node", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, crdt_node, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_node: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
+    rc = sqlite3_create_function(db, "crdt_compact", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_compact, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_compact: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
+    rc = sqlite3_create_function(db, "crdt_compact", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_compact, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_compact: %s", sqlite3_errstr(rc));
+         sqlite3_create_function(db, "crdt_compact", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, NULL, NULL);
+         return rc;
+    }
+
+    rc = sqlite3_create_module(db, "crdt_changes_since", &crdt_since_module, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create module crdt_changes_since: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+    rc = sqlite3_create_function(db, "crdt_ack", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, crdt_ack, NULL, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create function crdt_ack: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
+    rc = sqlite3_create_module(db, "crdt_export", &crdt_export_module, NULL);
+    if (rc != SQLITE_OK) {
+         *pzErrMsg = sqlite3_mprintf("Failed to create module crdt_export: %s", sqlite3_errstr(rc));
+         return rc;
+    }
+
     // Add SQLITE_DIRECTONLY flag to prevent use in triggers/views if desired
     // Add SQLITE_INNOCUOUS flag if the functions don't read/write files or have side effects outside DB
 
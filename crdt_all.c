@@ -0,0 +1,56 @@
+/**
+** uuid, hlc and crdt built as one extension with a single entry point:
+**
+**     .load ./crdt_all
+**
+** (entry point sqlite3_crdt_all_init) registers everything the three
+** separate extensions do. The files are compiled as one translation unit,
+** so crdt calls the HLC code in hlc.c
+** directly (packing the HLCs of applied changes and unpacking those of
+** changesets) instead of stepping a SELECT hlc_pack(?1) or hlc_unpack(?1)
+** per change. The SQL functions used by the triggers are unchanged.
+*/
+
+// hlc.c comes first: it sets _XOPEN_SOURCE before any system header and
+// declares the sqlite3_api pointer the other two files share
+#include "hlc.c"
+
+#undef SQLITE_EXTENSION_INIT1
+#define SQLITE_EXTENSION_INIT1
+
+#define CRDT_ALL
+#include "uuid.c"
+#include "crdt.c"
+
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_crdt_all_init(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+){
+    int rc = SQLITE_OK;
+    SQLITE_EXTENSION_INIT2(pApi);
+
+    rc = sqlite3_uuid_init(db, pzErrMsg, pApi);
+    if (rc != SQLITE_OK) return rc;
+
+    rc = sqlite3_hlc_init(db, pzErrMsg, pApi);
+    if (rc != SQLITE_OK) return rc;
+
+    return sqlite3_crdt_init(db, pzErrMsg, pApi);
+}
+
+// The entry point sqlite3_load_extension derives from the file name keeps
+// only its letters, so a plain .load ./crdt_all looks for this one
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_crdtall_init(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+){
+    return sqlite3_crdt_all_init(db, pzErrMsg, pApi);
+}
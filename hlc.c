@@ -18,12 +18,31 @@
 ** The HLC is implemented as a SQLite extension with the following functions:
 **
 **     hlc_now(node_id TEXT) -> TEXT
+**     hlc_recv(remote_hlc_text TEXT) -> TEXT
 **     hlc_node_id(hlc_text TEXT) -> TEXT
 **     hlc_parse(timestamp TEXT) -> TEXT
 **     hlc_increment(hlc_text TEXT) -> TEXT
 **     hlc_merge(local_hlc_text TEXT, remote_hlc_text TEXT) -> TEXT
 **     hlc_str(hlc_text TEXT) -> TEXT
 **     hlc_compare(hlc_text1 TEXT, hlc_text2 TEXT) -> INT
+**     hlc_pack(hlc_text TEXT) -> BLOB
+**     hlc_unpack(hlc_blob BLOB) -> TEXT
+**     hlc_max(hlc) -> newest HLC of a group (aggregate)
+**     hlc_min(hlc) -> oldest HLC of a group (aggregate)
+**
+** and the HLC collation, which orders HLC text like hlc_compare for ORDER
+** BY, indexes and comparisons (hlc COLLATE HLC > ?).
+**
+** hlc_now and hlc_recv share a per-connection clock: hlc_now never returns
+** the same HLC twice on a connection (the counter is bumped within a
+** millisecond) and hlc_recv moves the clock past a remote HLC so later
+** local timestamps sort after it.
+**
+** hlc_pack encodes an HLC as a 6-byte big-endian millisecond timestamp, a
+** 2-byte big-endian counter and the node ID bytes, so that plain BLOB
+** comparison orders packed HLCs the same way hlc_compare orders the text
+** form. hlc_node_id, hlc_counter, hlc_date_time and hlc_compare accept
+** either form.
 */
 
 #define _XOPEN_SOURCE 700
@@ -63,7 +82,6 @@ static int64_t getCurrentUtcMillis() {
     return (int64_t)tv.tv_sec * 1000 + (int64_t)tv.tv_usec / 1000;
 }
 
-// Helper function to convert struct tm to UTC milliseconds since epoch
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -71,56 +89,23 @@ static int64_t getCurrentUtcMillis() {
 #include <stddef.h>
 #endif
 
-static int64_t tmToUtcMillis(struct tm *tm, long millis) {
-    time_t t = mktime(tm);
-    if (t == -1) {
-        return -1; // Indicate error
-    }
-#ifdef _WIN32
-    // For Windows, mktime uses local time, so we need to adjust for the timezone.
-    // This is a simplified approach and might not be accurate for all timezones.
-    SYSTEMTIME st;
-    TzSpecificLocalTimeToSystemTime(NULL, tm, &st);
-    FILETIME ft;
-    SystemTimeToFileTime(&st, &ft);
-    ULARGE_INTEGER uli;
-    uli.LowPart = ft.dwLowDateTime;
-    uli.HighPart = ft.dwHighDateTime;
-    return (int64_t)(uli.QuadPart / 10000) - 11644473600000LL + millis;
-#else
-    // For POSIX systems, mktime uses local time, so we need to convert to UTC.
-    // Use timegm replacement.
-
-    time_t utc_t;
-    struct tm temp_tm = *tm;
-    temp_tm.tm_isdst = 0; // Force to calculate UTC without DST.
-
-    utc_t = mktime(&temp_tm);
-    if (utc_t == -1) {
-        return -1;
-    }
-
-    //Calculate the difference between local time and UTC
-    time_t local_t = mktime(tm);
-    if (local_t == -1) {
-        return -1;
-    }
-
-    long int diff = (long int)(utc_t - local_t);
-
-    if (diff > INT_MAX || diff < INT_MIN) {
-      return -1; // diff out of range.
-    }
-
-    utc_t = local_t - (time_t)diff;
-    return (int64_t)utc_t * 1000 + millis;
-#endif
+// Helper function to convert a UTC civil date and time to milliseconds since
+// epoch without going through mktime/timegm (days-from-civil algorithm).
+static int64_t civilToUtcMillis(int year, int month, int day, int hour, int minute, int second, int millis) {
+    year -= month <= 2;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yoe = (unsigned)(year - era * 400);
+    const unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    const int64_t days = era * 146097 + (int64_t)doe - 719468;
+    return ((days * 24 + hour) * 60 + minute) * 60000 + (int64_t)second * 1000 + millis;
 }
 
 // Helper function to convert ISO 8601 string to UTC milliseconds since epoch
 static int64_t iso8601ToUtcMillis(const char *iso8601) {
     struct tm tm;
     long millis = 0;
+    memset(&tm, 0, sizeof(struct tm));
     char* dotPtr = strchr(iso8601, '.');
     if(dotPtr != NULL){
         if (strptime(iso8601, "%Y-%m-%dT%H:%M:%S.%fZ", &tm) == NULL){
@@ -141,11 +126,10 @@ static int64_t iso8601ToUtcMillis(const char *iso8601) {
         }
     }
 
-    // Assume UTC if no timezone information is provided
-    if (iso8601[strlen(iso8601) - 1] != 'Z' && strchr(iso8601, '+') == NULL && strchr(iso8601, '-') == NULL) {
-        tm.tm_isdst = 0; // Indicate that DST is not known, force UTC interpretation
-    }
-    return tmToUtcMillis(&tm, millis);
+    // HLC timestamps are always UTC, so convert the broken-down time directly
+    // instead of round-tripping through the local timezone.
+    return civilToUtcMillis(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec, (int)millis);
 }
 
 // Constructor: Hlc(DateTime dateTime, int counter, String nodeId)
@@ -164,36 +148,6 @@ static Hlc* hlc_create(int64_t dateTimeMillis, unsigned short counter, const cha
     return hlc;
 }
 
-// Constructor: Hlc.zero(String nodeId)
-static Hlc* hlc_zero(const char* nodeId) {
-    struct tm epoch_tm;
-    memset(&epoch_tm, 0, sizeof(struct tm));
-    epoch_tm.tm_year = 70 - 1900; // Year since 1900
-    epoch_tm.tm_mon = 0;          // Month (0-11)
-    epoch_tm.tm_mday = 1;         // Day of the month (1-31)
-    epoch_tm.tm_hour = 0;         // Hour (0-23)
-    epoch_tm.tm_min = 0;          // Minute (0-59)
-    epoch_tm.tm_sec = 0;          // Second (0-59)
-    epoch_tm.tm_isdst = 0;        // Not in DST
-
-    int64_t epochMillis = tmToUtcMillis(&epoch_tm, 0);
-    if (epochMillis == -1) {
-        return NULL; // Error converting time
-    }
-    return hlc_create(epochMillis, 0, nodeId);
-}
-
-// Constructor: Hlc.fromDate(DateTime dateTime, String nodeId)
-static Hlc* hlc_fromDate(int64_t dateTimeMillis, const char* nodeId) {
-    return hlc_create(dateTimeMillis, 0, nodeId);
-}
-
-// Constructor: Hlc.now(String nodeId)
-static Hlc* hlc_now(const char* nodeId) {
-    int64_t nowMillis = getCurrentUtcMillis();
-    return hlc_fromDate(nowMillis, nodeId);
-}
-
 // Constructor: Hlc.parse(String timestamp)
 static Hlc* hlc_parse(const char* timestamp) {
     if (timestamp == NULL) {
@@ -275,6 +229,111 @@ static Hlc* hlc_parse(const char* timestamp) {
     return hlc;
 }
 
+// Helper to decode a run of decimal digits, returns -1 on a non-digit
+static int parseDigits(const char* s, int n) {
+    int value = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned d = (unsigned)(s[i] - '0');
+        if (d > 9) {
+            return -1;
+        }
+        value = value * 10 + (int)d;
+    }
+    return value;
+}
+
+// Helper to decode a run of hexadecimal digits, returns -1 on a non-hex digit
+static int parseHexDigits(const char* s, int n) {
+    int value = 0;
+    for (int i = 0; i < n; i++) {
+        int c = (unsigned char)s[i];
+        int d;
+        if (c >= '0' && c <= '9') {
+            d = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            d = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            d = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        value = (value << 4) | d;
+    }
+    return value;
+}
+
+// Fast path for Hlc.parse(String timestamp)
+//
+// Decodes the canonical fixed-width layout written by hlc_str (with or
+// without the 'Z' designator):
+//
+//     YYYY-MM-DDTHH:MM:SS.mmm[Z]-CCCC-nodeId
+//
+// directly into the caller's Hlc without allocating or calling into libc
+// time functions. Returns 0 on success, or -1 if the input is not in the
+// canonical layout, in which case the caller should fall back to hlc_parse.
+static int hlc_parse_fast(const char* timestamp, Hlc* hlc) {
+    const char* s = timestamp;
+    if (s[4] != '-' || s[7] != '-' || s[10] != 'T' || s[13] != ':' ||
+        s[16] != ':' || s[19] != '.') {
+        return -1;
+    }
+    int year = parseDigits(s, 4);
+    int month = parseDigits(s + 5, 2);
+    int day = parseDigits(s + 8, 2);
+    int hour = parseDigits(s + 11, 2);
+    int minute = parseDigits(s + 14, 2);
+    int second = parseDigits(s + 17, 2);
+    int millis = parseDigits(s + 20, 3);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+        second < 0 || second > 60 || millis < 0) {
+        return -1;
+    }
+
+    s += 23;
+    if (*s == 'Z') {
+        s++;
+    }
+    if (s[0] != '-') {
+        return -1;
+    }
+    int counter = parseHexDigits(s + 1, 4);
+    if (counter < 0 || s[5] != '-') {
+        return -1;
+    }
+
+    const char* nodeId = s + 6;
+    size_t nodeIdLen = strlen(nodeId);
+    if (nodeIdLen >= MAX_NODE_ID_LENGTH) {
+        return -1;
+    }
+
+    hlc->dateTime = civilToUtcMillis(year, month, day, hour, minute, second, millis);
+    hlc->counter = (unsigned short)counter;
+    memcpy(hlc->nodeId, nodeId, nodeIdLen + 1);
+    return 0;
+}
+
+// Parse into a caller-provided Hlc, trying the fast path first and only
+// falling back to the allocating hlc_parse for non-canonical input.
+// Returns 0 on success, -1 on error.
+static int hlc_parse_into(const char* timestamp, Hlc* hlc) {
+    if (timestamp == NULL) {
+        return -1;
+    }
+    if (strlen(timestamp) > 23 && hlc_parse_fast(timestamp, hlc) == 0) {
+        return 0;
+    }
+    Hlc* parsed = hlc_parse(timestamp);
+    if (parsed == NULL) {
+        return -1;
+    }
+    *hlc = *parsed;
+    free(parsed);
+    return 0;
+}
+
 // Method: apply({DateTime? dateTime, int? counter, String? nodeId})
 static Hlc* hlc_apply(const Hlc* hlc, int64_t dateTimeMillis, unsigned short counter, const char* nodeId) {
     if (hlc == NULL) {
@@ -370,37 +429,108 @@ static Hlc* hlc_merge(const Hlc* local, const Hlc* remote, int64_t wallTimeMilli
     return finalHlc;
 }
 
-// Method: toString()
-static char* hlc_str(const Hlc* hlc) {
+// Length of YYYY-MM-DDTHH:MM:SS, and size of the largest HLC text
+// YYYY-MM-DDTHH:MM:SS.mmm-CCCC-node with its NUL, with room for the longer
+// years gmtime can return for dates far from now
+#define HLC_PREFIX_SIZE 19
+#define HLC_TEXT_MAX_SIZE (HLC_PREFIX_SIZE + 4 + 6 + MAX_NODE_ID_LENGTH + 16)
+// 10000-01-01T00:00:00, the first second without a four digit year
+#define HLC_MAX_FAST_SECOND 253402300800LL
+
+// The YYYY-MM-DDTHH:MM:SS prefix hlc_str last wrote for a second, so HLCs
+// issued within the same second copy it instead of converting the date
+typedef struct {
+    int64_t second; // -1 before the first HLC
+    char prefix[HLC_PREFIX_SIZE];
+} HlcStrCache;
+
+static void hlc_put_digits(char* p, unsigned int value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// Writes YYYY-MM-DDTHH:MM:SS of a second since epoch between 1970 and
+// 9999 into p (civil-from-days algorithm, the inverse of civilToUtcMillis)
+static void hlc_put_date_time(char* p, int64_t second) {
+    const unsigned days = (unsigned)(second / 86400);
+    const unsigned secs = (unsigned)(second % 86400);
+    const unsigned z = days + 719468;
+    const unsigned era = z / 146097;
+    const unsigned doe = z - era * 146097;
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    const unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    const unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    const unsigned year = yoe + era * 400 + (month <= 2);
+    hlc_put_digits(p, year, 4);
+    p[4] = '-';
+    hlc_put_digits(p + 5, month, 2);
+    p[7] = '-';
+    hlc_put_digits(p + 8, day, 2);
+    p[10] = 'T';
+    hlc_put_digits(p + 11, secs / 3600, 2);
+    p[13] = ':';
+    hlc_put_digits(p + 14, secs / 60 % 60, 2);
+    p[16] = ':';
+    hlc_put_digits(p + 17, secs % 60, 2);
+}
+
+// Method: toString() -> writes the text of an HLC into buf, which holds
+// HLC_TEXT_MAX_SIZE bytes, and returns its length without the NUL, or -1
+// on error. The digits are written in place, dates before 1970 or after
+// 9999 go through gmtime and snprintf. cache is the connection's
+// HlcStrCache, or NULL.
+static int hlc_str(const Hlc* hlc, char* buf, HlcStrCache* cache) {
     if (hlc == NULL) {
-        return NULL;
+        return -1;
+    }
+    const size_t nodeIdLen = strlen(hlc->nodeId);
+    const int64_t second = hlc->dateTime / 1000;
+    if (hlc->dateTime >= 0 && second < HLC_MAX_FAST_SECOND && nodeIdLen < MAX_NODE_ID_LENGTH) {
+        static const char hexDigits[] = "0123456789ABCDEF";
+        if (cache != NULL && cache->second == second) {
+            memcpy(buf, cache->prefix, HLC_PREFIX_SIZE);
+        } else {
+            hlc_put_date_time(buf, second);
+            if (cache != NULL) {
+                cache->second = second;
+                memcpy(cache->prefix, buf, HLC_PREFIX_SIZE);
+            }
+        }
+        char* p = buf + HLC_PREFIX_SIZE;
+        p[0] = '.';
+        hlc_put_digits(p + 1, (unsigned int)(hlc->dateTime % 1000), 3);
+        p[4] = '-';
+        p[5] = hexDigits[(hlc->counter >> 12) & 0xF];
+        p[6] = hexDigits[(hlc->counter >> 8) & 0xF];
+        p[7] = hexDigits[(hlc->counter >> 4) & 0xF];
+        p[8] = hexDigits[hlc->counter & 0xF];
+        p[9] = '-';
+        memcpy(p + 10, hlc->nodeId, nodeIdLen + 1);
+        return (int)(HLC_PREFIX_SIZE + 10 + nodeIdLen);
     }
+
     struct tm tm;
     time_t t = hlc->dateTime / 1000;
 #ifdef _WIN32
     errno_t err = gmtime_s(&tm, &t);
     if (err != 0) {
-        return NULL;
+        return -1;
     }
 #else
     if (gmtime_r(&t, &tm) == NULL) {
-        return NULL;
+        return -1;
     }
 #endif
 
     char dateTimeStr[32];
     strftime(dateTimeStr, sizeof(dateTimeStr), "%Y-%m-%dT%H:%M:%S", &tm);
-
-    char counterStr[5];
-    snprintf(counterStr, sizeof(counterStr), "%04X", hlc->counter);
-
-    size_t bufferSize = strlen(dateTimeStr) + 4 + 1 + 4 + 1 + strlen(hlc->nodeId) + 1;
-    char* result = (char*)malloc(bufferSize);
-    if (result == NULL) {
-        return NULL;
-    }
-    snprintf(result, bufferSize, "%s.%03lld-%s-%s", dateTimeStr, hlc->dateTime % 1000, counterStr, hlc->nodeId);
-    return result;
+    int len = snprintf(buf, HLC_TEXT_MAX_SIZE, "%s.%03lld-%04X-%s", dateTimeStr, (long long)(hlc->dateTime % 1000),
+                       hlc->counter, hlc->nodeId);
+    return len < 0 || len >= HLC_TEXT_MAX_SIZE ? -1 : len;
 }
 
 // Method: compareTo(Hlc other)
@@ -419,6 +549,126 @@ static int hlc_compareTo(const Hlc* hlc1, const Hlc* hlc2) {
     }
 }
 
+// Packed binary form: 6-byte big-endian millis, 2-byte big-endian counter
+// and the raw node ID bytes. memcmp order over the packed bytes (with the
+// shorter blob sorting first on a tie) matches hlc_compareTo.
+#define HLC_PACKED_HEADER_SIZE 8
+#define HLC_PACKED_MAX_SIZE (HLC_PACKED_HEADER_SIZE + MAX_NODE_ID_LENGTH)
+#define HLC_MAX_PACKED_DATE_TIME ((int64_t)1 << 48)
+
+// Method: pack() -> writes the packed form into buf, returns its length or -1
+static int hlc_pack(const Hlc* hlc, unsigned char* buf) {
+    if (hlc == NULL || hlc->dateTime < 0 || hlc->dateTime >= HLC_MAX_PACKED_DATE_TIME) {
+        return -1;
+    }
+    uint64_t millis = (uint64_t)hlc->dateTime;
+    for (int i = 5; i >= 0; i--) {
+        buf[i] = (unsigned char)(millis & 0xFF);
+        millis >>= 8;
+    }
+    buf[6] = (unsigned char)(hlc->counter >> 8);
+    buf[7] = (unsigned char)(hlc->counter & 0xFF);
+    size_t nodeIdLen = strlen(hlc->nodeId);
+    memcpy(buf + HLC_PACKED_HEADER_SIZE, hlc->nodeId, nodeIdLen);
+    return (int)(HLC_PACKED_HEADER_SIZE + nodeIdLen);
+}
+
+// Constructor: Hlc.unpack(Uint8List bytes), returns 0 on success, -1 on error
+static int hlc_unpack(const unsigned char* buf, int len, Hlc* hlc) {
+    if (buf == NULL || len < HLC_PACKED_HEADER_SIZE || len >= HLC_PACKED_MAX_SIZE) {
+        return -1;
+    }
+    int64_t millis = 0;
+    for (int i = 0; i < 6; i++) {
+        millis = (millis << 8) | buf[i];
+    }
+    size_t nodeIdLen = (size_t)len - HLC_PACKED_HEADER_SIZE;
+    if (memchr(buf + HLC_PACKED_HEADER_SIZE, 0, nodeIdLen) != NULL) {
+        return -1;
+    }
+    hlc->dateTime = millis;
+    hlc->counter = (unsigned short)((buf[6] << 8) | buf[7]);
+    memcpy(hlc->nodeId, buf + HLC_PACKED_HEADER_SIZE, nodeIdLen);
+    hlc->nodeId[nodeIdLen] = '\0';
+    return 0;
+}
+
+// Per-connection clock shared by hlc_now and hlc_recv, so consecutive
+// timestamps issued by one connection are unique and strictly increasing
+// and never fall behind HLCs received from other nodes.
+typedef struct {
+    Hlc last;         // Last HLC issued or received on this connection
+    HlcStrCache str;  // Date and time of the last HLC text
+    int refCount;     // Number of SQL functions holding the clock
+} HlcClock;
+
+static HlcClock* hlc_clock_create(void) {
+    HlcClock* clock = (HlcClock*)sqlite3_malloc(sizeof(HlcClock));
+    if (clock == NULL) {
+        return NULL;
+    }
+    memset(clock, 0, sizeof(HlcClock));
+    clock->str.second = -1;
+    return clock;
+}
+
+static void hlc_clock_release(void* arg) {
+    HlcClock* clock = (HlcClock*)arg;
+    if (clock != NULL && --clock->refCount <= 0) {
+        sqlite3_free(clock);
+    }
+}
+
+// Method: send() -> advances the clock for a local event, returns 0 on
+// success, -1 on clock drift
+static int hlc_clock_now(HlcClock* clock, const char* nodeId, Hlc* out) {
+    if (strlen(nodeId) >= MAX_NODE_ID_LENGTH) {
+        return -1;
+    }
+    int64_t wallTime = getCurrentUtcMillis();
+    int64_t dateTime = clock->last.dateTime;
+    unsigned int counter = clock->last.counter;
+    if (wallTime > dateTime) {
+        dateTime = wallTime;
+        counter = 0;
+    } else if (++counter > MAX_COUNTER) {
+        // Borrow the next millisecond instead of failing, bounded by MAX_DRIFT
+        dateTime++;
+        counter = 0;
+    }
+    if (dateTime - wallTime > MAX_DRIFT) {
+        return -1; // Clock drift
+    }
+    clock->last.dateTime = dateTime;
+    clock->last.counter = (unsigned short)counter;
+    strcpy(clock->last.nodeId, nodeId);
+    *out = clock->last;
+    return 0;
+}
+
+// Method: receive(Hlc remote) -> merges a remote HLC into the clock, returns
+// 0 on success, -1 on remote clock drift. A remote HLC more than MAX_DRIFT
+// ahead of the wall clock is refused: stored as is it would win against
+// every local write until the wall clock caught up. Before the connection
+// issued an HLC of its own the clock takes the node ID of the remote one.
+static int hlc_clock_recv(HlcClock* clock, const Hlc* remote, Hlc* out) {
+    Hlc* local = &clock->last;
+    if (remote->dateTime > local->dateTime ||
+        (remote->dateTime == local->dateTime && remote->counter > local->counter)) {
+        int64_t wallTime = getCurrentUtcMillis();
+        if (remote->dateTime - wallTime > MAX_DRIFT) {
+            return -1; // Remote clock drift
+        }
+        local->dateTime = (wallTime > remote->dateTime) ? wallTime : remote->dateTime;
+        local->counter = (local->dateTime == remote->dateTime) ? remote->counter : 0;
+    }
+    if (local->nodeId[0] == '\0') {
+        strcpy(local->nodeId, remote->nodeId);
+    }
+    *out = *local;
+    return 0;
+}
+
 // Function to free the memory allocated for Hlc
 static void hlc_free(Hlc* hlc) {
     if (hlc != NULL) {
@@ -428,6 +678,16 @@ static void hlc_free(Hlc* hlc) {
 
 // --- SQLite Function Implementations ---
 
+// Decode an HLC argument that is either HLC text or a packed HLC blob.
+// Returns 0 on success, -1 on error.
+static int hlc_from_value(sqlite3_value *value, Hlc* hlc) {
+    if (sqlite3_value_type(value) == SQLITE_BLOB) {
+        const unsigned char *blob = (const unsigned char*)sqlite3_value_blob(value);
+        return hlc_unpack(blob, sqlite3_value_bytes(value), hlc);
+    }
+    return hlc_parse_into((const char*)sqlite3_value_text(value), hlc);
+}
+
 static void sqlite_hlc_now(sqlite3_context *context, int argc, sqlite3_value **argv) {
     if (argc != 1) {
         sqlite3_result_error(context, "hlc_now requires exactly one argument (node_id)", -1);
@@ -438,18 +698,19 @@ static void sqlite_hlc_now(sqlite3_context *context, int argc, sqlite3_value **a
         sqlite3_result_error(context, "node_id argument must be a text value", -1);
         return;
     }
-    Hlc* hlc = hlc_now((const char*)nodeId);
-    if (hlc == NULL) {
-        sqlite3_result_error(context, "Failed to create HLC", -1);
+    HlcClock* clock = (HlcClock*)sqlite3_user_data(context);
+    Hlc hlc;
+    if (hlc_clock_now(clock, (const char*)nodeId, &hlc) != 0) {
+        sqlite3_result_error(context, "Failed to create HLC (invalid node_id or clock drift)", -1);
         return;
     }
-    char* hlcStr = hlc_str(hlc);
-    hlc_free(hlc);
-    if (hlcStr == NULL) {
+    char hlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(&hlc, hlcStr, &clock->str);
+    if (len < 0) {
         sqlite3_result_error(context, "Failed to convert HLC to string", -1);
         return;
     }
-    sqlite3_result_text(context, hlcStr, -1, sqlite3_free);
+    sqlite3_result_text64(context, hlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
 }
 
 static void sqlite_hlc_node_id(sqlite3_context *context, int argc, sqlite3_value **argv) { 
@@ -457,22 +718,16 @@ static void sqlite_hlc_node_id(sqlite3_context *context, int argc, sqlite3_value
         sqlite3_result_error(context, "hlc_node_id requires exactly one argument (hlc_text)", -1);
         return;
     }
-    const unsigned char *hlcText = sqlite3_value_text(argv[0]);
-    if (hlcText == NULL) {
-        sqlite3_result_error(context, "hlc_text argument must be a text value", -1);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "hlc_text argument must be a text or packed blob value", -1);
         return;
     }
-    Hlc* hlc = hlc_parse((const char*)hlcText);
-    if (hlc == NULL) {
+    Hlc hlc;
+    if (hlc_from_value(argv[0], &hlc) != 0) {
         sqlite3_result_error(context, "Invalid HLC text provided", -1);
         return;
     }
-    char nodeIdStr[MAX_NODE_ID_LENGTH];
-    strncpy(nodeIdStr, hlc->nodeId, MAX_NODE_ID_LENGTH - 1);
-    nodeIdStr[MAX_NODE_ID_LENGTH - 1] = '\0';
-
-    sqlite3_result_text(context, nodeIdStr, -1, SQLITE_STATIC);
-    hlc_free(hlc);
+    sqlite3_result_text(context, hlc.nodeId, -1, SQLITE_TRANSIENT);
 }
 
 static void sqlite_hlc_counter(sqlite3_context *context, int argc, sqlite3_value **argv) { 
@@ -480,18 +735,16 @@ static void sqlite_hlc_counter(sqlite3_context *context, int argc, sqlite3_value
         sqlite3_result_error(context, "hlc_counter requires exactly one argument (hlc_text)", -1);
         return;
     }
-    const unsigned char *hlcText = sqlite3_value_text(argv[0]);
-    if (hlcText == NULL) {
-        sqlite3_result_error(context, "hlc_text argument must be a text value", -1);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "hlc_text argument must be a text or packed blob value", -1);
         return;
     }
-    Hlc* hlc = hlc_parse((const char*)hlcText);
-    if (hlc == NULL) {
+    Hlc hlc;
+    if (hlc_from_value(argv[0], &hlc) != 0) {
         sqlite3_result_error(context, "Invalid HLC text provided", -1);
         return;
     }
-    sqlite3_result_int(context, hlc->counter);
-    hlc_free(hlc);
+    sqlite3_result_int(context, hlc.counter);
 }
 
 static void sqlite_hlc_date_time(sqlite3_context *context, int argc, sqlite3_value **argv) { 
@@ -499,18 +752,16 @@ static void sqlite_hlc_date_time(sqlite3_context *context, int argc, sqlite3_val
         sqlite3_result_error(context, "hlc_date_time requires exactly one argument (hlc_text)", -1);
         return;
     }
-    const unsigned char *hlcText = sqlite3_value_text(argv[0]);
-    if (hlcText == NULL) {
-        sqlite3_result_error(context, "hlc_text argument must be a text value", -1);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "hlc_text argument must be a text or packed blob value", -1);
         return;
     }
-    Hlc* hlc = hlc_parse((const char*)hlcText);
-    if (hlc == NULL) {
+    Hlc hlc;
+    if (hlc_from_value(argv[0], &hlc) != 0) {
         sqlite3_result_error(context, "Invalid HLC text provided", -1);
         return;
     }
-    sqlite3_result_int64(context, hlc->dateTime);
-    hlc_free(hlc);
+    sqlite3_result_int64(context, hlc.dateTime);
 }
 
 static void sqlite_hlc_parse(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -528,13 +779,14 @@ static void sqlite_hlc_parse(sqlite3_context *context, int argc, sqlite3_value *
         sqlite3_result_error(context, "Failed to parse HLC string", -1);
         return;
     }
-    char* hlcStr = hlc_str(hlc);
+    char hlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(hlc, hlcStr, NULL);
     hlc_free(hlc);
-    if (hlcStr == NULL) {
+    if (len < 0) {
         sqlite3_result_error(context, "Failed to convert parsed HLC to string", -1);
         return;
     }
-    sqlite3_result_text(context, hlcStr, -1, sqlite3_free);
+    sqlite3_result_text64(context, hlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
 }
 
 static void sqlite_hlc_increment(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -565,13 +817,14 @@ static void sqlite_hlc_increment(sqlite3_context *context, int argc, sqlite3_val
         sqlite3_result_error(context, "Failed to increment HLC (potential overflow or drift)", -1);
         return;
     }
-    char* incrementedHlcStr = hlc_str(incrementedHlc);
+    char incrementedHlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(incrementedHlc, incrementedHlcStr, NULL);
     hlc_free(incrementedHlc);
-    if (incrementedHlcStr == NULL) {
+    if (len < 0) {
         sqlite3_result_error(context, "Failed to convert incremented HLC to string", -1);
         return;
     }
-    sqlite3_result_text(context, incrementedHlcStr, -1, sqlite3_free);
+    sqlite3_result_text64(context, incrementedHlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
 }
 
 static void sqlite_hlc_merge(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -606,15 +859,16 @@ static void sqlite_hlc_merge(sqlite3_context *context, int argc, sqlite3_value *
         return;
     }
 
-    char* mergedHlcStr = hlc_str(mergedHlc);
+    char mergedHlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(mergedHlc, mergedHlcStr, NULL);
     hlc_free(mergedHlc);
 
-    if (mergedHlcStr == NULL) {
+    if (len < 0) {
         sqlite3_result_error(context, "Failed to convert merged HLC to string", -1);
         return;
     }
 
-    sqlite3_result_text(context, mergedHlcStr, -1, sqlite3_free);
+    sqlite3_result_text64(context, mergedHlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
 }
 
 static void sqlite_hlc_str(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -635,31 +889,307 @@ static void sqlite_hlc_compare(sqlite3_context *context, int argc, sqlite3_value
         sqlite3_result_error(context, "hlc_compare requires exactly two arguments (hlc_text1, hlc_text2)", -1);
         return;
     }
-    const unsigned char *hlcText1 = sqlite3_value_text(argv[0]);
-    const unsigned char *hlcText2 = sqlite3_value_text(argv[1]);
-
-    if (hlcText1 == NULL || hlcText2 == NULL) {
-        sqlite3_result_error(context, "HLC text arguments must be text values", -1);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "HLC arguments must be text or packed blob values", -1);
         return;
     }
 
-    Hlc* hlc1 = hlc_parse((const char*)hlcText1);
-    Hlc* hlc2 = hlc_parse((const char*)hlcText2);
-
-    if (hlc1 == NULL || hlc2 == NULL) {
+    Hlc hlc1;
+    Hlc hlc2;
+    if (hlc_from_value(argv[0], &hlc1) != 0 ||
+        hlc_from_value(argv[1], &hlc2) != 0) {
         sqlite3_result_error(context, "Invalid HLC text provided for comparison", -1);
-        hlc_free(hlc1);
-        hlc_free(hlc2);
         return;
     }
 
-    int comparisonResult = hlc_compareTo(hlc1, hlc2);
-    hlc_free(hlc1);
-    hlc_free(hlc2);
+    int comparisonResult = hlc_compareTo(&hlc1, &hlc2);
 
     sqlite3_result_int(context, comparisonResult);
 }
 
+static void sqlite_hlc_recv(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(context, "hlc_recv requires exactly one argument (remote_hlc_text)", -1);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_error(context, "remote_hlc_text argument must be a text or packed blob value", -1);
+        return;
+    }
+    Hlc remote;
+    if (hlc_from_value(argv[0], &remote) != 0) {
+        sqlite3_result_error(context, "Invalid HLC text provided", -1);
+        return;
+    }
+    HlcClock* clock = (HlcClock*)sqlite3_user_data(context);
+    Hlc merged;
+    if (hlc_clock_recv(clock, &remote, &merged) != 0) {
+        sqlite3_result_error(context, "Failed to receive HLC (remote clock drift)", -1);
+        return;
+    }
+    char mergedHlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(&merged, mergedHlcStr, &clock->str);
+    if (len < 0) {
+        sqlite3_result_error(context, "Failed to convert merged HLC to string", -1);
+        return;
+    }
+    sqlite3_result_text64(context, mergedHlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
+}
+
+static void sqlite_hlc_pack(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(context, "hlc_pack requires exactly one argument (hlc_text)", -1);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    Hlc hlc;
+    if (hlc_from_value(argv[0], &hlc) != 0) {
+        sqlite3_result_error(context, "Invalid HLC provided for packing", -1);
+        return;
+    }
+    unsigned char packed[HLC_PACKED_MAX_SIZE];
+    int packedLen = hlc_pack(&hlc, packed);
+    if (packedLen < 0) {
+        sqlite3_result_error(context, "HLC timestamp is out of range for the packed format", -1);
+        return;
+    }
+    sqlite3_result_blob(context, packed, packedLen, SQLITE_TRANSIENT);
+}
+
+static void sqlite_hlc_unpack(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(context, "hlc_unpack requires exactly one argument (hlc_blob)", -1);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    Hlc hlc;
+    if (hlc_from_value(argv[0], &hlc) != 0) {
+        sqlite3_result_error(context, "Invalid packed HLC provided", -1);
+        return;
+    }
+    char hlcStr[HLC_TEXT_MAX_SIZE];
+    int len = hlc_str(&hlc, hlcStr, NULL);
+    if (len < 0) {
+        sqlite3_result_error(context, "Failed to convert unpacked HLC to string", -1);
+        return;
+    }
+    sqlite3_result_text64(context, hlcStr, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
+}
+
+// Days in each month of a common year, for hlc_text_scan
+static const unsigned char hlcDaysInMonth[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+// Byte scan of the canonical text layout written by hlc_str:
+//
+//     YYYY-MM-DDTHH:MM:SS.mmm[Z]-CCCC-nodeId
+//
+// For a valid date in this layout the first 23 bytes sort like the time
+// they encode, so two such HLCs compare without being parsed. Returns the
+// offset of the node ID and sets *counter, or 0 for any other layout, a
+// date hlc_parse would normalize (a leap second or the 31st of a shorter
+// month) or a node ID that does not fit an Hlc, which are left to
+// hlc_parse. The text does not have to be NUL-terminated.
+static int hlc_text_scan(const unsigned char* s, int n, int* counter) {
+    if (n < 29 || s[4] != '-' || s[7] != '-' || s[10] != 'T' || s[13] != ':' ||
+        s[16] != ':' || s[19] != '.') {
+        return 0;
+    }
+    const char* c = (const char*)s;
+    int year = parseDigits(c, 4);
+    int month = parseDigits(c + 5, 2);
+    int day = parseDigits(c + 8, 2);
+    int hour = parseDigits(c + 11, 2);
+    int minute = parseDigits(c + 14, 2);
+    int second = parseDigits(c + 17, 2);
+    int millis = parseDigits(c + 20, 3);
+    int leapDay = month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > hlcDaysInMonth[month - 1] + leapDay ||
+        hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+        second < 0 || second > 59 || millis < 0) {
+        return 0;
+    }
+
+    int i = 23;
+    if (s[i] == 'Z') {
+        i++;
+    }
+    if (n < i + 6 || s[i] != '-' || s[i + 5] != '-') {
+        return 0;
+    }
+    int value = parseHexDigits(c + i + 1, 4);
+    i += 6;
+    if (value < 0 || n - i >= MAX_NODE_ID_LENGTH || memchr(s + i, 0, (size_t)(n - i)) != NULL) {
+        return 0;
+    }
+    *counter = value;
+    return i;
+}
+
+// Byte order with the shorter run first on a tie, the order of node IDs and
+// of packed HLCs
+static int hlc_compare_bytes(const unsigned char* s1, int n1, const unsigned char* s2, int n2) {
+    int result = memcmp(s1, s2, (size_t)(n1 < n2 ? n1 : n2));
+    return result != 0 ? result : n1 - n2;
+}
+
+// Decode an HLC held as text or a packed blob, returns 0 on success, -1 on error
+static int hlc_from_bytes(int type, const unsigned char* s, int n, Hlc* hlc) {
+    if (type == SQLITE_BLOB) {
+        return hlc_unpack(s, n, hlc);
+    }
+    char text[256];
+    if (n < 0 || n >= (int)sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, s, (size_t)n);
+    text[n] = '\0';
+    return hlc_parse_into(text, hlc);
+}
+
+// Compare two HLCs held as text or packed blobs (type SQLITE_TEXT or
+// SQLITE_BLOB) the way hlc_compare does. Canonical text is compared with
+// hlc_text_scan and packed blobs byte by byte, anything else is parsed.
+// Returns 0 and sets *cmp, or -1 if either is not a valid HLC.
+static int hlc_compare_raw(int type1, const unsigned char* s1, int n1,
+                           int type2, const unsigned char* s2, int n2, int* cmp) {
+    if (type1 == SQLITE_TEXT && type2 == SQLITE_TEXT) {
+        int counter1, counter2;
+        int node1 = hlc_text_scan(s1, n1, &counter1);
+        int node2 = node1 ? hlc_text_scan(s2, n2, &counter2) : 0;
+        if (node1 && node2) {
+            int result = memcmp(s1, s2, 23);
+            if (result == 0) {
+                result = counter1 - counter2;
+            }
+            if (result == 0) {
+                result = hlc_compare_bytes(s1 + node1, n1 - node1, s2 + node2, n2 - node2);
+            }
+            *cmp = result;
+            return 0;
+        }
+    } else if (type1 == SQLITE_BLOB && type2 == SQLITE_BLOB) {
+        if (n1 < HLC_PACKED_HEADER_SIZE || n1 >= HLC_PACKED_MAX_SIZE ||
+            n2 < HLC_PACKED_HEADER_SIZE || n2 >= HLC_PACKED_MAX_SIZE) {
+            return -1;
+        }
+        *cmp = hlc_compare_bytes(s1, n1, s2, n2);
+        return 0;
+    }
+    Hlc hlc1;
+    Hlc hlc2;
+    if (hlc_from_bytes(type1, s1, n1, &hlc1) != 0 || hlc_from_bytes(type2, s2, n2, &hlc2) != 0) {
+        return -1;
+    }
+    *cmp = hlc_compareTo(&hlc1, &hlc2);
+    return 0;
+}
+
+// COLLATE HLC, orders HLC text like hlc_compare. Text that is not an HLC
+// sorts before every HLC, in byte order.
+static int sqlite_hlc_collate(void* arg, int n1, const void* s1, int n2, const void* s2) {
+    (void)arg;
+    int result;
+    if (hlc_compare_raw(SQLITE_TEXT, s1, n1, SQLITE_TEXT, s2, n2, &result) == 0) {
+        return result;
+    }
+    Hlc hlc;
+    int valid1 = hlc_from_bytes(SQLITE_TEXT, s1, n1, &hlc) == 0;
+    int valid2 = hlc_from_bytes(SQLITE_TEXT, s2, n2, &hlc) == 0;
+    if (valid1 != valid2) {
+        return valid1 ? 1 : -1;
+    }
+    return hlc_compare_bytes(s1, n1, s2, n2);
+}
+
+// State of hlc_max and hlc_min: the newest or oldest HLC so far, kept as
+// the text or packed blob it came in as
+typedef struct {
+    int type;              // SQLITE_TEXT or SQLITE_BLOB, 0 before the first HLC
+    int len;
+    int cap;
+    unsigned char* value;
+} HlcAggregate;
+
+// Step of hlc_max (sign 1) and hlc_min (sign -1), NULLs are skipped like
+// max() and min() do
+static void hlc_aggregate_step(sqlite3_context *context, sqlite3_value *value, int sign) {
+    int type = sqlite3_value_type(value);
+    if (type == SQLITE_NULL) {
+        return;
+    }
+    HlcAggregate* agg = (HlcAggregate*)sqlite3_aggregate_context(context, sizeof(HlcAggregate));
+    if (agg == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    const unsigned char* bytes;
+    if (type == SQLITE_BLOB) {
+        bytes = (const unsigned char*)sqlite3_value_blob(value);
+    } else {
+        type = SQLITE_TEXT;
+        bytes = sqlite3_value_text(value);
+    }
+    int len = sqlite3_value_bytes(value);
+
+    int cmp = sign; // The first HLC is always kept
+    Hlc hlc;
+    int invalid = agg->type == 0
+        ? bytes == NULL || hlc_from_bytes(type, bytes, len, &hlc) != 0
+        : bytes == NULL || hlc_compare_raw(type, bytes, len, agg->type, agg->value, agg->len, &cmp) != 0;
+    if (invalid) {
+        sqlite3_result_error(context, sign > 0 ? "Invalid HLC provided to hlc_max" : "Invalid HLC provided to hlc_min", -1);
+        return;
+    }
+    if (cmp * sign <= 0) {
+        return;
+    }
+    if (len > agg->cap) {
+        unsigned char* grown = (unsigned char*)sqlite3_realloc(agg->value, len);
+        if (grown == NULL) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        agg->value = grown;
+        agg->cap = len;
+    }
+    memcpy(agg->value, bytes, (size_t)len);
+    agg->len = len;
+    agg->type = type;
+}
+
+static void sqlite_hlc_max_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    hlc_aggregate_step(context, argv[0], 1);
+}
+
+static void sqlite_hlc_min_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    hlc_aggregate_step(context, argv[0], -1);
+}
+
+static void sqlite_hlc_aggregate_final(sqlite3_context *context) {
+    HlcAggregate* agg = (HlcAggregate*)sqlite3_aggregate_context(context, 0);
+    if (agg == NULL || agg->type == 0) {
+        if (agg != NULL) {
+            sqlite3_free(agg->value);
+        }
+        sqlite3_result_null(context);
+        return;
+    }
+    if (agg->type == SQLITE_BLOB) {
+        sqlite3_result_blob(context, agg->value, agg->len, sqlite3_free);
+    } else {
+        sqlite3_result_text(context, (const char*)agg->value, agg->len, sqlite3_free);
+    }
+    agg->value = NULL;
+}
+
 #ifdef _WIN32
 __declspec(dllexport)
 #endif
@@ -672,7 +1202,18 @@ int sqlite3_hlc_init(
     SQLITE_EXTENSION_INIT2(pApi);
     (void)pzErrMsg;  /* Unused parameter */
 
-    rc = sqlite3_create_function(db, "hlc_now", 1, SQLITE_UTF8 | SQLITE_INNOCUOUS, NULL, sqlite_hlc_now, NULL, NULL);
+    // The clock is shared by hlc_now and hlc_recv and freed with the last one
+    HlcClock* clock = hlc_clock_create();
+    if (clock == NULL) return SQLITE_NOMEM;
+    clock->refCount = 2;
+
+    rc = sqlite3_create_function_v2(db, "hlc_now", 1, SQLITE_UTF8 | SQLITE_INNOCUOUS, clock, sqlite_hlc_now, NULL, NULL, hlc_clock_release);
+    if (rc != SQLITE_OK) {
+        hlc_clock_release(clock); // SQLite already released the hlc_now reference
+        return rc;
+    }
+
+    rc = sqlite3_create_function_v2(db, "hlc_recv", 1, SQLITE_UTF8 | SQLITE_INNOCUOUS, clock, sqlite_hlc_recv, NULL, NULL, hlc_clock_release);
     if (rc != SQLITE_OK) return rc;
 
     rc = sqlite3_create_function(db, "hlc_node_id", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, sqlite_hlc_node_id, NULL, NULL);
@@ -699,5 +1240,20 @@ int sqlite3_hlc_init(
     rc = sqlite3_create_function(db, "hlc_compare", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, sqlite_hlc_compare, NULL, NULL);
     if (rc != SQLITE_OK) return rc;
 
+    rc = sqlite3_create_function(db, "hlc_pack", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, sqlite_hlc_pack, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+
+    rc = sqlite3_create_function(db, "hlc_unpack", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, sqlite_hlc_unpack, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+
+    rc = sqlite3_create_function(db, "hlc_max", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, NULL, sqlite_hlc_max_step, sqlite_hlc_aggregate_final);
+    if (rc != SQLITE_OK) return rc;
+
+    rc = sqlite3_create_function(db, "hlc_min", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, NULL, sqlite_hlc_min_step, sqlite_hlc_aggregate_final);
+    if (rc != SQLITE_OK) return rc;
+
+    rc = sqlite3_create_collation(db, "HLC", SQLITE_UTF8, NULL, sqlite_hlc_collate);
+    if (rc != SQLITE_OK) return rc;
+
     return SQLITE_OK;
 }
\ No newline at end of file
@@ -0,0 +1,934 @@
+/**
+** Minimal reader and editor for the SQLite JSONB format, used by the crdt
+** extension to apply changes to stored documents in a single C call instead
+** of chaining json_extract / jsonb_set in SQL.
+**
+** A JSONB element is a header followed by a payload. The low four bits of
+** the first header byte are the element type and the high four bits the
+** payload size: 0-11 is the size itself, 12-15 mean the size follows as a
+** 1, 2, 4 or 8 byte big-endian integer. Arrays and objects hold their
+** children back to back, objects alternating a text label and a value.
+** See https://sqlite.org/jsonb.html
+**
+** Paths use the json_extract syntax:
+**
+**     $  .key  ."key"  [N]  [#]  [#-N]
+**
+** Nothing in here depends on SQLite.
+*/
+
+#ifndef JSONB_H
+#define JSONB_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define JSONB_NULL 0
+#define JSONB_TRUE 1
+#define JSONB_FALSE 2
+#define JSONB_INT 3
+#define JSONB_INT5 4
+#define JSONB_FLOAT 5
+#define JSONB_FLOAT5 6
+#define JSONB_TEXT 7
+#define JSONB_TEXTJ 8
+#define JSONB_TEXT5 9
+#define JSONB_TEXTRAW 10
+#define JSONB_ARRAY 11
+#define JSONB_OBJECT 12
+
+#define JSONB_MAX_DEPTH 128
+#define JSONB_MAX_HEADER 9
+
+// Result codes for the editing functions
+#define JSONB_UNCHANGED 0   // Path not found or nothing to do, use the input
+#define JSONB_CHANGED 1     // The edited document is in the output buffer
+#define JSONB_REMOVED 2     // The root itself was removed, the result is NULL
+#define JSONB_MALFORMED -1  // Malformed JSONB document or path
+#define JSONB_NOMEM -2      // Out of memory
+#define JSONB_IN_PLACE 3    // The writable input document was edited in place
+
+// Growable output buffer
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    int oom;
+} JsonbBuf;
+
+static void jsonb_buf_init(JsonbBuf *buf) {
+    memset(buf, 0, sizeof(JsonbBuf));
+}
+
+static void jsonb_buf_free(JsonbBuf *buf) {
+    free(buf->data);
+    jsonb_buf_init(buf);
+}
+
+static int jsonb_buf_reserve(JsonbBuf *buf, size_t extra) {
+    if (buf->oom) {
+        return 0;
+    }
+    if (buf->len + extra <= buf->cap) {
+        return 1;
+    }
+    size_t cap = buf->cap ? buf->cap * 2 : 64;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    unsigned char *data = (unsigned char *)realloc(buf->data, cap);
+    if (data == NULL) {
+        buf->oom = 1;
+        return 0;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 1;
+}
+
+static void jsonb_buf_append(JsonbBuf *buf, const void *data, size_t len) {
+    if (len > 0 && jsonb_buf_reserve(buf, len)) {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+}
+
+// Decode the element header at z[i], where n is the end of the enclosing
+// container (or document). Returns the header length, or 0 if malformed.
+static size_t jsonb_header(const unsigned char *z, size_t n, size_t i, int *type, size_t *payload) {
+    if (i >= n) {
+        return 0;
+    }
+    int code = z[i] >> 4;
+    if (code < 12) {
+        // Common case, the size is in the header byte itself
+        *type = z[i] & 0x0F;
+        *payload = (size_t)code;
+        return *type <= JSONB_OBJECT && (size_t)code < n - i ? 1 : 0;
+    }
+    size_t hdr = 1;
+    uint64_t size = (uint64_t)code;
+    if (code >= 12) {
+        size_t bytes = (size_t)1 << (code - 12);
+        if (n - i <= bytes) {
+            return 0;
+        }
+        size = 0;
+        for (size_t k = 1; k <= bytes; k++) {
+            size = (size << 8) | z[i + k];
+        }
+        hdr += bytes;
+    }
+    *type = z[i] & 0x0F;
+    if (*type > JSONB_OBJECT || size > (uint64_t)(n - i - hdr)) {
+        return 0;
+    }
+    *payload = (size_t)size;
+    return hdr;
+}
+
+// Length of the smallest header able to describe a payload of this size
+static size_t jsonb_header_len(size_t payload) {
+    if (payload <= 11) return 1;
+    if (payload <= 0xFF) return 2;
+    if (payload <= 0xFFFF) return 3;
+    if (payload <= 0xFFFFFFFFu) return 5;
+    return 9;
+}
+
+// Write the smallest header for type and payload size, returns its length
+static size_t jsonb_write_header(unsigned char *out, int type, size_t payload) {
+    size_t hdr = jsonb_header_len(payload);
+    if (hdr == 1) {
+        out[0] = (unsigned char)((payload << 4) | (size_t)type);
+        return 1;
+    }
+    static const unsigned char codes[] = { 0, 12, 13, 0, 14, 0, 0, 0, 15 };
+    out[0] = (unsigned char)((codes[hdr - 1] << 4) | type);
+    uint64_t size = (uint64_t)payload;
+    for (size_t k = hdr - 1; k >= 1; k--) {
+        out[k] = (unsigned char)(size & 0xFF);
+        size >>= 8;
+    }
+    return hdr;
+}
+
+// Append a complete element with the given type and payload
+static void jsonb_append_node(JsonbBuf *buf, int type, const void *payload, size_t len) {
+    unsigned char hdr[JSONB_MAX_HEADER];
+    jsonb_buf_append(buf, hdr, jsonb_write_header(hdr, type, len));
+    jsonb_buf_append(buf, payload, len);
+}
+
+// Start a container whose payload size is not known yet, returns the offset
+// to pass to jsonb_end_container once the children have been appended.
+static size_t jsonb_begin_container(JsonbBuf *buf) {
+    static const unsigned char placeholder[JSONB_MAX_HEADER] = { 0 };
+    size_t start = buf->len;
+    jsonb_buf_append(buf, placeholder, JSONB_MAX_HEADER);
+    return start;
+}
+
+static void jsonb_end_container(JsonbBuf *buf, size_t start, int type) {
+    if (buf->oom) {
+        return;
+    }
+    size_t payload = buf->len - start - JSONB_MAX_HEADER;
+    size_t hdr = jsonb_write_header(buf->data + start, type, payload);
+    memmove(buf->data + start + hdr, buf->data + start + JSONB_MAX_HEADER, payload);
+    buf->len = start + hdr + payload;
+}
+
+// Append a text element, escaping is left to the TEXTRAW type when needed
+static void jsonb_append_text(JsonbBuf *buf, const char *text, size_t len) {
+    int type = JSONB_TEXT;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x20 || c == '"' || c == '\\') {
+            type = JSONB_TEXTRAW;
+            break;
+        }
+    }
+    jsonb_append_node(buf, type, text, len);
+}
+
+static void jsonb_append_int(JsonbBuf *buf, int64_t value) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%lld", (long long)value);
+    jsonb_append_node(buf, JSONB_INT, text, (size_t)len);
+}
+
+// Floats are rendered like SQLite renders a REAL: 15 significant digits and
+// always with a decimal point or exponent. NaN becomes null.
+static void jsonb_format_real(double value, char *text, size_t size) {
+    if (isinf(value)) {
+        snprintf(text, size, "%s", value < 0 ? "-9e999" : "9e999");
+        return;
+    }
+    int len = snprintf(text, size, "%.15g", value);
+    if (strchr(text, '.') == NULL && (size_t)len + 2 < size) {
+        // 1e+20 becomes 1.0e+20, 3 becomes 3.0
+        char *exponent = strchr(text, 'e');
+        size_t at = exponent ? (size_t)(exponent - text) : (size_t)len;
+        memmove(text + at + 2, text + at, (size_t)len - at + 1);
+        memcpy(text + at, ".0", 2);
+    }
+}
+
+static void jsonb_append_real(JsonbBuf *buf, double value) {
+    if (isnan(value)) {
+        jsonb_append_node(buf, JSONB_NULL, NULL, 0);
+        return;
+    }
+    char text[40];
+    jsonb_format_real(value, text, sizeof(text));
+    jsonb_append_node(buf, JSONB_FLOAT, text, strlen(text));
+}
+
+static int jsonb_hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void jsonb_append_utf8(JsonbBuf *buf, uint32_t c) {
+    unsigned char out[4];
+    size_t len;
+    if (c < 0x80) {
+        out[0] = (unsigned char)c;
+        len = 1;
+    } else if (c < 0x800) {
+        out[0] = (unsigned char)(0xC0 | (c >> 6));
+        out[1] = (unsigned char)(0x80 | (c & 0x3F));
+        len = 2;
+    } else if (c < 0x10000) {
+        out[0] = (unsigned char)(0xE0 | (c >> 12));
+        out[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        out[2] = (unsigned char)(0x80 | (c & 0x3F));
+        len = 3;
+    } else {
+        out[0] = (unsigned char)(0xF0 | (c >> 18));
+        out[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+        out[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        out[3] = (unsigned char)(0x80 | (c & 0x3F));
+        len = 4;
+    }
+    jsonb_buf_append(buf, out, len);
+}
+
+// Append the unescaped content of a text element payload
+static void jsonb_unescape(JsonbBuf *buf, int type, const unsigned char *z, size_t n) {
+    if (type != JSONB_TEXTJ && type != JSONB_TEXT5) {
+        jsonb_buf_append(buf, z, n);
+        return;
+    }
+    size_t i = 0;
+    while (i < n) {
+        size_t run = i;
+        while (run < n && z[run] != '\\') run++;
+        jsonb_buf_append(buf, z + i, run - i);
+        i = run;
+        if (i + 1 >= n) {
+            break;
+        }
+        unsigned char c = z[i + 1];
+        i += 2;
+        switch (c) {
+            case 'b': jsonb_buf_append(buf, "\b", 1); break;
+            case 'f': jsonb_buf_append(buf, "\f", 1); break;
+            case 'n': jsonb_buf_append(buf, "\n", 1); break;
+            case 'r': jsonb_buf_append(buf, "\r", 1); break;
+            case 't': jsonb_buf_append(buf, "\t", 1); break;
+            case 'v': jsonb_buf_append(buf, "\v", 1); break;
+            case '0': jsonb_buf_append(buf, "\0", 1); break;
+            case 'x':
+                if (i + 2 <= n && jsonb_hex_value(z[i]) >= 0 && jsonb_hex_value(z[i + 1]) >= 0) {
+                    jsonb_append_utf8(buf, (uint32_t)(jsonb_hex_value(z[i]) << 4 | jsonb_hex_value(z[i + 1])));
+                    i += 2;
+                }
+                break;
+            case 'u': {
+                uint32_t code = 0;
+                int k;
+                for (k = 0; k < 4 && i + (size_t)k < n && jsonb_hex_value(z[i + k]) >= 0; k++) {
+                    code = (code << 4) | (uint32_t)jsonb_hex_value(z[i + k]);
+                }
+                if (k < 4) break;
+                i += 4;
+                // Combine a UTF-16 surrogate pair
+                if (code >= 0xD800 && code <= 0xDBFF && i + 6 <= n && z[i] == '\\' && z[i + 1] == 'u') {
+                    uint32_t low = 0;
+                    for (k = 0; k < 4 && jsonb_hex_value(z[i + 2 + k]) >= 0; k++) {
+                        low = (low << 4) | (uint32_t)jsonb_hex_value(z[i + 2 + k]);
+                    }
+                    if (k == 4 && low >= 0xDC00 && low <= 0xDFFF) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+                jsonb_append_utf8(buf, code);
+                break;
+            }
+            case '\r':
+                // JSON5 line continuation
+                if (i < n && z[i] == '\n') i++;
+                break;
+            case '\n':
+                break;
+            default:
+                jsonb_buf_append(buf, &c, 1);
+                break;
+        }
+    }
+}
+
+// Compare the label element at z[i] with a raw (unescaped) key
+static int jsonb_label_equals(const unsigned char *z, size_t i, size_t hdr, size_t payload, int type,
+                              const char *key, size_t keyLen) {
+    const unsigned char *text = z + i + hdr;
+    if (type == JSONB_TEXT || type == JSONB_TEXTRAW) {
+        return payload == keyLen && memcmp(text, key, keyLen) == 0;
+    }
+    if (type != JSONB_TEXTJ && type != JSONB_TEXT5) {
+        return 0;
+    }
+    JsonbBuf buf;
+    jsonb_buf_init(&buf);
+    jsonb_unescape(&buf, type, text, payload);
+    int equal = !buf.oom && buf.len == keyLen && (keyLen == 0 || memcmp(buf.data, key, keyLen) == 0);
+    jsonb_buf_free(&buf);
+    return equal;
+}
+
+// --- Paths ---
+
+typedef struct {
+    int isIndex;       // [N], [#] or [#-N] rather than .key
+    const char *key;   // Key for .key or ."key"
+    size_t keyLen;
+    int escaped;       // The quoted key contains JSON escapes
+    int fromEnd;       // [#] or [#-N]
+    size_t index;      // N
+} JsonbPathSegment;
+
+// Parse the next segment of a path, advancing *path. Returns 1 if a segment
+// was parsed, 0 at the end of the path and -1 if the path is malformed.
+static int jsonb_path_next(const char **path, JsonbPathSegment *seg) {
+    const char *p = *path;
+    memset(seg, 0, sizeof(JsonbPathSegment));
+    if (*p == '\0') {
+        return 0;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '"') {
+            const char *end = p + 1;
+            while (*end && *end != '"') {
+                if (*end == '\\' && end[1]) {
+                    seg->escaped = 1;
+                    end++;
+                }
+                end++;
+            }
+            if (*end != '"') return -1;
+            seg->key = p + 1;
+            seg->keyLen = (size_t)(end - p - 1);
+            p = end + 1;
+        } else {
+            seg->key = p;
+            while (*p && *p != '.' && *p != '[') p++;
+            seg->keyLen = (size_t)(p - seg->key);
+            if (seg->keyLen == 0) return -1;
+        }
+    } else if (*p == '[') {
+        p++;
+        seg->isIndex = 1;
+        if (*p == '#') {
+            seg->fromEnd = 1;
+            p++;
+            if (*p == '-') {
+                p++;
+                if (*p < '0' || *p > '9') return -1;
+            }
+        } else if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        while (*p >= '0' && *p <= '9') {
+            seg->index = seg->index * 10 + (size_t)(*p - '0');
+            p++;
+        }
+        if (*p != ']') return -1;
+        p++;
+    } else {
+        return -1;
+    }
+    *path = p;
+    return 1;
+}
+
+// Append the key of a path segment with any JSON escapes resolved
+static void jsonb_segment_key(const JsonbPathSegment *seg, JsonbBuf *out) {
+    jsonb_unescape(out, seg->escaped ? JSONB_TEXTJ : JSONB_TEXT, (const unsigned char *)seg->key, seg->keyLen);
+}
+
+// Append a label for the key of a path segment
+static void jsonb_append_label(JsonbBuf *out, const JsonbPathSegment *seg) {
+    if (seg->escaped) {
+        // Keep the escapes as written in the path
+        jsonb_append_node(out, JSONB_TEXTJ, seg->key, seg->keyLen);
+    } else {
+        jsonb_append_text(out, seg->key, seg->keyLen);
+    }
+}
+
+// A container on the way from the root to a path target
+typedef struct {
+    size_t start;     // Offset of the container header
+    size_t hdr;       // Header length
+    size_t end;       // Offset just past the container payload
+    int type;
+} JsonbAncestor;
+
+// Result of resolving a path in a document
+typedef struct {
+    JsonbAncestor ancestors[JSONB_MAX_DEPTH];
+    int depth;
+    int found;
+    size_t start;       // Target element (when found)
+    size_t end;
+    size_t memberStart; // Label offset for object members, otherwise start
+    int canCreate;      // The missing segment can be added to the innermost ancestor
+    size_t insertAt;    // Where a new member goes (end of that ancestor's payload)
+    const char *rest;   // Path from the first missing segment onwards
+} JsonbLocation;
+
+// Resolve path in the n-byte document z. Returns 0 on success (check
+// loc->found) or JSONB_MALFORMED.
+static int jsonb_locate(const unsigned char *z, size_t n, const char *path, JsonbLocation *loc) {
+    int type;
+    size_t payload;
+    size_t hdr = jsonb_header(z, n, 0, &type, &payload);
+    // Only the header fields, ancestors are filled in as the path is walked
+    loc->depth = 0;
+    loc->found = 0;
+    loc->canCreate = 0;
+    if (hdr == 0 || hdr + payload != n || path == NULL || path[0] != '$') {
+        return JSONB_MALFORMED;
+    }
+    const char *p = path + 1;
+    size_t start = 0;
+    size_t memberStart = 0;
+    for (;;) {
+        const char *segStart = p;
+        JsonbPathSegment seg;
+        int rc = jsonb_path_next(&p, &seg);
+        if (rc < 0) {
+            return JSONB_MALFORMED;
+        }
+        if (rc == 0) {
+            loc->found = 1;
+            loc->start = start;
+            loc->end = start + hdr + payload;
+            loc->memberStart = memberStart;
+            return 0;
+        }
+        int expected = seg.isIndex ? JSONB_ARRAY : JSONB_OBJECT;
+        if (type != expected) {
+            return 0; // Not found and cannot be created here
+        }
+        if (loc->depth >= JSONB_MAX_DEPTH) {
+            return JSONB_MALFORMED;
+        }
+        size_t end = start + hdr + payload;
+        JsonbAncestor *ancestor = &loc->ancestors[loc->depth++];
+        ancestor->start = start;
+        ancestor->hdr = hdr;
+        ancestor->end = end;
+        ancestor->type = type;
+
+        size_t i = start + hdr;
+        int matched = 0;
+        if (seg.isIndex) {
+            size_t target = seg.index;
+            if (seg.fromEnd) {
+                size_t count = 0;
+                for (size_t k = i; k < end; count++) {
+                    int t;
+                    size_t sz;
+                    size_t h = jsonb_header(z, end, k, &t, &sz);
+                    if (h == 0) return JSONB_MALFORMED;
+                    k += h + sz;
+                }
+                target = seg.index <= count ? count - seg.index : (size_t)-1;
+            }
+            size_t k = 0;
+            for (; i < end; k++) {
+                size_t h = jsonb_header(z, end, i, &type, &payload);
+                if (h == 0) return JSONB_MALFORMED;
+                if (k == target) {
+                    matched = 1;
+                    memberStart = i;
+                    hdr = h;
+                    break;
+                }
+                i += h + payload;
+            }
+            if (!matched && k == target) {
+                // One past the last element, like [#], appends
+                loc->canCreate = 1;
+                loc->insertAt = end;
+                loc->rest = segStart;
+                return 0;
+            }
+        } else {
+            const char *key = seg.key;
+            size_t keyLen = seg.keyLen;
+            JsonbBuf unescaped;
+            unescaped.data = NULL;
+            unescaped.oom = 0;
+            if (seg.escaped) {
+                jsonb_buf_init(&unescaped);
+                jsonb_segment_key(&seg, &unescaped);
+                key = unescaped.len ? (const char *)unescaped.data : "";
+                keyLen = unescaped.len;
+            }
+            int malformed = unescaped.oom;
+            while (!malformed && i < end) {
+                int labelType;
+                size_t labelSize;
+                size_t h = jsonb_header(z, end, i, &labelType, &labelSize);
+                size_t value = i + h + labelSize;
+                size_t vh = h ? jsonb_header(z, end, value, &type, &payload) : 0;
+                if (vh == 0) {
+                    malformed = 1;
+                } else if ((labelType == JSONB_TEXT || labelType == JSONB_TEXTRAW)
+                               ? labelSize == keyLen && memcmp(z + i + h, key, keyLen) == 0
+                               : jsonb_label_equals(z, i, h, labelSize, labelType, key, keyLen)) {
+                    matched = 1;
+                    memberStart = i;
+                    i = value;
+                    hdr = vh;
+                    break;
+                } else {
+                    i = value + vh + payload;
+                }
+            }
+            if (seg.escaped) {
+                jsonb_buf_free(&unescaped);
+            }
+            if (malformed) {
+                return JSONB_MALFORMED;
+            }
+            if (!matched) {
+                loc->canCreate = 1;
+                loc->insertAt = end;
+                loc->rest = segStart;
+                return 0;
+            }
+        }
+        if (!matched) {
+            return 0;
+        }
+        start = i;
+    }
+}
+
+// Write z to out with the bytes [from, to) replaced by repl, growing or
+// shrinking the payload of every ancestor in loc to match.
+static void jsonb_splice(const unsigned char *z, size_t n, const JsonbLocation *loc, size_t from, size_t to,
+                         const unsigned char *repl, size_t replLen, JsonbBuf *out) {
+    size_t payloads[JSONB_MAX_DEPTH];
+    int64_t delta = (int64_t)replLen - (int64_t)(to - from);
+    for (int k = loc->depth - 1; k >= 0; k--) {
+        const JsonbAncestor *a = &loc->ancestors[k];
+        payloads[k] = (size_t)((int64_t)(a->end - a->start - a->hdr) + delta);
+        delta += (int64_t)jsonb_header_len(payloads[k]) - (int64_t)a->hdr;
+    }
+    jsonb_buf_reserve(out, (size_t)((int64_t)n + delta));
+    size_t prev = 0;
+    for (int k = 0; k < loc->depth; k++) {
+        const JsonbAncestor *a = &loc->ancestors[k];
+        unsigned char hdr[JSONB_MAX_HEADER];
+        jsonb_buf_append(out, z + prev, a->start - prev);
+        jsonb_buf_append(out, hdr, jsonb_write_header(hdr, a->type, payloads[k]));
+        prev = a->start + a->hdr;
+    }
+    jsonb_buf_append(out, z + prev, from - prev);
+    jsonb_buf_append(out, repl, replLen);
+    jsonb_buf_append(out, z + to, n - to);
+}
+
+// Build what has to be inserted for a missing path: a label for a missing
+// key followed by value, wrapped in a new object for every further key and
+// a new array for every further [0] or [#]. Returns 0 or JSONB_UNCHANGED if the
+// path cannot be created.
+static int jsonb_build_missing(const char *rest, const unsigned char *value, size_t valueLen, JsonbBuf *out) {
+    JsonbPathSegment segs[JSONB_MAX_DEPTH];
+    int count = 0;
+    const char *p = rest;
+    while (count < JSONB_MAX_DEPTH && jsonb_path_next(&p, &segs[count]) == 1) {
+        count++;
+    }
+    if (*p != '\0') {
+        return JSONB_UNCHANGED;
+    }
+    // A new array is empty, so [0] and [#] are the only indexes in it
+    for (int k = 1; k < count; k++) {
+        if (segs[k].isIndex && segs[k].index != 0) return JSONB_UNCHANGED;
+    }
+    if (!segs[0].isIndex) {
+        jsonb_append_label(out, &segs[0]);
+    }
+    size_t starts[JSONB_MAX_DEPTH];
+    for (int k = 1; k < count; k++) {
+        starts[k] = jsonb_begin_container(out);
+        if (!segs[k].isIndex) {
+            jsonb_append_label(out, &segs[k]);
+        }
+    }
+    jsonb_buf_append(out, value, valueLen);
+    for (int k = count - 1; k >= 1; k--) {
+        jsonb_end_container(out, starts[k], segs[k].isIndex ? JSONB_ARRAY : JSONB_OBJECT);
+    }
+    return 0;
+}
+
+typedef enum {
+    JSONB_EDIT_SET,     // jsonb_set: replace or create
+    JSONB_EDIT_INSERT,  // jsonb_insert: create only
+    JSONB_EDIT_REPLACE, // jsonb_replace: replace only
+    JSONB_EDIT_REMOVE   // jsonb_remove
+} JsonbEditMode;
+
+// Apply a jsonb_set / jsonb_insert / jsonb_replace / jsonb_remove style edit
+// of the element value (ignored for remove) at a location resolved with
+// jsonb_locate. Returns one of the JSONB_* result codes; on JSONB_CHANGED
+// the new document is in out.
+static int jsonb_edit_at(const unsigned char *z, size_t n, const JsonbLocation *location, JsonbEditMode mode,
+                         const unsigned char *value, size_t valueLen, JsonbBuf *out) {
+    const JsonbLocation loc = *location;
+    if (loc.found) {
+        if (mode == JSONB_EDIT_INSERT) {
+            return JSONB_UNCHANGED;
+        }
+        if (mode == JSONB_EDIT_REMOVE) {
+            if (loc.depth == 0) {
+                return JSONB_REMOVED;
+            }
+            jsonb_splice(z, n, &loc, loc.memberStart, loc.end, NULL, 0, out);
+        } else {
+            // Keep the label of an object member, replace only its value
+            jsonb_splice(z, n, &loc, loc.start, loc.end, value, valueLen, out);
+        }
+    } else {
+        if (!loc.canCreate || mode == JSONB_EDIT_REPLACE || mode == JSONB_EDIT_REMOVE) {
+            return JSONB_UNCHANGED;
+        }
+        JsonbBuf member;
+        jsonb_buf_init(&member);
+        int rc = jsonb_build_missing(loc.rest, value, valueLen, &member);
+        if (rc == 0 && !member.oom) {
+            jsonb_splice(z, n, &loc, loc.insertAt, loc.insertAt, member.data, member.len, out);
+        }
+        int oom = member.oom;
+        jsonb_buf_free(&member);
+        if (rc != 0) {
+            return rc;
+        }
+        if (oom) {
+            return JSONB_NOMEM;
+        }
+    }
+    return out->oom ? JSONB_NOMEM : JSONB_CHANGED;
+}
+
+// Overwrite the element found at loc in the writable document z with value
+// when both take the same number of bytes, so no container header changes.
+// Returns 1 if z was overwritten, 0 if the caller has to splice instead.
+static int jsonb_overwrite_at(unsigned char *z, const JsonbLocation *loc, const unsigned char *value,
+                              size_t valueLen) {
+    if (!loc->found || loc->end - loc->start != valueLen) {
+        return 0;
+    }
+    memcpy(z + loc->start, value, valueLen);
+    return 1;
+}
+
+// jsonb_edit_at for a path that has not been resolved yet
+static int jsonb_edit(const unsigned char *z, size_t n, const char *path, JsonbEditMode mode,
+                      const unsigned char *value, size_t valueLen, JsonbBuf *out) {
+    JsonbLocation loc;
+    if (jsonb_locate(z, n, path, &loc) != 0) {
+        return JSONB_MALFORMED;
+    }
+    return jsonb_edit_at(z, n, &loc, mode, value, valueLen, out);
+}
+
+// --- Merge patch (RFC 7396) ---
+
+// Find the member of the object element at z[start] whose label equals the
+// label element at l[li]. Returns the offset of the member value or 0.
+static size_t jsonb_object_find(const unsigned char *z, size_t start, size_t end,
+                                const unsigned char *l, size_t li, size_t lend) {
+    int labelType;
+    size_t labelSize;
+    size_t lh = jsonb_header(l, lend, li, &labelType, &labelSize);
+    if (lh == 0) {
+        return 0;
+    }
+    JsonbBuf key;
+    jsonb_buf_init(&key);
+    jsonb_unescape(&key, labelType, l + li + lh, labelSize);
+    size_t found = 0;
+    int type;
+    size_t payload;
+    size_t hdr = jsonb_header(z, end, start, &type, &payload);
+    size_t i = start + hdr;
+    size_t stop = start + hdr + payload;
+    while (!key.oom && hdr != 0 && i < stop) {
+        int t;
+        size_t sz;
+        size_t h = jsonb_header(z, stop, i, &t, &sz);
+        if (h == 0) break;
+        size_t value = i + h + sz;
+        if (jsonb_label_equals(z, i, h, sz, t, key.len ? (const char *)key.data : "", key.len)) {
+            found = value;
+            break;
+        }
+        size_t vh = jsonb_header(z, stop, value, &t, &sz);
+        if (vh == 0) break;
+        i = value + vh + sz;
+    }
+    jsonb_buf_free(&key);
+    return found;
+}
+
+// Append the result of merge-patching the element at t[ti] (or nothing when
+// t is NULL) with the patch element at p[pi]. Returns 0 or JSONB_MALFORMED.
+static int jsonb_patch(const unsigned char *t, size_t ti, size_t tend,
+                       const unsigned char *p, size_t pi, size_t pend, JsonbBuf *out, int depth) {
+    int ptype, ttype = -1;
+    size_t psize, tsize = 0, thdr = 0;
+    size_t phdr = jsonb_header(p, pend, pi, &ptype, &psize);
+    if (phdr == 0 || depth > JSONB_MAX_DEPTH) {
+        return JSONB_MALFORMED;
+    }
+    if (ptype != JSONB_OBJECT) {
+        jsonb_buf_append(out, p + pi, phdr + psize);
+        return 0;
+    }
+    if (t != NULL) {
+        thdr = jsonb_header(t, tend, ti, &ttype, &tsize);
+        if (thdr == 0) return JSONB_MALFORMED;
+    }
+    size_t container = jsonb_begin_container(out);
+    size_t pstart = pi + phdr, pstop = pstart + psize;
+
+    // Members of the target, patched or removed where the patch has them
+    if (ttype == JSONB_OBJECT) {
+        size_t i = ti + thdr, stop = i + tsize;
+        while (i < stop) {
+            int lt, vt;
+            size_t ls, vs;
+            size_t lh = jsonb_header(t, stop, i, &lt, &ls);
+            if (lh == 0) return JSONB_MALFORMED;
+            size_t value = i + lh + ls;
+            size_t vh = jsonb_header(t, stop, value, &vt, &vs);
+            if (vh == 0) return JSONB_MALFORMED;
+            size_t patched = jsonb_object_find(p, pi, pend, t, i, stop);
+            if (patched == 0) {
+                jsonb_buf_append(out, t + i, value + vh + vs - i);
+            } else if ((p[patched] & 0x0F) != JSONB_NULL) {
+                jsonb_buf_append(out, t + i, lh + ls);
+                if (jsonb_patch(t, value, stop, p, patched, pstop, out, depth + 1) != 0) {
+                    return JSONB_MALFORMED;
+                }
+            }
+            i = value + vh + vs;
+        }
+    }
+
+    // Members only present in the patch
+    size_t i = pstart;
+    while (i < pstop) {
+        int lt, vt;
+        size_t ls, vs;
+        size_t lh = jsonb_header(p, pstop, i, &lt, &ls);
+        if (lh == 0) return JSONB_MALFORMED;
+        size_t value = i + lh + ls;
+        size_t vh = jsonb_header(p, pstop, value, &vt, &vs);
+        if (vh == 0) return JSONB_MALFORMED;
+        if (vt != JSONB_NULL && (ttype != JSONB_OBJECT || jsonb_object_find(t, ti, tend, p, i, pstop) == 0)) {
+            jsonb_buf_append(out, p + i, lh + ls);
+            if (jsonb_patch(NULL, 0, 0, p, value, pstop, out, depth + 1) != 0) {
+                return JSONB_MALFORMED;
+            }
+        }
+        i = value + vh + vs;
+    }
+    jsonb_end_container(out, container, JSONB_OBJECT);
+    return 0;
+}
+
+// --- Values ---
+
+#define JSONB_VALUE_NULL 0
+#define JSONB_VALUE_INT 1
+#define JSONB_VALUE_REAL 2
+
+// An element converted the way json_extract hands it to SQL arithmetic
+typedef struct {
+    int type;   // JSONB_VALUE_*
+    int64_t i;
+    double r;
+} JsonbNumber;
+
+// Convert text to a number like SQL arithmetic does: the longest numeric
+// prefix, or 0 when there is none.
+static void jsonb_text_to_number(const char *text, JsonbNumber *num) {
+    char *end;
+    while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r') text++;
+    num->type = JSONB_VALUE_INT;
+    num->i = 0;
+    num->r = strtod(text, &end);
+    if (end == text) {
+        return;
+    }
+    const char *digits = text + (*text == '-' || *text == '+');
+    if (strncmp(digits, "0x", 2) == 0 || strncmp(digits, "0X", 2) == 0) {
+        num->i = strtoll(text, NULL, 16);
+        return;
+    }
+    if (strcspn(text, ".eEnNiI") >= (size_t)(end - text)) {
+        errno = 0;
+        long long value = strtoll(text, NULL, 10);
+        if (errno != ERANGE) {
+            num->i = value;
+            return;
+        }
+    }
+    num->type = JSONB_VALUE_REAL;
+}
+
+// Read the element at z[i] as a number. Missing elements and nulls are NULL,
+// booleans are 1 and 0, containers are 0.
+static void jsonb_to_number(const unsigned char *z, size_t n, size_t i, JsonbNumber *num) {
+    int type;
+    size_t payload;
+    size_t hdr = z != NULL ? jsonb_header(z, n, i, &type, &payload) : 0;
+    memset(num, 0, sizeof(JsonbNumber));
+    if (hdr == 0 || type == JSONB_NULL) {
+        num->type = JSONB_VALUE_NULL;
+        return;
+    }
+    if (type == JSONB_TRUE || type == JSONB_FALSE) {
+        num->type = JSONB_VALUE_INT;
+        num->i = type == JSONB_TRUE;
+        return;
+    }
+    if (type == JSONB_ARRAY || type == JSONB_OBJECT) {
+        num->type = JSONB_VALUE_INT;
+        return;
+    }
+    const unsigned char *digits = z + i + hdr;
+    if (type == JSONB_INT && payload > 0 && payload <= 18) {
+        // Plain decimal integers that cannot overflow, the usual counter
+        int negative = digits[0] == '-';
+        size_t k = (size_t)negative;
+        int64_t value = 0;
+        while (k < payload && digits[k] >= '0' && digits[k] <= '9') {
+            value = value * 10 + (digits[k++] - '0');
+        }
+        if (k == payload && k > (size_t)negative) {
+            num->type = JSONB_VALUE_INT;
+            num->i = negative ? -value : value;
+            return;
+        }
+    }
+    if (type != JSONB_TEXTJ && type != JSONB_TEXT5 && payload < 64) {
+        char text[64];
+        memcpy(text, digits, payload);
+        text[payload] = '\0';
+        jsonb_text_to_number(text, num);
+        return;
+    }
+    JsonbBuf text;
+    jsonb_buf_init(&text);
+    jsonb_unescape(&text, type, digits, payload);
+    jsonb_buf_append(&text, "", 1);
+    if (!text.oom) {
+        jsonb_text_to_number((const char *)text.data, num);
+    }
+    jsonb_buf_free(&text);
+}
+
+// Append the text json_extract would hand to SQL for the element at z[i]
+// (numbers as written, strings unescaped). Returns 0 for NULL, containers
+// and missing elements, 1 otherwise.
+static int jsonb_to_text(const unsigned char *z, size_t n, size_t i, JsonbBuf *out) {
+    int type;
+    size_t payload;
+    size_t hdr = z != NULL ? jsonb_header(z, n, i, &type, &payload) : 0;
+    if (hdr == 0 || type == JSONB_NULL || type == JSONB_ARRAY || type == JSONB_OBJECT) {
+        return 0;
+    }
+    if (type == JSONB_TRUE || type == JSONB_FALSE) {
+        jsonb_buf_append(out, type == JSONB_TRUE ? "1" : "0", 1);
+    } else if (type == JSONB_FLOAT || type == JSONB_FLOAT5) {
+        JsonbNumber num;
+        char text[40];
+        jsonb_to_number(z, n, i, &num);
+        jsonb_format_real(num.r, text, sizeof(text));
+        jsonb_buf_append(out, text, strlen(text));
+    } else {
+        jsonb_unescape(out, type, z + i + hdr, payload);
+    }
+    return 1;
+}
+
+#endif /* JSONB_H */
@@ -0,0 +1,27 @@
+-- make check: crdt_import refuses malformed changesets and applies none of
+-- their changes. Errors do not stop the script, make check compares its
+-- output with test/check-errors.out.
+.load ./uuid
+.load ./hlc
+.load ./crdt
+SELECT crdt_create('3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+SELECT crdt_create_table('tasks', '3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+INSERT INTO tasks (id, data) VALUES ('t1', '{"title":"Write"}'), ('t2', '{"title":"Ship"}');
+CREATE TEMP TABLE changesets AS SELECT changeset FROM crdt_export(NULL);
+DELETE FROM crdt_changes;
+DELETE FROM crdt_records;
+
+-- Cut short, an unknown header, empty, trailing bytes and not a blob
+SELECT crdt_import(substr(changeset, 1, length(changeset) - 3)) FROM changesets;
+SELECT crdt_import(x'00');
+SELECT crdt_import(x'');
+SELECT crdt_import(unhex(hex(changeset) || '00')) FROM changesets;
+SELECT crdt_import('{"pk":"t1"}');
+
+.testcase import-malformed
+SELECT (SELECT count(*) FROM crdt_changes), (SELECT count(*) FROM crdt_records);
+.check 0|0
+
+.testcase import-valid
+SELECT sum(crdt_import(changeset)) FROM changesets;
+.check 2
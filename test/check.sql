@@ -0,0 +1,390 @@
+-- make check: the query plans of the crdt indexes and the upgrade of a
+-- database from before they existed. Run from the repository root with the
+-- extensions built, every .check stops the script with an error when its
+-- output differs.
+.bail on
+.load ./uuid
+.load ./hlc
+.load ./crdt
+
+-- crdt_changes, crdt_records and a people table as crdt_create and
+-- crdt_create_table left them before the indexes: deleted and node_id are
+-- VIRTUAL columns
+CREATE TABLE crdt_changes (
+    id TEXT NOT NULL PRIMARY KEY DEFAULT (hlc_now('3afeb0e0-d9a6-424b-b60d-af86c06a4799')),
+    pk TEXT NOT NULL,
+    tbl TEXT NOT NULL,
+    data BLOB,
+    path TEXT NOT NULL DEFAULT ('$'),
+    op TEXT NOT NULL DEFAULT ('='),
+    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) VIRTUAL,
+    hlc TEXT NOT NULL,
+    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,
+    node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) VIRTUAL
+);
+INSERT INTO crdt_changes VALUES('2024-06-15T12:34:56.789-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60', '1', 'people', jsonb('{"name":"Ada"}'), '$', '=', '2024-06-15T12:34:56.789-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+INSERT INTO crdt_changes VALUES('2024-06-15T12:34:56.789-0001-0b9a4f3c-2d1e-4f5a-8b7c-6d5e4f3a2b1c', '2', 'people', jsonb('{"name":"Grace"}'), '$', '=', '2024-06-15T12:34:56.789-0001-3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+INSERT INTO crdt_changes VALUES('2024-06-15T12:34:57.000-0000-5e4d3c2b-1a09-4f8e-9d7c-6b5a49382716', '1', 'people', jsonb('{"age":36}'), '$', 'patch', '2024-06-15T12:34:57.000-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+INSERT INTO crdt_changes VALUES('2024-06-15T12:34:58.000-0000-9f8e7d6c-5b4a-4392-8170-6f5e4d3c2b1a', '2', 'people', NULL, '$', '=', '2024-06-15T12:34:58.000-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+CREATE TABLE crdt_kv (
+    key TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE,
+    value
+);
+CREATE TABLE crdt_records (
+    id TEXT NOT NULL PRIMARY KEY,
+    tbl TEXT NOT NULL,
+    data BLOB,
+    deleted BOOLEAN GENERATED ALWAYS AS (data IS NULL) VIRTUAL,
+    hlc TEXT NOT NULL,
+    path TEXT,
+    op TEXT,
+    json GENERATED ALWAYS AS (json_extract(data,'$')) VIRTUAL,
+    node_id TEXT NOT NULL GENERATED ALWAYS AS (hlc_node_id(hlc)) VIRTUAL
+);
+INSERT INTO crdt_records VALUES('1', 'people', jsonb('{"name":"Ada","age":36}'), '2024-06-15T12:34:57.000-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799', '$', 'patch');
+INSERT INTO crdt_records VALUES('2', 'people', NULL, '2024-06-15T12:34:58.000-0000-3afeb0e0-d9a6-424b-b60d-af86c06a4799', '$', '=');
+CREATE VIEW people AS
+SELECT
+  id,
+  data,
+  deleted,
+  hlc,
+  path,
+  op,
+  json,
+  node_id
+FROM crdt_records
+WHERE tbl = 'people'
+AND deleted = 0;
+CREATE TRIGGER crdt_changes_trigger
+AFTER INSERT ON crdt_changes
+BEGIN
+    INSERT INTO crdt_records (id, tbl, data, hlc, op, path)
+    VALUES (
+            NEW.pk,
+            NEW.tbl,
+            jsonb(NEW.data), 
+            NEW.hlc,
+            IFNULL(NEW.op, '='),
+            IFNULL(NEW.path, '$')
+        ) ON CONFLICT (id) DO
+    UPDATE
+    SET data = (
+        CASE
+            WHEN NEW.deleted THEN NULL 
+            WHEN NEW.op = 'set' THEN jsonb_set(data, NEW.path, jsonb(NEW.data))
+            WHEN NEW.op = 'insert' THEN jsonb_insert(data, NEW.path, jsonb(NEW.data))
+            WHEN NEW.op = 'patch' THEN jsonb_patch(data, jsonb(NEW.data))
+            WHEN NEW.op = 'remove' THEN jsonb_remove(data, NEW.path)
+            WHEN NEW.op = 'replace' THEN jsonb_replace(data, NEW.path, jsonb(NEW.data))
+            WHEN NEW.op = '=' THEN jsonb_set(data, NEW.path, jsonb(NEW.data))
+            WHEN NEW.op = '+' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) + json_extract(NEW.data, '$')))
+            WHEN NEW.op = '-' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) - json_extract(NEW.data, '$')))
+            WHEN NEW.op = '*' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) * json_extract(NEW.data, '$')))
+            WHEN NEW.op = '/' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) / json_extract(NEW.data, '$')))
+            WHEN NEW.op = '%' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) % json_extract(NEW.data, '$')))
+            WHEN NEW.op = '&' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) & json_extract(NEW.data, '$')))
+            WHEN NEW.op = '|' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) | json_extract(NEW.data, '$')))
+            WHEN NEW.op = '||' THEN jsonb_set(data, NEW.path, jsonb(json_extract(data, NEW.path) || json_extract(NEW.data, '$')))
+            ELSE data 
+        END
+    ),
+    hlc = NEW.hlc,
+    path = IFNULL(NEW.path, '$'),
+    op = IFNULL(NEW.op, '=')
+    WHERE hlc_compare(NEW.hlc, crdt_records.hlc) > 0;
+END;
+CREATE TRIGGER people_insert INSTEAD OF
+INSERT ON people BEGIN
+INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)
+VALUES (
+        hlc_now(uuid()), -- node_id was '3afeb0e0-d9a6-424b-b60d-af86c06a4799'
+        NEW.id,
+        'people',
+        jsonb(NEW.data),
+        IFNULL(NEW.op, '='),
+        IFNULL(NEW.path, '$'),
+        IFNULL(NEW.hlc, hlc_now('3afeb0e0-d9a6-424b-b60d-af86c06a4799'))
+    );
+END
+;
+CREATE TRIGGER people_update INSTEAD OF
+UPDATE ON people BEGIN
+INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)
+VALUES (
+        hlc_now(uuid()), -- node_id was '3afeb0e0-d9a6-424b-b60d-af86c06a4799'
+        NEW.id,
+        'people',
+        jsonb(NEW.data),
+        IFNULL(NEW.op, 'patch'),
+        IFNULL(NEW.path, '$'),
+        IFNULL(NEW.hlc, hlc_now('3afeb0e0-d9a6-424b-b60d-af86c06a4799'))
+    );
+END
+;
+CREATE TRIGGER people_delete INSTEAD OF DELETE ON people BEGIN
+INSERT INTO crdt_changes (id, pk, tbl, data, op, path, hlc)
+VALUES (
+        hlc_now(uuid()), -- node_id was '3afeb0e0-d9a6-424b-b60d-af86c06a4799'
+        OLD.id,
+        'people',
+        NULL,
+        '=',
+        '$',
+        hlc_now('3afeb0e0-d9a6-424b-b60d-af86c06a4799')
+    );
+END
+;
+
+-- crdt_create copies the tables to the new layout
+SELECT crdt_create('3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+
+.testcase upgrade-integrity
+PRAGMA integrity_check;
+.check ok
+
+.testcase upgrade-rows
+SELECT (SELECT count(*) FROM crdt_changes), group_concat(id || '=' || json(data), ' ') FROM people;
+.check '4|1={"name":"Ada","age":36}'
+
+-- The views, the changes of a table and the changes of a node each read
+-- through their index
+.testcase plan-view
+EXPLAIN QUERY PLAN SELECT id, json FROM people;
+.check "*SEARCH crdt_records USING INDEX crdt_records_tbl (tbl=? AND deleted=?)*"
+
+.testcase plan-changes-tbl
+EXPLAIN QUERY PLAN SELECT pk, data, hlc FROM crdt_changes WHERE tbl = 'people' AND hlc > '2024-06-15T12:34:57.000-0000-';
+.check "*SEARCH crdt_changes USING INDEX crdt_changes_tbl (tbl=? AND hlc>?)*"
+
+.testcase plan-changes-node-id
+EXPLAIN QUERY PLAN SELECT pk, tbl, data, hlc FROM crdt_changes WHERE node_id = '3afeb0e0-d9a6-424b-b60d-af86c06a4799' AND hlc > '2024-06-15T12:34:57.000-0000-';
+.check "*SEARCH crdt_changes USING INDEX crdt_changes_node_id (node_id=? AND hlc>?)*"
+
+-- The upgraded tables keep taking writes through the old view
+.testcase upgrade-write
+INSERT INTO people (id, data) VALUES ('3', '{"name":"Edsger"}');
+SELECT group_concat(id || '=' || json(data), ' ') FROM people;
+.check '1={"name":"Ada","age":36} 3={"name":"Edsger"}'
+
+.testcase upgrade-write-integrity
+PRAGMA integrity_check;
+.check ok
+
+-- A change from a node whose clock runs far ahead is refused, kept it would
+-- win against every local write. crdt_apply_changes skips it and counts the
+-- rest, the local writes after it win.
+SELECT crdt_create_table('notes', '3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+
+.testcase skew-apply
+SELECT crdt_apply_changes('[{"pk":"n1","tbl":"notes","data":{"v":"remote"},"hlc":"2099-01-01T00:00:00.000-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60"},{"pk":"n2","tbl":"notes","data":{"v":"remote"},"hlc":"2024-06-15T12:35:00.000-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60"}]');
+.check 1
+
+.testcase skew-local-write
+INSERT INTO notes (id, data) VALUES ('n1', '{"v":"local"}');
+UPDATE notes SET data = '{"v":"local"}', hlc = NULL WHERE id = 'n2';
+SELECT group_concat(id || '=' || json(data), ' ') FROM notes;
+.check 'n1={"v":"local"} n2={"v":"local"}'
+
+-- crdt_compact removes the changes that no longer make up a record: a
+-- newer '=' at '$' replaced them, or their record is a tombstone past its
+-- grace period. Without watermarks only the tombstones go, with them the
+-- replaced changes every peer has been sent. A peer that comes later still
+-- gets every record, through crdt_changes_since or crdt_export.
+SELECT crdt_create_table('tasks', '3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+INSERT INTO tasks (id, data) VALUES ('t1', '{"title":"Write"}');
+UPDATE tasks SET data = '{"title":"Review"}', op = '=', hlc = NULL WHERE id = 't1';
+INSERT INTO tasks (id, data) VALUES ('t2', '{"title":"Ship"}');
+UPDATE tasks SET data = '{"done":true}', op = 'patch', hlc = NULL WHERE id = 't2';
+INSERT INTO tasks (id, data) VALUES ('t3', '{"title":"Drop"}');
+DELETE FROM tasks WHERE id = 't3';
+SELECT crdt_compact('9999-12-31T23:59:59.999-0000-z');
+
+.testcase compact-without-watermarks
+SELECT group_concat(pk || op, ' ') FROM (SELECT pk, op FROM crdt_changes WHERE tbl = 'tasks' ORDER BY id);
+.check 't1= t1= t2= t2patch'
+
+SELECT count(*) FROM crdt_changes_since('p1');
+SELECT crdt_compact('9999-12-31T23:59:59.999-0000-z');
+
+.testcase compact-with-watermarks
+SELECT group_concat(pk || op, ' ') FROM (SELECT pk, op FROM crdt_changes WHERE tbl = 'tasks' ORDER BY id);
+.check 't1= t2= t2patch'
+
+.testcase compact-new-peer
+SELECT group_concat(pk || op || json(data), ' ') FROM crdt_changes_since('p2') WHERE tbl = 'tasks';
+.check 't1={"title":"Review"} t2={"title":"Ship"} t2patch{"done":true}'
+
+-- A second connection imports the export into an empty database, the
+-- changesets go through an in-memory database both connections attach
+ATTACH 'file:/check_xfer?vfs=memdb' AS xfer;
+CREATE TABLE xfer.changesets AS SELECT changeset FROM crdt_export(NULL);
+.connection 1
+.load ./uuid
+.load ./hlc
+.load ./crdt
+SELECT crdt_create('7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60');
+ATTACH 'file:/check_xfer?vfs=memdb' AS xfer;
+SELECT sum(crdt_import(changeset)) > 0 FROM xfer.changesets;
+
+.testcase compact-export
+SELECT group_concat(id || '=' || json(data), ' ') FROM (SELECT id, data FROM crdt_records WHERE tbl = 'tasks' ORDER BY id);
+.check 't1={"title":"Review"} t2={"title":"Ship","done":true}'
+
+DETACH xfer;
+.connection 0
+DETACH xfer;
+
+-- A table of the crdt module writes the same changes as a view. EXPLAIN
+-- QUERY PLAN shows its plan number: bit 0x01 is id =, 0x02 to 0x10 the
+-- id ranges >, >=, < and <=, and the bits from 0x100 up the columns it
+-- reads, from id (0x100) to node_id (0x8000).
+CREATE VIRTUAL TABLE contacts USING crdt('3afeb0e0-d9a6-424b-b60d-af86c06a4799');
+
+.testcase vtab-insert
+INSERT INTO contacts (id, data) VALUES ('c1', '{"name":"Ada"}'), ('c2', '{"name":"Alan"}'), ('c3', '{"name":"Grace"}');
+SELECT group_concat(id || '=' || json, ' ') FROM contacts;
+.check 'c1={"name":"Ada"} c2={"name":"Alan"} c3={"name":"Grace"}'
+
+.testcase vtab-update
+UPDATE contacts SET data = '{"age":36}' WHERE id = 'c1';
+SELECT json FROM contacts WHERE id = 'c1';
+.check '{"name":"Ada","age":36}'
+
+.testcase vtab-delete
+DELETE FROM contacts WHERE id = 'c3';
+SELECT group_concat(id, ' '), (SELECT deleted FROM crdt_records WHERE id = 'c3') FROM contacts;
+.check 'c1 c2|1'
+
+-- Changing the id deletes the old record and writes the row to the new one
+.testcase vtab-update-id
+UPDATE contacts SET id = 'c4' WHERE id = 'c2';
+SELECT group_concat(id || '=' || json, ' '), (SELECT deleted FROM crdt_records WHERE id = 'c2') FROM contacts;
+.check 'c1={"name":"Ada","age":36} c4={"name":"Alan"}|1'
+
+.testcase vtab-plan-eq
+EXPLAIN QUERY PLAN SELECT * FROM contacts WHERE id = 'c1';
+.check "*SCAN contacts VIRTUAL TABLE INDEX 65281:*"
+
+.testcase vtab-plan-range
+EXPLAIN QUERY PLAN SELECT * FROM contacts WHERE id > 'c1' AND id <= 'c4';
+.check "*SCAN contacts VIRTUAL TABLE INDEX 65298:*"
+
+.testcase vtab-plan-columns
+EXPLAIN QUERY PLAN SELECT id, json FROM contacts WHERE id >= 'c1';
+.check "*SCAN contacts VIRTUAL TABLE INDEX 16644:*"
+
+.testcase vtab-range
+SELECT group_concat(id, ' ') FROM contacts WHERE id > 'c1' AND id <= 'c4';
+.check c4
+
+-- crdt_export streams the changes as changesets: all of them, the ones
+-- after an HLC, or split at a size in bytes. Importing them into empty
+-- databases gives the same records, the changesets go through xfer.
+ATTACH 'file:/check_export?vfs=memdb' AS xfer;
+CREATE TABLE xfer.since_hlc AS SELECT hlc FROM crdt_changes WHERE pk = 'c1' ORDER BY id LIMIT 1;
+CREATE TABLE xfer.records AS SELECT id, tbl, data, hlc, path, op FROM crdt_records;
+CREATE TABLE xfer.changes AS SELECT pk, hlc FROM crdt_changes;
+CREATE TABLE xfer.full AS SELECT changeset FROM crdt_export(NULL);
+CREATE TABLE xfer.since AS SELECT changeset FROM crdt_export((SELECT hlc FROM xfer.since_hlc));
+CREATE TABLE xfer.small AS SELECT changeset FROM crdt_export(NULL, 256);
+
+.testcase export-split
+SELECT (SELECT count(*) FROM xfer.full), (SELECT count(*) FROM xfer.small) > 1, (SELECT max(length(changeset)) FROM xfer.small) < (SELECT length(changeset) FROM xfer.full);
+.check 1|1|1
+
+.connection 2
+.load ./uuid
+.load ./hlc
+.load ./crdt
+SELECT crdt_create('0b9a4f3c-2d1e-4f5a-8b7c-6d5e4f3a2b1c');
+ATTACH 'file:/check_export?vfs=memdb' AS xfer;
+
+.testcase export-import
+SELECT sum(crdt_import(changeset)) = (SELECT count(*) FROM xfer.changes) FROM xfer.full;
+SELECT (SELECT count(*) FROM (SELECT id, tbl, data, hlc, path, op FROM crdt_records EXCEPT SELECT * FROM xfer.records)), (SELECT count(*) FROM (SELECT * FROM xfer.records EXCEPT SELECT id, tbl, data, hlc, path, op FROM crdt_records));
+.check "1\n0|0\n"
+
+.connection 3
+.load ./uuid
+.load ./hlc
+.load ./crdt
+SELECT crdt_create('0b9a4f3c-2d1e-4f5a-8b7c-6d5e4f3a2b1c');
+ATTACH 'file:/check_export?vfs=memdb' AS xfer;
+
+-- Only the changes after since_hlc, the first insert into contacts
+.testcase export-since
+SELECT sum(crdt_import(changeset)) FROM xfer.since;
+SELECT group_concat(pk || op, ' '), (SELECT count(*) FROM xfer.changes WHERE hlc_compare(hlc, (SELECT hlc FROM xfer.since_hlc)) > 0) FROM (SELECT pk, op FROM crdt_changes ORDER BY hlc);
+.check "6\nc2= c3= c1patch c3= c2= c4=|6\n"
+
+.connection 4
+.load ./uuid
+.load ./hlc
+.load ./crdt
+SELECT crdt_create('0b9a4f3c-2d1e-4f5a-8b7c-6d5e4f3a2b1c');
+ATTACH 'file:/check_export?vfs=memdb' AS xfer;
+
+.testcase export-import-split
+SELECT sum(crdt_import(changeset)) = (SELECT count(*) FROM xfer.changes) FROM xfer.small;
+SELECT (SELECT count(*) FROM (SELECT id, tbl, data, hlc, path, op FROM crdt_records EXCEPT SELECT * FROM xfer.records)), (SELECT count(*) FROM (SELECT * FROM xfer.records EXCEPT SELECT id, tbl, data, hlc, path, op FROM crdt_records));
+.check "1\n0|0\n"
+
+-- crdt_changes_since moves the watermark of a peer only once a read
+-- returns its last row, a read stopped by a LIMIT leaves it where it was
+-- and crdt_ack moves it to the last change the peer got, never back
+.connection 0
+
+.testcase since-full
+SELECT count(*) = (SELECT count(*) FROM crdt_changes) FROM crdt_changes_since('p3');
+SELECT value = (SELECT max(id) FROM crdt_changes) FROM crdt_kv WHERE key = 'watermark:p3';
+.check "1\n1\n"
+
+INSERT INTO contacts (id, data) VALUES ('c5', '{"name":"Barbara"}'), ('c6', '{"name":"Donald"}');
+CREATE TEMP TABLE watermark AS SELECT value FROM crdt_kv WHERE key = 'watermark:p3';
+
+.testcase since-limit
+SELECT pk FROM crdt_changes_since('p3') LIMIT 1;
+SELECT value = (SELECT value FROM watermark) FROM crdt_kv WHERE key = 'watermark:p3';
+.check "c5\n1\n"
+
+.testcase since-ack
+SELECT crdt_ack('p3', (SELECT id FROM crdt_changes WHERE pk = 'c5'));
+SELECT crdt_ack('p3', (SELECT value FROM watermark));
+SELECT group_concat(pk, ' ') FROM crdt_changes_since('p3');
+.check "1\n0\nc6\n"
+
+.testcase since-after-ack
+SELECT count(*) FROM crdt_changes_since('p3');
+.check 0
+
+-- With the counters option '+' and '-' writes log this node's running
+-- totals as a 'pn' change, [increments, decrements]. The counter is the sum
+-- over the nodes, each keeping its largest totals, so a remote node's
+-- increments add up however often they arrive.
+SELECT crdt_create_table('posts', '3afeb0e0-d9a6-424b-b60d-af86c06a4799', 'counters');
+INSERT INTO posts (id, data) VALUES ('post1', '{"title":"Hello","likes":0}');
+
+.testcase pn-local
+UPDATE posts SET data = '3', op = '+', path = '$.likes', hlc = NULL WHERE id = 'post1';
+UPDATE posts SET data = '1', op = '-', path = '$.likes', hlc = NULL WHERE id = 'post1';
+SELECT json_extract(data, '$.likes'), (SELECT group_concat(op || ' ' || json_extract(data, '$[0]') || '/' || json_extract(data, '$[1]'), ', ') FROM (SELECT op, data FROM crdt_changes WHERE pk = 'post1' AND path = '$.likes' ORDER BY id)) FROM posts;
+.check '2|pn 3/0, pn 3/1'
+
+.testcase pn-remote
+SELECT crdt_apply_changes('[{"pk":"post1","tbl":"posts","data":[5,1],"path":"$.likes","op":"pn","hlc":"2024-06-15T12:35:00.000-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60"}]');
+SELECT json_extract(data, '$.likes') FROM posts;
+.check "1\n6\n"
+
+-- Again, and older totals with a newer HLC: the largest totals stay
+.testcase pn-remote-again
+SELECT crdt_apply_changes('[{"pk":"post1","tbl":"posts","data":[5,1],"path":"$.likes","op":"pn","hlc":"2024-06-15T12:35:00.000-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60"},{"pk":"post1","tbl":"posts","data":[4,0],"path":"$.likes","op":"pn","hlc":"2024-06-15T12:36:00.000-0000-7c1e5f0a-8b2d-4c3e-9f4a-1b2c3d4e5f60"}]');
+SELECT json_extract(data, '$.likes') FROM posts;
+.check "2\n6\n"
+
+-- A later write of the whole record keeps the counter
+.testcase pn-overwrite
+UPDATE posts SET data = '{"title":"Hello again","likes":0}', op = '=', hlc = NULL WHERE id = 'post1';
+UPDATE posts SET data = '1', op = '+', path = '$.likes', hlc = NULL WHERE id = 'post1';
+SELECT json(data) FROM posts;
+.check '{"title":"Hello again","likes":7}'
@@ -11,9 +11,11 @@
 ******************************************************************************
 **
 ** This SQLite extension implements functions that handling RFC-4122 UUIDs
-** Three SQL functions are implemented:
+** Five SQL functions are implemented:
 **
 **     uuid()        - generate a version 4 UUID as a string
+**     uuid7()       - generate a version 7 UUID as a string
+**     uuid7_blob()  - generate a version 7 UUID as a 16-byte blob
 **     uuid_str(X)   - convert a UUID X into a well-formed UUID string
 **     uuid_blob(X)  - convert a UUID X into a 16-byte blob
 **
@@ -57,6 +59,20 @@
 **
 ** If the X input string has too few or too many digits or contains
 ** stray characters other than {, }, or -, then NULL is returned.
+**
+** A version 7 UUID (RFC 9562) starts with a 48-bit Unix timestamp in
+** milliseconds followed by a 12-bit sequence number, so UUIDs generated
+** one after the other sort in the order they were made and land next to
+** each other in an index, where random version 4 UUIDs land on a random
+** page each.  The sequence starts at a random value below 0x800 each
+** millisecond and counts up within it; after 0xfff it moves on to the
+** next millisecond.  The UUIDs from one database connection are strictly
+** increasing, even if the clock steps back.  The remaining 62 bits are
+** random.
+**
+** The random bytes of uuid(), uuid7() and uuid7_blob() are drawn from
+** sqlite3_randomness() UUID_POOL bytes at a time per connection, instead
+** of taking its mutex once per UUID.
 */
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
@@ -159,6 +175,69 @@ static const unsigned char *sqlite3UuidInputToBlob(
   }
 }
 
+/*
+** Random bytes and the last version 7 UUID of a database connection,
+** shared by uuid(), uuid7() and uuid7_blob().
+*/
+#ifndef UUID_POOL
+# define UUID_POOL 512
+#endif
+typedef struct UuidState UuidState;
+struct UuidState {
+  int nRef;                       /* Functions using this state */
+  int iPool;                      /* Next unused byte of aPool[] */
+  sqlite3_vfs *pVfs;              /* Clock of uuid7() */
+  sqlite3_int64 iLastMs;          /* Timestamp of the last uuid7() */
+  unsigned int iSeq;              /* Sequence number of the last uuid7() */
+  unsigned char aPool[UUID_POOL]; /* Random bytes from sqlite3_randomness() */
+};
+
+/* Drop a reference to p, the xDestroy of the functions that use it */
+static void sqlite3UuidStateRelease(void *p){
+  UuidState *pState = (UuidState*)p;
+  if( --pState->nRef==0 ) sqlite3_free(pState);
+}
+
+/* Copy n random bytes, n<=UUID_POOL, from the pool into aOut */
+static void sqlite3UuidRandomness(UuidState *p, int n, unsigned char *aOut){
+  if( p->iPool+n>UUID_POOL ){
+    sqlite3_randomness(UUID_POOL, p->aPool);
+    p->iPool = 0;
+  }
+  memcpy(aOut, &p->aPool[p->iPool], n);
+  p->iPool += n;
+}
+
+/* Fill aBlob with the next version 7 UUID of the connection */
+static void sqlite3Uuid7Generate(UuidState *p, unsigned char *aBlob){
+  sqlite3_int64 iMs = 0;
+  int i;
+  if( p->pVfs->iVersion>=2 && p->pVfs->xCurrentTimeInt64 ){
+    p->pVfs->xCurrentTimeInt64(p->pVfs, &iMs);
+  }else{
+    double r = 0.0;
+    p->pVfs->xCurrentTime(p->pVfs, &r);
+    iMs = (sqlite3_int64)(r*86400000.0);
+  }
+  iMs -= 210866760000000LL;  /* Julian day number to Unix epoch, in ms */
+  if( iMs>p->iLastMs ){
+    unsigned char aSeq[2];
+    sqlite3UuidRandomness(p, 2, aSeq);
+    p->iLastMs = iMs;
+    p->iSeq = ((aSeq[0]<<8) | aSeq[1]) & 0x7ff;
+  }else if( ++p->iSeq>0xfff ){
+    p->iLastMs++;
+    p->iSeq = 0;
+  }
+  for(i=0; i<6; i++){
+    aBlob[i] = (unsigned char)(p->iLastMs>>(40-8*i));
+  }
+  aBlob[6] = (unsigned char)(0x70 + (p->iSeq>>8));
+  aBlob[7] = (unsigned char)(p->iSeq & 0xff);
+  sqlite3UuidRandomness(p, 8, &aBlob[8]);
+  aBlob[8] = (aBlob[8]&0x3f) + 0x80;
+}
+
 /* Implementation of uuid() */
 static void sqlite3UuidFunc(
   sqlite3_context *context,
@@ -169,13 +248,41 @@ static void sqlite3UuidFunc(
   unsigned char zStr[37];
   (void)argc;
   (void)argv;
-  sqlite3_randomness(16, aBlob);
+  sqlite3UuidRandomness((UuidState*)sqlite3_user_data(context), 16, aBlob);
   aBlob[6] = (aBlob[6]&0x0f) + 0x40;
   aBlob[8] = (aBlob[8]&0x3f) + 0x80;
   sqlite3UuidBlobToStr(aBlob, zStr);
   sqlite3_result_text(context, (char*)zStr, 36, SQLITE_TRANSIENT);
 }
 
+/* Implementation of uuid7() */
+static void sqlite3Uuid7Func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  unsigned char aBlob[16];
+  unsigned char zStr[37];
+  (void)argc;
+  (void)argv;
+  sqlite3Uuid7Generate((UuidState*)sqlite3_user_data(context), aBlob);
+  sqlite3UuidBlobToStr(aBlob, zStr);
+  sqlite3_result_text(context, (char*)zStr, 36, SQLITE_TRANSIENT);
+}
+
+/* Implementation of uuid7_blob() */
+static void sqlite3Uuid7BlobFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  unsigned char aBlob[16];
+  (void)argc;
+  (void)argv;
+  sqlite3Uuid7Generate((UuidState*)sqlite3_user_data(context), aBlob);
+  sqlite3_result_blob(context, aBlob, 16, SQLITE_TRANSIENT);
+}
+
 /* Implementation of uuid_str() */
 static void sqlite3UuidStrFunc(
   sqlite3_context *context,
@@ -215,10 +322,36 @@ int sqlite3_uuid_init(
   const sqlite3_api_routines *pApi
 ){
   int rc = SQLITE_OK;
+  UuidState *pState;
   SQLITE_EXTENSION_INIT2(pApi);
   (void)pzErrMsg;  /* Unused parameter */
-  rc = sqlite3_create_function(db, "uuid", 0, SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
-                               sqlite3UuidFunc, 0, 0);
+  pState = (UuidState*)sqlite3_malloc(sizeof(*pState));
+  if( pState==0 ) return SQLITE_NOMEM;
+  memset(pState, 0, sizeof(*pState));
+  pState->iPool = UUID_POOL;
+  pState->pVfs = sqlite3_vfs_find(0);
+  if( pState->pVfs==0 ){
+    sqlite3_free(pState);
+    return SQLITE_ERROR;
+  }
+  /* One reference until the functions are registered and one for each,
+  ** which sqlite3_create_function_v2() drops itself if it fails */
+  pState->nRef = 2;
+  rc = sqlite3_create_function_v2(db, "uuid", 0, SQLITE_UTF8|SQLITE_INNOCUOUS,
+                       pState, sqlite3UuidFunc, 0, 0, sqlite3UuidStateRelease);
+  if( rc==SQLITE_OK ){
+    pState->nRef++;
+    rc = sqlite3_create_function_v2(db, "uuid7", 0, SQLITE_UTF8|SQLITE_INNOCUOUS,
+                       pState, sqlite3Uuid7Func, 0, 0, sqlite3UuidStateRelease);
+  }
+  if( rc==SQLITE_OK ){
+    pState->nRef++;
+    rc = sqlite3_create_function_v2(db, "uuid7_blob", 0,
+                       SQLITE_UTF8|SQLITE_INNOCUOUS,
+                       pState, sqlite3Uuid7BlobFunc, 0, 0,
+                       sqlite3UuidStateRelease);
+  }
+  sqlite3UuidStateRelease(pState);
   if( rc==SQLITE_OK ){
     rc = sqlite3_create_function(db, "uuid_str", 1, 
                        SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,